@@ -0,0 +1,302 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     autotune.c
+ *
+ * Purpose:  Find the fastest way to run a grid on this machine: time short
+ *           runs of every backend over its thread counts, rank x thread
+ *           splits, -N and (omp-tasks) bands per thread, and remember the
+ *           best settings of each backend in the tuning cache
+ *
+ * Run:      ./autotune [-n <iters>] [-r <reps>] [-p <max cpus>] [-b <backends>] [-m <mpirun>] <in file>
+ *
+ *           -n: iterations of each trial run (default 5)
+ *           -r: runs per setting, the fastest counts (default 2)
+ *           -p: most threads/ranks to try (default: online cpus)
+ *           -b: comma separated subset of serial,pth,omp,omp-tasks,mpi,hybrid
+ *           -m: MPI launcher (default $STENCIL_MPIRUN, else "mpirun")
+ *
+ * Input:    Binary file with stencil matrix, the shape to tune for
+ *
+ * Output:   A table of the trials, the best setting of each backend and
+ *           overall, and the tuning cache ($STENCIL_TUNE_CACHE or
+ *           ~/.stencil-tune), which stencil-2d-pth/-omp/-omp-tasks/-hybrid read
+ *           when they are run without -p
+ *
+ * Errors:   Usage errors and file permission errors
+ *
+ * Notes:    Trials run the stencil programs next to this binary in a
+ *           scratch directory and read the work time they append to their
+ *           *Time.csv, so file reading and startup are not counted. Each
+ *           backend is first tuned for its thread/rank counts, then -N is
+ *           tried on the winner, then for omp-tasks the -k values in
+ *           TUNE_BANDS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include "utilities.c"
+
+#define MAX_COUNTS 32
+
+// omp-tasks bands per thread (-k) to try on the best thread count and -N
+static const int TUNE_BANDS[] = { 1, 2, 4, 8, 16, 32 };
+#define NUM_TUNE_BANDS ((int) (sizeof(TUNE_BANDS) / sizeof(TUNE_BANDS[0])))
+
+typedef struct {
+    const char *backend;     // serial, pth, omp, omp-tasks, mpi, hybrid
+    const char *program;     // binary running it
+    const char *csv;         // timing file it appends to
+    int mpi;                 // launched through mpirun
+} backend_t;
+
+static const backend_t backends[] = {
+    { "serial",    "stencil-2d",           "serialTime.csv",   0 },
+    { "pth",       "stencil-2d-pth",       "pthTime.csv",      0 },
+    { "omp",       "stencil-2d-omp",       "ompTime.csv",      0 },
+    { "omp-tasks", "stencil-2d-omp-tasks", "ompTasksTime.csv", 0 },
+    { "mpi",       "stencil-2d-mpi",       "mpiTime.csv",      1 },
+    { "hybrid",    "stencil-2d-hybrid",    "hybridTime.csv",   1 },
+};
+#define NUM_BACKENDS ((int) (sizeof(backends) / sizeof(backends[0])))
+
+static char bindir[PATH_MAX];
+static char input[PATH_MAX];
+static const char *mpirun;
+static int iters = 5, reps = 2;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-n <iters>] [-r <reps>] [-p <max cpus>] [-b <backends>] [-m <mpirun>] <in file>\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Last_work_time
+ * Purpose:    Work time column of the last line of a driver's timing file
+ * Returns:    the time, or -1 if there is none
+ */
+static double Last_work_time(const char *csv) {
+    char line[512], last[512] = "";
+    double work;
+    FILE *f = fopen(csv, "r");
+    if (f == NULL)
+        return -1.0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        strcpy(last, line);
+    fclose(f);
+
+    if (sscanf(last, "%*d,%*d,%*d,%*f,%lf", &work) != 1)
+        return -1.0;
+    return work;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Run_trial
+ * Purpose:    Time one setting, best of reps runs
+ * In args:    b: the backend, np: ranks (MPI backends), p: threads, nt: -N,
+ *             k: -k (0: the driver's default)
+ * Returns:    the work time in seconds, or -1 if the run failed
+ */
+static double Run_trial(const backend_t *b, int np, int p, int nt, int k) {
+    char cmd[3 * PATH_MAX + 256], threads[32] = "", bands[32] = "", launch[PATH_MAX + 64] = "";
+    double best = -1.0;
+
+    if (strcmp(b->backend, "pth") == 0 || strcmp(b->backend, "omp") == 0 ||
+        strcmp(b->backend, "omp-tasks") == 0 || strcmp(b->backend, "hybrid") == 0)
+        snprintf(threads, sizeof(threads), "-p %d", p);
+    if (k > 0)
+        snprintf(bands, sizeof(bands), "-k %d", k);
+    if (b->mpi)
+        snprintf(launch, sizeof(launch), "%s -np %d ", mpirun, np);
+    snprintf(cmd, sizeof(cmd), "%s%s/%s -n %d -i '%s' -o /dev/null %s %s %s > /dev/null 2>&1",
+             launch, bindir, b->program, iters, input, threads, nt ? "-N" : "", bands);
+
+    for (int r = 0; r < reps; r++) {
+        remove(b->csv);
+        if (system(cmd) != 0)
+            return -1.0;
+        double t = Last_work_time(b->csv);
+        if (t < 0.0)
+            return -1.0;
+        if (best < 0.0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   In_list
+ * Returns:    1 if name is one of the comma separated entries of list
+ */
+static int In_list(const char *list, const char *name) {
+    char *copy = strdup(list), *save = NULL;
+    int found = 0;
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL && !found; tok = strtok_r(NULL, ",", &save))
+        found = strcmp(tok, name) == 0;
+    free(copy);
+    return found;
+}
+
+
+static void Report_trial(const backend_t *b, int np, int p, int nt, int k, double t) {
+    char bands[16] = "";
+    if (k > 0)
+        snprintf(bands, sizeof(bands), " k=%d", k);
+    if (t < 0.0) {
+        printf("%-9s np=%-3d p=%-3d N=%d%s  failed\n", b->backend, np, p, nt, bands);
+    } else {
+        printf("%-9s np=%-3d p=%-3d N=%d%s  %.6f s\n", b->backend, np, p, nt, bands, t);
+    }
+    fflush(stdout);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tune_backend
+ * Purpose:    Try every thread/rank setting of one backend, then -N on
+ *             the fastest, then (omp-tasks) every -k in TUNE_BANDS
+ * In args:    b, counts: the thread/rank counts to try, ncounts, max_cpus
+ * Out arg:    best: the fastest setting (seconds < 0 if nothing ran)
+ */
+static void Tune_backend(const backend_t *b, const int *counts, int ncounts, int max_cpus, tune_entry_t *best) {
+    best->seconds = -1.0;
+    best->k = 0;
+    snprintf(best->backend, sizeof(best->backend), "%s", b->backend);
+
+    int serial = strcmp(b->backend, "serial") == 0;
+    int hybrid = strcmp(b->backend, "hybrid") == 0;
+    int tasks = strcmp(b->backend, "omp-tasks") == 0;
+
+    for (int i = 0; i < (serial ? 1 : ncounts); i++) {
+        for (int j = 0; j < (hybrid ? ncounts : 1); j++) {
+            int np = b->mpi ? counts[i] : 1;
+            int p = hybrid ? counts[j] : (b->mpi || serial ? 1 : counts[i]);
+            if (hybrid && np * p > max_cpus)
+                continue;
+
+            double t = Run_trial(b, np, p, 0, 0);
+            Report_trial(b, np, p, 0, 0, t);
+            if (t >= 0.0 && (best->seconds < 0.0 || t < best->seconds)) {
+                best->np = np;
+                best->p = p;
+                best->nt = 0;
+                best->seconds = t;
+            }
+        }
+    }
+
+    if (best->seconds < 0.0)
+        return;
+    double t = Run_trial(b, best->np, best->p, 1, 0);
+    Report_trial(b, best->np, best->p, 1, 0, t);
+    if (t >= 0.0 && t < best->seconds) {
+        best->nt = 1;
+        best->seconds = t;
+    }
+
+    // The runs so far used the driver's default -k, which stays the
+    // setting (k = 0) unless another one beats it
+    for (int i = 0; tasks && i < NUM_TUNE_BANDS; i++) {
+        t = Run_trial(b, best->np, best->p, best->nt, TUNE_BANDS[i]);
+        Report_trial(b, best->np, best->p, best->nt, TUNE_BANDS[i], t);
+        if (t >= 0.0 && t < best->seconds) {
+            best->k = TUNE_BANDS[i];
+            best->seconds = t;
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int max_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char *list = "serial,pth,omp,omp-tasks,mpi,hybrid";
+    int opt;
+
+    mpirun = getenv("STENCIL_MPIRUN") != NULL ? getenv("STENCIL_MPIRUN") : "mpirun";
+
+    while ((opt = getopt(argc, argv, "n:r:p:b:m:")) != -1) {
+        switch (opt) {
+            case 'n': iters = atoi(optarg); break;
+            case 'r': reps = atoi(optarg); break;
+            case 'p': max_cpus = atoi(optarg); break;
+            case 'b': list = optarg; break;
+            case 'm': mpirun = optarg; break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1 || iters < 1 || reps < 1 || max_cpus < 1) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    // Trials run in a scratch directory, so everything else needs a full path
+    char self[PATH_MAX];
+    if (realpath(argv[optind], input) == NULL || realpath(argv[0], self) == NULL) {
+        fprintf(stderr, "Error: Unable to resolve '%s'.\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(bindir, sizeof(bindir), "%.*s", (int) (strrchr(self, '/') - self), self);
+
+    int rows, cols;
+    Read_matrix_dims(input, &rows, &cols);
+
+    char scratch[] = "/tmp/autotune.XXXXXX";
+    if (mkdtemp(scratch) == NULL || chdir(scratch) != 0) {
+        fprintf(stderr, "Error: Unable to create a scratch directory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 1, 2, 4, ... up to max_cpus, and max_cpus itself
+    int counts[MAX_COUNTS], ncounts = 0;
+    for (int c = 1; c < max_cpus && ncounts < MAX_COUNTS - 1; c *= 2)
+        counts[ncounts++] = c;
+    counts[ncounts++] = max_cpus;
+
+    printf("tuning %dx%d, %d iterations, up to %d cpus\n", rows, cols, iters, max_cpus);
+
+    tune_entry_t overall = { .seconds = -1.0 };
+    for (int k = 0; k < NUM_BACKENDS; k++) {
+        const backend_t *b = &backends[k];
+        if (!In_list(list, b->backend))
+            continue;
+
+        tune_entry_t best;
+        Tune_backend(b, counts, ncounts, max_cpus, &best);
+        if (best.seconds < 0.0)
+            continue;
+
+        best.rows = rows;
+        best.cols = cols;
+        Tune_store(&best);
+        if (overall.seconds < 0.0 || best.seconds < overall.seconds)
+            overall = best;
+    }
+
+    for (int k = 0; k < NUM_BACKENDS; k++)
+        remove(backends[k].csv);
+    if (chdir("/") == 0)
+        rmdir(scratch);
+
+    if (overall.seconds < 0.0) {
+        fprintf(stderr, "Error: No trial ran successfully.\n");
+        return EXIT_FAILURE;
+    }
+    printf("best: %s np=%d p=%d N=%d", overall.backend, overall.np, overall.p, overall.nt);
+    if (overall.k > 0)
+        printf(" k=%d", overall.k);
+    printf("  %.6f s\n", overall.seconds);
+    return 0;
+}
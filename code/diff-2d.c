@@ -0,0 +1,195 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     diff-2d.c
+ *
+ * Purpose:  Compare two matrix files, e.g. the outputs of two backends, and
+ *           report how far apart they are
+ *
+ * Run:      ./diff-2d [-a <abs tol>] [-r <rel tol>] [-q] [-p <threads>] <file A> <file B>
+ *
+ *           -a, -r: a cell is over tolerance when its absolute error is
+ *               above -a and its relative error is above -r (default 0 0:
+ *               any difference counts)
+ *           -q: stop at the first cell over tolerance
+ *           -p: number of threads
+ *
+ * Input:    Two binary matrix files (raw or tiled) of the same shape
+ *
+ * Output:   Max absolute and relative error, max ULP distance, the worst
+ *           cell and the number of cells over tolerance
+ *
+ * Errors:   Exit status 0 when the files agree within tolerance, 1 when
+ *           they don't (or differ in shape), 2 for usage and file errors
+ *
+ * Notes:    Both files are mmapped and read once, sequentially, in chunks
+ *           that each thread reduces with SIMD, so comparing two large
+ *           outputs runs at about the speed of reading them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <omp.h>
+#include "utilities.c"
+
+#define DIFF_CHUNK 4096     // cells per SIMD chunk
+
+typedef struct {
+    double max_abs, max_rel;
+    uint64_t max_ulp;
+    size_t worst;            // cell with the largest absolute error
+    size_t over;             // cells over tolerance
+} diff_t;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-a <abs tol>] [-r <rel tol>] [-q] [-p <threads>] <file A> <file B>\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Ordered
+ * Purpose:    Map a double's bits onto integers that are ordered like the
+ *             doubles, so that neighbours differ by one (ULP distance)
+ */
+static inline int64_t Ordered(double v) {
+    union { double d; int64_t i; } u = { v };
+    return u.i < 0 ? INT64_MIN - u.i : u.i;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Diff_chunk
+ * Purpose:    Compare cells [lo, hi) and fold them into d
+ * Returns:    the number of cells over tolerance in the chunk
+ */
+static size_t Diff_chunk(const double *A, const double *B, size_t lo, size_t hi, double atol, double rtol, diff_t *d) {
+    double max_abs = 0.0, max_rel = 0.0;
+    uint64_t max_ulp = 0;
+    size_t over = 0;
+
+    #pragma omp simd reduction(max:max_abs, max_rel, max_ulp) reduction(+:over)
+    for (size_t k = lo; k < hi; k++) {
+        double a = A[k], b = B[k];
+        double err = fabs(a - b);
+        double scale = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+        double rel = scale > 0.0 ? err / scale : 0.0;
+        int64_t ia = Ordered(a), ib = Ordered(b);
+        uint64_t ulp = ia > ib ? (uint64_t) ia - (uint64_t) ib : (uint64_t) ib - (uint64_t) ia;
+
+        max_abs = err > max_abs ? err : max_abs;
+        max_rel = rel > max_rel ? rel : max_rel;
+        max_ulp = ulp > max_ulp ? ulp : max_ulp;
+        // Branch-free so the loop vectorizes; a NaN on one side only counts
+        over += ((err > atol) & (rel > rtol)) | ((a != a) ^ (b != b));
+    }
+
+    // Only look for the location when this chunk holds a new worst cell
+    if (max_abs > d->max_abs) {
+        for (size_t k = lo; k < hi; k++) {
+            if (fabs(A[k] - B[k]) == max_abs) {
+                d->worst = k;
+                break;
+            }
+        }
+        d->max_abs = max_abs;
+    }
+    d->max_rel = fmax(d->max_rel, max_rel);
+    d->max_ulp = max_ulp > d->max_ulp ? max_ulp : d->max_ulp;
+    d->over += over;
+    return over;
+}
+
+
+int main(int argc, char **argv) {
+    double atol = 0.0, rtol = 0.0;
+    int quick = 0, opt;
+
+    while ((opt = getopt(argc, argv, "a:r:qp:")) != -1) {
+        switch (opt) {
+            case 'a':
+                atol = atof(optarg);
+                break;
+            case 'r':
+                rtol = atof(optarg);
+                break;
+            case 'q':
+                quick = 1;
+                break;
+            case 'p':
+                omp_set_num_threads(atoi(optarg));
+                break;
+            default:
+                usage(argv);
+                exit(2);
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv);
+        exit(2);
+    }
+
+    int rowsA, colsA, rowsB, colsB;
+    size_t bytesA, bytesB;
+    Read_matrix_dims(argv[optind], &rowsA, &colsA);
+    Read_matrix_dims(argv[optind + 1], &rowsB, &colsB);
+    if (rowsA != rowsB || colsA != colsB) {
+        printf("shape differs: %dx%d vs %dx%d\n", rowsA, colsA, rowsB, colsB);
+        return 1;
+    }
+
+    double *A = Map_matrix(argv[optind], &rowsA, &colsA, &bytesA);
+    double *B = Map_matrix(argv[optind + 1], &rowsB, &colsB, &bytesB);
+    posix_madvise((int*) A - 2, bytesA, POSIX_MADV_SEQUENTIAL);
+    posix_madvise((int*) B - 2, bytesB, POSIX_MADV_SEQUENTIAL);
+
+    size_t count = (size_t) rowsA * colsA;
+    size_t nchunks = CEILING(count, DIFF_CHUNK);
+    diff_t total = { 0.0, 0.0, 0, 0, 0 };
+    int stop = 0;
+
+    #pragma omp parallel
+    {
+        diff_t mine = { 0.0, 0.0, 0, 0, 0 };
+
+        #pragma omp for schedule(static, 16)
+        for (size_t c = 0; c < nchunks; c++) {
+            int done;
+            #pragma omp atomic read
+            done = stop;
+            if (done)
+                continue;
+
+            size_t lo = c * DIFF_CHUNK, hi = MIN(lo + DIFF_CHUNK, count);
+            if (Diff_chunk(A, B, lo, hi, atol, rtol, &mine) > 0 && quick) {
+                #pragma omp atomic write
+                stop = 1;
+            }
+        }
+
+        #pragma omp critical
+        {
+            if (mine.max_abs > total.max_abs || (mine.max_abs == total.max_abs && mine.worst < total.worst && mine.max_abs > 0.0)) {
+                total.max_abs = mine.max_abs;
+                total.worst = mine.worst;
+            }
+            total.max_rel = fmax(total.max_rel, mine.max_rel);
+            total.max_ulp = mine.max_ulp > total.max_ulp ? mine.max_ulp : total.max_ulp;
+            total.over += mine.over;
+        }
+    }
+
+    size_t wr = total.worst / colsA, wc = total.worst % colsA;
+    printf("cells: %zu (%dx%d)%s\n", count, rowsA, colsA, stop ? ", stopped at the first cell over tolerance" : "");
+    printf("max abs error: %.6e at (%zu, %zu): %.17g vs %.17g\n", total.max_abs, wr, wc, A[total.worst], B[total.worst]);
+    printf("max rel error: %.6e\n", total.max_rel);
+    printf("max ulp distance: %llu\n", (unsigned long long) total.max_ulp);
+    printf("over tolerance (abs %g, rel %g): %zu\n", atol, rtol, total.over);
+
+    Unmap_matrix(A, bytesA);
+    Unmap_matrix(B, bytesB);
+    return total.over > 0 ? 1 : 0;
+}
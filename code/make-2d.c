@@ -1,69 +1,171 @@
-/* 
+/*
  * Authors:   Justin LaForge, Kyle Wallace
  * File:     make-2d.c
- * Purpose:  create a stencil matrix with 1's on 
- * Run:      ./make-2d <file A> <size n>
+ * Purpose:  create a stencil matrix with 1's on
+ * Run:      ./make-2d [-p threads] [-l left] [-r right] [-t top] [-b bottom] [-c interior] <file A> <rows> [cols]
  * Input:    file A, the output matrix
- *           size n, the size of the output matrix (nxn)
- * Output:   an n by n stencil matrix with 1's on the left and right sides and 0's everywhere else
- * Errors:   Usage errors and file permission errors; 
+ *           rows, cols: the size of the output matrix (rows x rows if cols is omitted)
+ *           -p: number of writer threads (default: online cpus)
+ *           -l/-r/-t/-b: left/right/top/bottom boundary values (default 1, 1, 0, 0)
+ *           -c: initial value of the interior cells (default 0)
+ *           A file name ending in .t2d is written in the compressed tiled format.
+ * Output:   a rows by cols stencil matrix with 1's on the left and right sides and 0's everywhere else
+ * Errors:   Usage errors and file permission errors;
+ *
+ * Notes:    The grid is never held in memory. Each thread fills its band of
+ *           rows a few MB at a time and pwrites it into place. Rows whose
+ *           interior is 0 only get their two boundary cells written, the
+ *           rest of the file is left as a sparse hole that reads back as 0.
  * -------------------------------------------------------------------*/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include "utilities.c"
 
+#define BAND_BYTES (4 << 20)   // size of each thread's fill buffer
+
+typedef struct {
+    int id, num_threads;
+    int fd;
+    int m, n;
+    const stencil_bc_t *bc;
+} make_arg_t;
+
+
+/*-------------------------------------------------------------------
+ * Function:   Write_cell
+ * Purpose:    pwrite one cell, skipping zeros that the hole already holds
+ */
+static void Write_cell(int fd, double v, off_t offset) {
+    if (v != 0.0 && pwrite(fd, &v, sizeof(double), offset) != (ssize_t) sizeof(double)) {
+        fprintf(stderr, "Error: Failed to write matrix data.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   make_worker
+ * Purpose:    Write this thread's band of rows straight into the file
+ */
+void* make_worker(void *arg) {
+    make_arg_t *a = (make_arg_t*) arg;
+    int m = a->m, n = a->n;
+    int lo = BLOCK_LOW(a->id, a->num_threads, m);
+    int hi = BLOCK_HIGH(a->id, a->num_threads, m) + 1;
+    off_t row_bytes = (off_t) n * sizeof(double);
+    off_t base = 2 * sizeof(int);
+
+    int band = BAND_BYTES / row_bytes > 0 ? BAND_BYTES / row_bytes : 1;
+    double *buf = malloc((size_t) band * n * sizeof(double));
+    if (buf == NULL) {
+        fprintf(stderr, "Can't allocate storage\n");
+        exit(-1);
+    }
+
+    int i = lo;
+    while (i < hi) {
+        double fill = i == 0 ? a->bc->top : (i == m - 1 ? a->bc->bottom : a->bc->interior);
+
+        if (fill == 0.0) {
+            // Zero interior: only the boundary cells need to reach the disk
+            off_t row = base + (off_t) i * row_bytes;
+            Write_cell(a->fd, a->bc->left, row);
+            if (n > 1) Write_cell(a->fd, a->bc->right, row + row_bytes - (off_t) sizeof(double));
+            i++;
+            continue;
+        }
+
+        int end = MIN(i + band, hi);
+        Fill_stencil_rows(buf, i, end, m, n, a->bc);
+        size_t bytes = (size_t)(end - i) * row_bytes;
+        if (pwrite(a->fd, buf, bytes, base + (off_t) i * row_bytes) != (ssize_t) bytes) {
+            fprintf(stderr, "Error: Failed to write matrix data.\n");
+            exit(EXIT_FAILURE);
+        }
+        i = end;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+
+void usage(char **argv) {
+    printf("usage: %s [-p threads] [-l left] [-r right] [-t top] [-b bottom] [-c interior] <file A> <rows> [cols]\n", argv[0]);
+}
+
+
 int main(int argc, char** argv){
+    stencil_bc_t bc = STENCIL_BC_DEFAULT;
+    int num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:l:r:t:b:c:")) != -1) {
+        switch (opt) {
+            case 'p': num_threads = atoi(optarg); break;
+            case 'l': bc.left = atof(optarg); break;
+            case 'r': bc.right = atof(optarg); break;
+            case 't': bc.top = atof(optarg); break;
+            case 'b': bc.bottom = atof(optarg); break;
+            case 'c': bc.interior = atof(optarg); break;
+            default:
+                usage(argv);
+                exit(0);
+        }
+    }
+
     // Usage statement
-    if(argc != 3){
-        printf("usage: %s <file A> <size n>\n", argv[0]);
+    if (argc - optind != 2 && argc - optind != 3) {
+        usage(argv);
         exit(0);
     }
 
     // Initiate values
-    double* A = NULL;
-    int m = atoi(argv[2]);
-    int n = atoi(argv[2]);
- 
-    char *file_name = argv[1];
- 
-    
-    A = malloc(m*n*sizeof(double));
-    if (A == NULL) {
-       fprintf(stderr, "Can't allocate storage\n");
-       exit(-1);
+    char *file_name = argv[optind];
+    int m = atoi(argv[optind + 1]);
+    int n = argc - optind == 3 ? atoi(argv[optind + 2]) : m;
+    if (m <= 0 || n <= 0) {
+        fprintf(stderr, "Error: Invalid matrix dimensions.\n");
+        return EXIT_FAILURE;
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > m) num_threads = m;
+
+    // *.t2d: generate compressed tiles instead of a raw grid
+    if (Is_tiled_name(file_name)) {
+        Tiled_write(file_name, NULL, m, n, n, &bc);
+        return 0;
     }
-    Create_stencil("A", A, m, n);
- 
-     // Writing matrix to binary file
-     FILE *file = fopen(file_name, "wb");
-     if (!file) {
-         fprintf(stderr, "Error: Unable to open file for writing.\n");
-         free(A);
-         return EXIT_FAILURE;
-     }
- 
-     // Write the dimensions
-     if (fwrite(&m, sizeof(int), 1, file) != 1 || fwrite(&n, sizeof(int), 1, file) != 1) {
-         fprintf(stderr, "Error: Failed to write matrix dimensions.\n");
-         fclose(file);
-         free(A);
-         return EXIT_FAILURE;
-     }
- 
-     // Write the matrix data
-     if (fwrite(A, sizeof(double), m * n, file) != (size_t)(m * n)) {
-         fprintf(stderr, "Error: Failed to write matrix data.\n");
-         fclose(file);
-         free(A);
-         return EXIT_FAILURE;
-     }
- 
-     fclose(file);
- 
- 
-    free(A);
+
+    int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to open file for writing.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Write the dimensions and size the file; untouched ranges stay sparse
+    int header[2] = { m, n };
+    if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        ftruncate(fd, (off_t) sizeof(header) + (off_t) m * n * (off_t) sizeof(double)) != 0) {
+        fprintf(stderr, "Error: Failed to write matrix dimensions.\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    // Write the matrix data, one band of rows per thread
+    pthread_t threads[num_threads];
+    make_arg_t args[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        args[t] = (make_arg_t){ .id = t, .num_threads = num_threads, .fd = fd, .m = m, .n = n, .bc = &bc };
+        pthread_create(&threads[t], NULL, make_worker, &args[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    close(fd);
     return 0;
  }  /* main */
- 
\ No newline at end of file
@@ -1,41 +1,211 @@
-/* 
+ /*
  * Author:   Justin LaForge Kyle Wallace
- * 
+ *
  * File:     print-2d.c
  *
- * Purpose:  Print matrix to screen in a nice formatted way. 
+ * Purpose:  Print matrix to screen in a nice formatted way, or inspect
+ *           multi-gigabyte matrices without printing every cell.
+ *
+ * Run:      ./print-2d [-s] [-H <bins>] [-w <r0,c0,r1,c1>] [-d <stride>] [-p <threads>] <file_name>
  *
- * Run:      ./print_matrix <file_name>
+ *           -s: summary statistics (min/max/mean and a checksum)
+ *           -H: histogram of the values with <bins> equal bins over [min, max]
+ *           -w: print only the window [r0,r1) x [c0,c1)
+ *           -d: print only every <stride>-th row and column
+ *           -p: number of threads for the reductions
+ *           With no options the whole matrix is printed, as before.
  *
  * Input:    Binary file for matrix to be printed
- * 
- * Output:   Nicely formatted mxn matrix
+ *
+ * Output:   Nicely formatted mxn matrix, statistics and/or histogram
  *
  * Errors:   Usage errors and file permission errors
+ *
+ * Notes:    The file is mmapped, so printing a window or a strided view
+ *           only touches the pages holding those cells.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <omp.h>
 #include "utilities.c"
 
 
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-s] [-H <bins>] [-w <r0,c0,r1,c1>] [-d <stride>] [-p <threads>] <binary_file>\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Mix64
+ * Purpose:    splitmix64 finalizer, scrambles one cell for the checksum
+ */
+static inline uint64_t Mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Matrix_stats
+ * Purpose:    Parallel SIMD min/max/sum and a checksum summing the mixed
+ *             (bit pattern, position) of every cell (order independent, so
+ *             any thread count gives the same value)
+ * In args:    A: the matrix, count: the number of cells
+ * Out args:   mn, mx, mean, checksum
+ */
+void Matrix_stats(const double *A, size_t count, double *mn, double *mx, double *mean, uint64_t *checksum) {
+    double lo = A[0], hi = A[0], sum = 0.0;
+    uint64_t ck = 0;
+
+    #pragma omp parallel for simd reduction(min:lo) reduction(max:hi) reduction(+:sum,ck) schedule(static)
+    for (size_t k = 0; k < count; k++) {
+        double v = A[k];
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+        sum += v;
+        ck += Mix64(bits ^ ((uint64_t) k * 0x9e3779b97f4a7c15ULL));
+    }
+
+    *mn = lo;
+    *mx = hi;
+    *mean = sum / (double) count;
+    *checksum = ck;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Matrix_histogram
+ * Purpose:    Count values into bins equal-width bins over [mn, mx]
+ * In args:    A: the matrix, count: the number of cells, bins, mn, mx
+ * Out arg:    hist: bins counters
+ */
+void Matrix_histogram(const double *A, size_t count, int bins, double mn, double mx, size_t *hist) {
+    double scale = mx > mn ? bins / (mx - mn) : 0.0;
+
+    for (int b = 0; b < bins; b++)
+        hist[b] = 0;
+
+    #pragma omp parallel for reduction(+:hist[:bins]) schedule(static)
+    for (size_t k = 0; k < count; k++) {
+        int b = (int) ((A[k] - mn) * scale);
+        if (b >= bins) b = bins - 1;
+        if (b < 0) b = 0;
+        hist[b]++;
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Print_view
+ * Purpose:    Print the cells of [r0,r1) x [c0,c1) keeping every stride-th
+ *             row and column, touching only those cells
+ */
+void Print_view(const double *A, int cols, int r0, int c0, int r1, int c1, int stride) {
+    for (int i = r0; i < r1; i += stride) {
+        const double *row = A + (size_t) i * cols;
+        for (int j = c0; j < c1; j += stride) {
+            printf("%6.2f ", row[j]);
+        }
+        printf("\n");
+    }
+}
+
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <binary_file>\n", argv[0]);
+    int stats = 0, bins = 0, stride = 1, window = 0;
+    int r0 = 0, c0 = 0, r1 = 0, c1 = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sH:w:d:p:")) != -1) {
+        switch (opt) {
+            case 's':
+                stats = 1;
+                break;
+            case 'H':
+                bins = atoi(optarg);
+                break;
+            case 'w':
+                if (sscanf(optarg, "%d,%d,%d,%d", &r0, &c0, &r1, &c1) != 4) {
+                    usage(argv);
+                    exit(0);
+                }
+                window = 1;
+                break;
+            case 'd':
+                stride = atoi(optarg);
+                break;
+            case 'p':
+                omp_set_num_threads(atoi(optarg));
+                break;
+            default:
+                usage(argv);
+                exit(0);
+        }
+    }
+    if (optind != argc - 1 || stride < 1 || bins < 0) {
+        usage(argv);
         exit(0);
     }
-    double *matrix;
+
     int rows, cols;
+    size_t map_bytes;
+    char *file_name = argv[optind];
+    double *matrix = Map_matrix(file_name, &rows, &cols, &map_bytes);
+    size_t count = (size_t) rows * cols;
+
+    if (!window) {
+        r1 = rows;
+        c1 = cols;
+    }
+    if (r0 < 0 || c0 < 0 || r1 > rows || c1 > cols || r0 >= r1 || c0 >= c1) {
+        fprintf(stderr, "Error: Window %d,%d,%d,%d is outside the %dx%d matrix.\n", r0, c0, r1, c1, rows, cols);
+        exit(EXIT_FAILURE);
+    }
 
-    char *file_name = argv[1];
+    // Print the matrix (or the requested part of it)
+    if (window || stride > 1 || (!stats && bins == 0)) {
+        if (window || stride > 1)
+            posix_madvise((int*) matrix - 2, map_bytes, POSIX_MADV_RANDOM);
+        Print_view(matrix, cols, r0, c0, r1, c1, stride);
+    }
+
+    if (stats || bins > 0) {
+        double mn, mx, mean;
+        uint64_t checksum;
+
+        posix_madvise((int*) matrix - 2, map_bytes, POSIX_MADV_SEQUENTIAL);
+        Matrix_stats(matrix, count, &mn, &mx, &mean, &checksum);
 
-    Read_matrix(file_name, &matrix, &rows, &cols);
+        if (stats) {
+            printf("rows: %d cols: %d\n", rows, cols);
+            printf("min: %.6f max: %.6f mean: %.6f\n", mn, mx, mean);
+            printf("checksum: %016llx\n", (unsigned long long) checksum);
+        }
+
+        if (bins > 0) {
+            size_t *hist = malloc(bins * sizeof(size_t));
+            if (hist == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            Matrix_histogram(matrix, count, bins, mn, mx, hist);
+            for (int b = 0; b < bins; b++) {
+                printf("[%10.6f, %10.6f) %zu\n", mn + (mx - mn) * b / bins, mn + (mx - mn) * (b + 1) / bins, hist[b]);
+            }
+            free(hist);
+        }
+    }
 
-    
-    // Print the matrix
-    Print_matrix(matrix, rows, cols);
-    
-    free(matrix);
+    Unmap_matrix(matrix, map_bytes);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,205 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     query-2d.c
+ *
+ * Purpose:  Answer "what is the temperature here after n iterations" for a
+ *           few probe points or small windows without running (or even
+ *           reading) the whole grid
+ *
+ * Run:      ./query-2d -n <iters> [-q <r,c>]... [-w <r0,c0,r1,c1>]... [-p <threads>] [-v] <in file>
+ *
+ *           -n: iterations
+ *           -q: probe the cell (r, c); may be repeated
+ *           -w: the window [r0,r1) x [c0,c1); may be repeated
+ *           -p: threads, queries are answered in parallel
+ *           -v: report the size of each dependency cone and the work saved
+ *
+ * Input:    Binary file with stencil matrix (raw or tiled)
+ *
+ * Output:   "r,c: value" for each probe, the cells of each window, in the
+ *           order given
+ *
+ * Errors:   Usage errors and file permission errors
+ *
+ * Notes:    After n iterations a cell depends only on the cells within n
+ *           rows and columns of it, so each query reads just that cone
+ *           (window + 2n on each side, clipped to the grid) and sweeps it n
+ *           times, the valid part shrinking by one cell per side each
+ *           sweep. Edges of the cone that lie on the grid's boundary stay
+ *           fixed, as in the full run, so the answer is bit-identical.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <omp.h>
+#include "utilities.c"
+
+typedef struct {
+    int r0, c0, r1, c1;      // the window, half open
+    int probe;               // given with -q
+    double *values;          // (r1 - r0) x (c1 - c0) results
+    int cone_rows, cone_cols;
+    double updates;          // cell updates spent
+} query_t;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s -n <iters> [-q <r,c>]... [-w <r0,c0,r1,c1>]... [-p <threads>] [-v] <in file>\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Run_query
+ * Purpose:    Read the dependency cone of one window and sweep it n times
+ * In args:    file_name, rows, cols: the grid, n: iterations
+ * In/out:     q: the query, values and work filled in
+ */
+void Run_query(char *file_name, int rows, int cols, int n, query_t *q) {
+    int R0 = MAX(q->r0 - n, 0), R1 = MIN(q->r1 + n, rows);
+    int C0 = MAX(q->c0 - n, 0), C1 = MIN(q->c1 + n, cols);
+    size_t pitch = Grid_pitch(C1 - C0);
+    size_t count = (size_t)(R1 - R0) * pitch;
+
+    double *A = Alloc_grid(count);
+    double *B = Alloc_grid(count);
+    Read_matrix_window(file_name, R0, C0, R1, C1, A, pitch);
+    memcpy(B, A, count * sizeof(double));
+
+    q->cone_rows = R1 - R0;
+    q->cone_cols = C1 - C0;
+    q->updates = 0.0;
+
+    for (int k = 1; k <= n; k++) {
+        // Cells still valid after k sweeps; grid edges never move
+        int ilo = R0 > 0 ? R0 + k : 1, ihi = R1 < rows ? R1 - k : rows - 1;
+        int jlo = C0 > 0 ? C0 + k : 1, jhi = C1 < cols ? C1 - k : cols - 1;
+        if (ihi <= ilo || jhi <= jlo)
+            break;
+
+        for (size_t i = ilo - R0; i < (size_t)(ihi - R0); i++) {
+            Stencil_row(A + (i - 1) * pitch, A + i * pitch, A + (i + 1) * pitch,
+                        B + i * pitch, jlo - C0, jhi - C0, 0);
+        }
+        q->updates += (double)(ihi - ilo) * (jhi - jlo);
+
+        double *temp = A;
+        A = B;
+        B = temp;
+    }
+
+    size_t width = (size_t)(q->c1 - q->c0);
+    for (int i = q->r0; i < q->r1; i++)
+        memcpy(q->values + (size_t)(i - q->r0) * width, A + (size_t)(i - R0) * pitch + (q->c0 - C0), width * sizeof(double));
+
+    Free_grid(A, count);
+    Free_grid(B, count);
+}
+
+
+int main(int argc, char **argv) {
+    int n = -1, verbose = 0, nq = 0, opt;
+    query_t *queries = malloc(argc * sizeof(query_t));
+    if (queries == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((opt = getopt(argc, argv, "n:q:w:p:v")) != -1) {
+        query_t *q = &queries[nq];
+        switch (opt) {
+            case 'n':
+                n = atoi(optarg);
+                break;
+            case 'q':
+                if (sscanf(optarg, "%d,%d", &q->r0, &q->c0) != 2) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                q->r1 = q->r0 + 1;
+                q->c1 = q->c0 + 1;
+                q->probe = 1;
+                nq++;
+                break;
+            case 'w':
+                if (sscanf(optarg, "%d,%d,%d,%d", &q->r0, &q->c0, &q->r1, &q->c1) != 4) {
+                    usage(argv);
+                    exit(EXIT_FAILURE);
+                }
+                q->probe = 0;
+                nq++;
+                break;
+            case 'p':
+                omp_set_num_threads(atoi(optarg));
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1 || n < 0 || nq == 0) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    char *file_name = argv[optind];
+    int rows, cols;
+    Read_matrix_dims(file_name, &rows, &cols);
+
+    for (int k = 0; k < nq; k++) {
+        query_t *q = &queries[k];
+        if (q->r0 < 0 || q->c0 < 0 || q->r1 > rows || q->c1 > cols || q->r0 >= q->r1 || q->c0 >= q->c1) {
+            fprintf(stderr, "Error: Query %d,%d,%d,%d is outside the %dx%d matrix.\n", q->r0, q->c0, q->r1, q->c1, rows, cols);
+            exit(EXIT_FAILURE);
+        }
+        q->values = malloc((size_t)(q->r1 - q->r0) * (q->c1 - q->c0) * sizeof(double));
+        if (q->values == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start, finish;
+    GET_TIME(start);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nq; k++)
+        Run_query(file_name, rows, cols, n, &queries[k]);
+
+    GET_TIME(finish);
+
+    double updates = 0.0;
+    for (int k = 0; k < nq; k++) {
+        query_t *q = &queries[k];
+        size_t width = (size_t)(q->c1 - q->c0);
+        if (q->probe) {
+            printf("%d,%d: %.6f\n", q->r0, q->c0, q->values[0]);
+        } else {
+            printf("window %d,%d,%d,%d:\n", q->r0, q->c0, q->r1, q->c1);
+            for (int i = 0; i < q->r1 - q->r0; i++) {
+                for (size_t j = 0; j < width; j++)
+                    printf("%6.2f ", q->values[i * width + j]);
+                printf("\n");
+            }
+        }
+        if (verbose)
+            fprintf(stderr, "query %d: cone %dx%d, %.0f cell updates\n", k, q->cone_rows, q->cone_cols, q->updates);
+        updates += q->updates;
+        free(q->values);
+    }
+
+    if (verbose) {
+        double full = (double)(rows - 2) * (cols - 2) * n;
+        fprintf(stderr, "%.0f cell updates in %.6f s, %.1fx fewer than the full %dx%d run\n",
+                updates, finish - start, updates > 0.0 ? full / updates : 0.0, rows, cols);
+    }
+
+    free(queries);
+    return 0;
+}
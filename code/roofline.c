@@ -0,0 +1,158 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     roofline.c
+ *
+ * Purpose:  Measure this machine's sustainable memory bandwidth and peak
+ *           floating point throughput, the two limits of the roofline
+ *           model, so the stencil drivers can report how close they get
+ *
+ * Run:      ./roofline [-p <max threads>] [-m <MB per array>] [-r <repeats>]
+ *
+ *           -p: calibrate 1, 2, 4, ... up to this many threads (default:
+ *               OpenMP's default)
+ *           -m: size of each triad array (default 256 MB, well past the
+ *               last level cache)
+ *           -r: repeats, the best is kept (default 10)
+ *
+ * Output:   A table of GB/s and GFLOP/s per thread count, also stored for
+ *           this host in $STENCIL_ROOFLINE (else ~/.stencil-roofline)
+ *
+ * Errors:   Usage errors and file permission errors
+ *
+ * Notes:    Bandwidth is the STREAM triad a[i] = b[i] + s * c[i], counted
+ *           as STREAM does (24 bytes per element). Peak is 64 independent
+ *           FMA chains per thread, enough to keep both FMA units of
+ *           current cores busy. Run it on an otherwise idle node,
+ *           with the same thread pinning as the runs it will judge.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <omp.h>
+#include "utilities.c"
+
+#define ROOF_LANES 8            // SIMD lanes x 8 accumulators = independent FMA chains
+#define ROOF_FMA_ITERS 2000000  // FMAs per chain per repeat
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-p <max threads>] [-m <MB per array>] [-r <repeats>]\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Triad_gbs
+ * Purpose:    Best STREAM triad bandwidth over reps, on threads threads
+ * In args:    a, b, c: arrays of len doubles, first touched by the same
+ *             static schedule so their pages sit near the threads using them
+ */
+double Triad_gbs(double *a, const double *b, const double *c, size_t len, int threads, int reps) {
+    double best = 1e30;
+    const double s = 3.0;
+
+    for (int r = 0; r < reps; r++) {
+        double start = omp_get_wtime();
+        #pragma omp parallel for simd schedule(static) num_threads(threads)
+        for (size_t i = 0; i < len; i++)
+            a[i] = b[i] + s * c[i];
+        best = MIN(best, omp_get_wtime() - start);
+    }
+    return 3.0 * sizeof(double) * len / best / 1e9;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Peak_gflops
+ * Purpose:    Best FMA throughput over reps, on threads threads
+ */
+double Peak_gflops(int threads, int reps) {
+    double best = 1e30, sink = 0.0;
+
+    for (int r = 0; r < reps; r++) {
+        double start = omp_get_wtime();
+        #pragma omp parallel num_threads(threads) reduction(+:sink)
+        {
+            // Each of the 8 accumulators becomes its own vector register
+            // chain once the lanes are vectorized
+            double m = 0.999999, a = 1e-6 * (omp_get_thread_num() + 1);
+
+            #pragma omp simd reduction(+:sink)
+            for (int j = 0; j < ROOF_LANES; j++) {
+                double x0 = j, x1 = j + 1, x2 = j + 2, x3 = j + 3;
+                double x4 = j + 4, x5 = j + 5, x6 = j + 6, x7 = j + 7;
+                for (long k = 0; k < ROOF_FMA_ITERS; k++) {
+                    x0 = fma(x0, m, a); x1 = fma(x1, m, a); x2 = fma(x2, m, a); x3 = fma(x3, m, a);
+                    x4 = fma(x4, m, a); x5 = fma(x5, m, a); x6 = fma(x6, m, a); x7 = fma(x7, m, a);
+                }
+                sink += x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7;
+            }
+        }
+        best = MIN(best, omp_get_wtime() - start);
+    }
+
+    // Keeps the chains from being optimized away
+    if (sink == 42.0)
+        printf("%f\n", sink);
+    return 2.0 * 8 * ROOF_LANES * ROOF_FMA_ITERS * threads / best / 1e9;
+}
+
+
+int main(int argc, char **argv) {
+    int maxThreads = omp_get_max_threads(), reps = 10, opt;
+    size_t mb = 256;
+
+    while ((opt = getopt(argc, argv, "p:m:r:")) != -1) {
+        switch (opt) {
+            case 'p':
+                maxThreads = atoi(optarg);
+                break;
+            case 'm':
+                mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc || maxThreads < 1 || mb < 1 || reps < 1) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t len = mb * 1024 * 1024 / sizeof(double);
+    double *a = Alloc_grid(len);
+    double *b = Alloc_grid(len);
+    double *c = Alloc_grid(len);
+
+    #pragma omp parallel for schedule(static) num_threads(maxThreads)
+    for (size_t i = 0; i < len; i++) {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+
+    printf("threads  triad GB/s  peak GFLOP/s  balance flop/B\n");
+    for (int t = 1; ; t = MIN(2 * t, maxThreads)) {
+        roofline_t r;
+        r.threads = t;
+        r.gbs = Triad_gbs(a, b, c, len, t, reps);
+        r.gflops = Peak_gflops(t, reps);
+        Roofline_store(&r);
+        printf("%7d  %10.2f  %12.2f  %14.2f\n", t, r.gbs, r.gflops, r.gflops / r.gbs);
+
+        if (t == maxThreads)
+            break;
+    }
+
+    Free_grid(a, len);
+    Free_grid(b, len);
+    Free_grid(c, len);
+    return 0;
+}
@@ -35,18 +35,18 @@ MPI_FILE="mpiTime.csv"
 HYBRID_FILE="hybridTime.csv"
 
 # Ensure the CSV files have headers
-echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime," > $SERIAL_FILE
-echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors" > $PTHREADS_FILE
-echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors" > $OMP_FILE
-echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors" > $MPI_FILE
-echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors" > $HYBRID_FILE
+echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors, WorkEnergy, OverallEnergy, WorkPower, JoulesPerCell" > $SERIAL_FILE
+echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors, WorkEnergy, OverallEnergy, WorkPower, JoulesPerCell" > $PTHREADS_FILE
+echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors, WorkEnergy, OverallEnergy, WorkPower, JoulesPerCell" > $OMP_FILE
+echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors, WorkEnergy, OverallEnergy, WorkPower, JoulesPerCell" > $MPI_FILE
+echo "Iterations, Rows, Cols, OverallTime, WorkTime, DiffTime, Processors, WorkEnergy, OverallEnergy, WorkPower, JoulesPerCell" > $HYBRID_FILE
 
 # Compile files
 make
 
 # Loop over matrix sizes and thread counts
 for C in "${C_values[@]}"; do
-    ./make-2d A.bin $C
+    ./make-2d -p $SLURM_CPUS_PER_TASK A.bin $C
 
     echo "Running serial version for C=$C with N=${N_values} iterations."
     ./stencil-2d -n $N_values -i A.bin -o C.bin
@@ -0,0 +1,235 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     stencil-2d-batch.c
+ *
+ * Purpose:  Run many stencil simulations in one process, for parameter
+ *           studies over small and medium grids
+ *
+ * Run:      ./stencil-2d-batch [-p <threads>] [-N] <manifest>
+ *
+ *           -p: threads in the shared pool (default: OpenMP's default)
+ *           -N: write the new grids with non-temporal (streaming) stores
+ *
+ * Input:    A manifest with one job per line, "<in file> <iters> <out file>".
+ *           Blank lines and lines starting with # are skipped.
+ *
+ * Output:   Every job's output file, a line per job with its time and
+ *           throughput, and the totals for the batch
+ *
+ * Errors:   Usage errors, manifest errors and file permission errors
+ *
+ * Notes:    All jobs run as OpenMP tasks in one thread team, created
+ *           largest first. A grid under BATCH_SPLIT_CELLS runs on a single
+ *           thread, so many small grids run side by side instead of each
+ *           one being spread thinly over every core. Larger grids split
+ *           each sweep into taskloop chunks of about BATCH_TASK_CELLS
+ *           cells, which the idle threads of the same team pick up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <omp.h>
+#include "utilities.c"
+
+#define BATCH_SPLIT_CELLS (1 << 20)   // grids this size and up are split
+#define BATCH_TASK_CELLS  (1 << 16)   // cells per taskloop chunk
+
+typedef struct {
+    char in[PATH_MAX];
+    char out[PATH_MAX];
+    int n;
+    int rows, cols;
+    int split;               // sweeps split into taskloop chunks
+    double work;             // seconds in the sweeps
+    double total;            // seconds including read and write
+} job_t;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-p <threads>] [-N] <manifest>\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Read_manifest
+ * Purpose:    Parse the job list
+ * In args:    file_name: the manifest
+ * Out arg:    njobs: number of jobs
+ * Returns:    the jobs, in manifest order
+ */
+job_t* Read_manifest(char *file_name, int *njobs) {
+    char line[2 * PATH_MAX + 64];
+    int cap = 16, count = 0, lineno = 0;
+    job_t *jobs = malloc(cap * sizeof(job_t));
+    FILE *f = fopen(file_name, "r");
+    if (f == NULL || jobs == NULL) {
+        fprintf(stderr, "Error: Unable to read manifest '%s'.\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char first;
+        lineno++;
+        if (sscanf(line, " %c", &first) != 1 || first == '#')
+            continue;
+
+        if (count == cap) {
+            cap *= 2;
+            jobs = realloc(jobs, cap * sizeof(job_t));
+            if (jobs == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        job_t *j = &jobs[count];
+        memset(j, 0, sizeof(*j));
+        if (sscanf(line, "%4095s %d %4095s", j->in, &j->n, j->out) != 3 || j->n < 0) {
+            fprintf(stderr, "Error: %s:%d: expected \"<in file> <iters> <out file>\".\n", file_name, lineno);
+            exit(EXIT_FAILURE);
+        }
+        Read_matrix_dims(j->in, &j->rows, &j->cols);
+        count++;
+    }
+    fclose(f);
+
+    *njobs = count;
+    return jobs;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Run_job
+ * Purpose:    Read, simulate and write one job, from inside a task
+ * In args:    nt: non-temporal stores
+ * In/out:     j: the job, its size and times are filled in
+ */
+void Run_job(job_t *j, int nt) {
+    double start = omp_get_wtime();
+    grid_t grid, newGrid;
+
+    Read_grid(j->in, &grid);
+    Grid_alloc(&newGrid, grid.rows, grid.cols);
+    memcpy(newGrid.data, grid.data, (size_t) grid.rows * grid.pitch * sizeof(double));
+
+    double *matrix = grid.data, *newMatrix = newGrid.data;
+    size_t rows = grid.rows, pitch = grid.pitch;
+    int cols = grid.cols;
+    size_t grain = BATCH_TASK_CELLS / cols > 0 ? BATCH_TASK_CELLS / cols : 1;
+    j->split = rows * cols >= BATCH_SPLIT_CELLS;
+
+    double startWork = omp_get_wtime();
+    for (int o = 1; o <= j->n; o++) {
+        if (j->split) {
+            // Chunks go to whichever threads of the team are free
+            #pragma omp taskloop grainsize(grain) firstprivate(matrix, newMatrix)
+            for (size_t i = 1; i < rows - 1; i++) {
+                Stencil_row(matrix + (i - 1) * pitch, matrix + i * pitch, matrix + (i + 1) * pitch,
+                            newMatrix + i * pitch, 1, cols - 1, nt);
+            }
+        } else {
+            for (size_t i = 1; i < rows - 1; i++) {
+                Stencil_row(matrix + (i - 1) * pitch, matrix + i * pitch, matrix + (i + 1) * pitch,
+                            newMatrix + i * pitch, 1, cols - 1, nt);
+            }
+        }
+
+        double *temp = matrix;
+        matrix = newMatrix;
+        newMatrix = temp;
+    }
+    j->work = omp_get_wtime() - startWork;
+
+    grid.data = matrix;
+    newGrid.data = newMatrix;
+    Write_grid(&grid, j->out);
+    Grid_free(&grid);
+    Grid_free(&newGrid);
+
+    j->total = omp_get_wtime() - start;
+}
+
+
+// Largest jobs (cells x iterations) first, so they don't finish last
+static job_t *sort_jobs;
+static int By_work(const void *a, const void *b) {
+    const job_t *x = &sort_jobs[*(const int*) a], *y = &sort_jobs[*(const int*) b];
+    double wx = (double) x->rows * x->cols * x->n, wy = (double) y->rows * y->cols * y->n;
+    return (wx < wy) - (wx > wy);
+}
+
+
+int main(int argc, char **argv) {
+    int nt = 0, opt;
+
+    while ((opt = getopt(argc, argv, "p:N")) != -1) {
+        switch (opt) {
+            case 'p':
+                omp_set_num_threads(atoi(optarg));
+                break;
+            case 'N':
+                nt = 1;
+                break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    int njobs;
+    job_t *jobs = Read_manifest(argv[optind], &njobs);
+    int *order = malloc((njobs > 0 ? njobs : 1) * sizeof(int));
+    if (order == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < njobs; k++)
+        order[k] = k;
+    sort_jobs = jobs;
+    qsort(order, njobs, sizeof(int), By_work);
+
+    int threads = 1;
+    double start = omp_get_wtime();
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            threads = omp_get_num_threads();
+            for (int k = 0; k < njobs; k++) {
+                job_t *j = &jobs[order[k]];
+                #pragma omp task firstprivate(j)
+                Run_job(j, nt);
+            }
+        }
+    }
+
+    double elapsed = omp_get_wtime() - start;
+
+    // Per-job and aggregate report, in manifest order
+    double updates = 0.0, work = 0.0;
+    for (int k = 0; k < njobs; k++) {
+        job_t *j = &jobs[k];
+        double cells = (double) (j->rows - 2) * (j->cols - 2) * j->n;
+        updates += cells;
+        work += j->work;
+        printf("job %d: %s %dx%d n=%d %s  work %.6f s  total %.6f s  %.2f Mcell/s\n",
+               k, j->in, j->rows, j->cols, j->n, j->split ? "split" : "single",
+               j->work, j->total, j->work > 0.0 ? cells / j->work / 1e6 : 0.0);
+    }
+    printf("batch: %d jobs on %d threads in %.6f s  %.2f jobs/s  %.2f Mcell/s  (%.6f s of job sweeps)\n",
+           njobs, threads, elapsed, njobs / elapsed, updates / elapsed / 1e6, work);
+    Roofline_report("batch", updates, 1, elapsed, threads, 1, nt);
+
+    free(order);
+    free(jobs);
+    return 0;
+}
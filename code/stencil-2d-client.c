@@ -0,0 +1,85 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     stencil-2d-client.c
+ *
+ * Purpose:  Send one command to a running stencil-2d-server
+ *
+ * Run:      ./stencil-2d-client [-S <socket>] <command> [args...]
+ *
+ *           e.g. ./stencil-2d-client load heat A.bin
+ *                ./stencil-2d-client advance heat 100
+ *                ./stencil-2d-client snapshot heat 0,0,8,8
+ *                ./stencil-2d-client write heat C.bin
+ *
+ *           -S: UNIX socket path (default $STENCIL_SOCKET, else
+ *               /tmp/stencil-2d.sock)
+ *
+ * Output:   The server's reply
+ *
+ * Errors:   Exits with 1 if the server can't be reached or replies "error"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_SOCKET "/tmp/stencil-2d.sock"
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-S <socket>] <load|advance|snapshot|write|info|free|shutdown> [args...]\n", argv[0]);
+}
+
+
+int main(int argc, char **argv) {
+    char *path = getenv("STENCIL_SOCKET") != NULL ? getenv("STENCIL_SOCKET") : SERVER_SOCKET;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+S:")) != -1) {
+        switch (opt) {
+            case 'S': path = optarg; break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: No server listening on '%s'.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // The command is the remaining words on one line
+    FILE *out = fdopen(dup(sock), "w");
+    for (int k = optind; k < argc; k++)
+        fprintf(out, "%s%s", argv[k], k + 1 < argc ? " " : "\n");
+    fclose(out);
+    shutdown(sock, SHUT_WR);
+
+    FILE *in = fdopen(sock, "r");
+    char line[4096];
+    int status = EXIT_FAILURE, first = 1;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (first)
+            status = strncmp(line, "ok", 2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        first = 0;
+        fputs(line, stdout);
+    }
+    fclose(in);
+    return status;
+}
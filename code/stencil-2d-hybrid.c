@@ -5,7 +5,36 @@
  *
  * Purpose:  Perform stencil simulation using MPI for parallization
  *
- * Run:      mpirun -np <num processors> ./stencil-2d-mpi.c -t <num iters> -i <in> -o <out> -p <num threads>
+ * Run:      mpirun -np <num processors> ./stencil-2d-mpi.c -t <num iters> -i <in> -o <out> [-p <num threads>]
+ *
+ *           -g <RxC[/rank|/thread]>: build the grid in memory, every rank
+ *           filling its own slab (no read, no scatter); /rank makes R rows
+ *           per rank, /thread R rows per thread (needs -p)
+ *           -o is optional: without it nothing is gathered or written
+ *           -u: update the output in place (see stencil-2d.c)
+ *           -a <file,every[,isotherm[,profiles]]>: in-situ analysis (see
+ *           stencil-2d.c); threads combine their accumulators in a tree,
+ *           then the ranks' results are reduced to rank 0
+ *           -s <file,every,stride[,r0,c0,r1,c1]>: stream binary snapshot frames,
+ *           each rank writing its own rows of every frame (see stencil-2d.c)
+ *           -N: write the new grid with non-temporal (streaming) stores
+ *           -b <K>: every K iterations move the slab boundaries so each rank's
+ *           rows follow its measured compute speed (see Rebalance_rows)
+ *
+ * Notes:    Each rank runs a communication thread that does the halo exchange
+ *           while the compute threads sweep the rows that don't need the
+ *           halos; the two edge rows wait until it signals completion. The
+ *           communication thread sleeps on a condition variable between
+ *           exchanges, so it doesn't take a core from the compute threads.
+ *           The compute threads are the rank's OpenMP team, started once
+ *           and reused for every sweep.
+ *           MPI is initialised with MPI_THREAD_SERIALIZED, since MPI is only
+ *           ever called by one thread at a time; the sweeps are timed with
+ *           omp_get_wtime, as MPI_Wtime would race the exchange.
+ *           Ranks are renumbered by node and socket (Topology_comm) so that
+ *           neighbouring slabs share a node. Without -p the thread count
+ *           comes from the autotune cache when it was tuned for this many
+ *           ranks, else each rank takes an equal share of its node's cores.
  *
  * Input:    Binary file with stencil matrix
  * 
@@ -24,12 +53,12 @@
  #include "utilities.c" // NOTE: Ideally, you should include "utilities.h" instead.
  
  void usage(char **argv) {
-     printf("Usage: %s -n <num iters> -i <in file> -o <out file> -p <threads>\n", argv[0]);
+     printf("Usage: %s -n <num iters> (-i <in file> | -g <RxC[/rank|/thread]>) [-o <out file>] [-p <threads>] [-s <file,every,stride[,r0,c0,r1,c1]>] [-N] [-b <K>] [-a <file,every[,isotherm[,profiles]]>] [-u]\n", argv[0]);
  }
  
- void setArgs(int argc, char **argv, int *n, char **in, char **out, int *p) {
+ void setArgs(int argc, char **argv, int *n, char **in, char **out, int *p, char **snap, int *nt, int *K, char **gen, int *update, char **ana) {
      int opt;
-     while ((opt = getopt(argc, argv, "n:i:o:p:")) != -1) {
+     while ((opt = getopt(argc, argv, "n:i:o:p:s:Nb:g:ua:")) != -1) {
          switch (opt) {
              case 'n':
                  *n = atoi(optarg);
@@ -40,53 +69,266 @@
              case 'o':
                  *out = optarg;
                  break;
+             case 's':
+                 *snap = optarg;
+                 break;
+             case 'N':
+                 *nt = 1;
+                 break;
+             case 'b':
+                 *K = atoi(optarg);
+                 break;
              case 'p':
                  *p = atoi(optarg);
                  break;
+             case 'g':
+                 *gen = optarg;
+                 break;
+             case 'u':
+                 *update = 1;
+                 break;
+             case 'a':
+                 *ana = optarg;
+                 break;
              default:
                  usage(argv);
                  exit(EXIT_FAILURE);
          }
      }
-     if (*in == NULL || *out == NULL) {
-         fprintf(stderr, "Error: Both input (-i) and output (-o) files must be specified.\n");
+     if (*in == NULL && *gen == NULL) {
+         fprintf(stderr, "Error: An input file (-i) or grid spec (-g) must be specified.\n");
          usage(argv);
          exit(EXIT_FAILURE);
      }
+     // The autotune cache is keyed by grid size, which /thread derives from p
+     if (*gen != NULL && strstr(*gen, "/thread") != NULL && *p < 1) {
+         fprintf(stderr, "Error: -g %s needs -p to size the grid.\n", *gen);
+         exit(EXIT_FAILURE);
+     }
  }
  
+
+ // Handoff between the compute threads and the communication thread.
+ // go/done count iterations: go = k means "exchange halos of buf for
+ // iteration k", done = k means those halos have arrived. Both are
+ // guarded by lock, and every change is broadcast on cond.
+ typedef struct {
+     double *buf;
+     int rank, size, cols, local_rows, n;
+     size_t pitch;
+     MPI_Comm comm;
+     int go, done;
+     pthread_mutex_t lock;
+     pthread_cond_t cond;
+ } halo_comm_t;
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Halo_signal
+  * Purpose:    Set go or done to iter and wake the other side
+  */
+ void Halo_signal(halo_comm_t *c, int *flag, int iter) {
+     pthread_mutex_lock(&c->lock);
+     *flag = iter;
+     pthread_cond_broadcast(&c->cond);
+     pthread_mutex_unlock(&c->lock);
+ }
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Halo_wait
+  * Purpose:    Sleep until go or done reaches iter
+  */
+ void Halo_wait(halo_comm_t *c, const int *flag, int iter) {
+     pthread_mutex_lock(&c->lock);
+     while (*flag < iter)
+         pthread_cond_wait(&c->cond, &c->lock);
+     pthread_mutex_unlock(&c->lock);
+ }
+
+
+ /*-------------------------------------------------------------------
+  * Function:   comm_worker
+  * Purpose:    Exchange the ghost rows of every iteration as soon as the
+  *             compute threads publish the new buffer
+  */
+ void* comm_worker(void *arg) {
+     halo_comm_t *c = (halo_comm_t*) arg;
+     size_t pitch = c->pitch;
+
+     for (int iter = 1; iter <= c->n; iter++) {
+         Halo_wait(c, &c->go, iter);
+
+         double *A = c->buf;
+         MPI_Request requests[4];
+         int req_count = 0;
+
+         if (c->rank > 0) {
+             MPI_Isend(A + pitch, c->cols, MPI_DOUBLE, c->rank - 1, 0, c->comm, &requests[req_count++]);
+             MPI_Irecv(A, c->cols, MPI_DOUBLE, c->rank - 1, 0, c->comm, &requests[req_count++]);
+         }
+         if (c->rank < c->size - 1) {
+             MPI_Isend(A + c->local_rows * pitch, c->cols, MPI_DOUBLE, c->rank + 1, 0, c->comm, &requests[req_count++]);
+             MPI_Irecv(A + (c->local_rows + 1) * pitch, c->cols, MPI_DOUBLE, c->rank + 1, 0, c->comm, &requests[req_count++]);
+         }
+         MPI_Waitall(req_count, requests, MPI_STATUSES_IGNORE);
+
+         Halo_signal(c, &c->done, iter);
+     }
+     return NULL;
+ }
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Hybrid_rows
+  * Purpose:    Update local rows [lo, hi] on the rank's OpenMP team, whole
+  *             rows per thread; a single row is split over the columns
+  * In args:    ana: fold the new rows into the threads' accumulators
+  *             (a sampled sweep), or NULL
+  */
+ void Hybrid_rows(size_t lo, size_t hi, int row_lo, int rows, int cols, size_t pitch, int nt,
+                  double *local_matrix, double *local_newMatrix, analysis_t *ana) {
+     if (lo == hi && ana != NULL) {
+         // Sampled: the row whole, on this thread and accumulator 0
+         int global_row = row_lo + (int) lo - 1;
+         if (global_row == 0 || global_row == rows - 1)
+             Analysis_fold(ana, 0, local_newMatrix + lo * pitch, global_row);
+         else
+             Stencil_row_analyze(local_matrix + (lo - 1) * pitch, local_matrix + lo * pitch, local_matrix + (lo + 1) * pitch,
+                                 local_newMatrix + lo * pitch, global_row, ana, 0);
+         return;
+     }
+
+     if (lo == hi) {
+         int global_row = row_lo + (int) lo - 1;
+         if (global_row == 0 || global_row == rows - 1)
+             return;
+         // Column blocks start on cache lines so -N stores stay aligned
+         #pragma omp parallel
+         {
+             int t = omp_get_thread_num(), p = omp_get_num_threads();
+             int lines = CEILING(cols, 8);
+             int c0 = MAX(1, 8 * BLOCK_LOW(t, p, lines)), c1 = MIN(cols - 1, 8 * BLOCK_LOW(t + 1, p, lines));
+             if (c0 < c1)
+                 Stencil_row(local_matrix + (lo - 1) * pitch, local_matrix + lo * pitch, local_matrix + (lo + 1) * pitch,
+                             local_newMatrix + lo * pitch, c0, c1, nt);
+         }
+         return;
+     }
+
+     #pragma omp parallel for schedule(static)
+     for (size_t i = lo; i <= hi; i++) {
+         int global_row = row_lo + (int) i - 1;
+         if (global_row == 0 || global_row == rows - 1) {
+             if (ana != NULL)
+                 Analysis_fold(ana, omp_get_thread_num(), local_newMatrix + i * pitch, global_row);
+             continue;
+         }
+         if (ana != NULL)
+             Stencil_row_analyze(local_matrix + (i - 1) * pitch, local_matrix + i * pitch, local_matrix + (i + 1) * pitch,
+                                 local_newMatrix + i * pitch, global_row, ana, omp_get_thread_num());
+         else
+             Stencil_row(local_matrix + (i - 1) * pitch, local_matrix + i * pitch, local_matrix + (i + 1) * pitch,
+                         local_newMatrix + i * pitch, 1, cols - 1, nt);
+     }
+ }
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Hybrid_analysis
+  * Purpose:    Combine the threads' accumulators of a sampled sweep in a
+  *             tree on the OpenMP team, then the ranks' on rank 0
+  * Notes:      Called between exchanges, while the communication thread
+  *             waits for the next go and makes no MPI calls
+  */
+ void Hybrid_analysis(analysis_t *ana, int iter, MPI_Comm comm) {
+     #pragma omp parallel
+     {
+         int t = omp_get_thread_num(), p = omp_get_num_threads();
+         for (int s = 1; s < p; s *= 2) {
+             Analysis_tree(ana, t, p, s);
+             #pragma omp barrier
+         }
+     }
+     Analysis_reduce(ana, comm);
+     Analysis_write(ana, iter);
+ }
+
+
  int main(int argc, char **argv) {
-     MPI_Init(&argc, &argv);
-     
+     int provided;
+     MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+     if (provided < MPI_THREAD_SERIALIZED) {
+         fprintf(stderr, "Error: MPI library does not provide MPI_THREAD_SERIALIZED.\n");
+         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+     }
  
+     // Ranks renumbered so that neighbouring slabs share a node/socket
+     int node_size;
+     MPI_Comm comm = Topology_comm(&node_size);
+
      int rank, size;
-     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-     MPI_Comm_size(MPI_COMM_WORLD, &size);
+     MPI_Comm_rank(comm, &rank);
+     MPI_Comm_size(comm, &size);
  
      // Timer variables
      double startOvrll = 0, finishOvrll = 0, startWork = 0, finishWork = 0;
-     MPI_Barrier(MPI_COMM_WORLD);
+     MPI_Barrier(comm);
      startOvrll = MPI_Wtime();
+
+     // Energy: one rank per node reads RAPL, rank 0 sums the nodes
+     energy_t energy;
+     double startWorkJ = 0, finishWorkJ = 0;
+     Energy_open(&energy, Energy_node_reader(comm));
  
-     int n = 1,p=1;
+     int n = 1,p=0;
      char *in = NULL;
      char *out = NULL;
+     char *snapSpec = NULL;
+     int nt = 0;
+     int K = 0;
+     char *genSpec = NULL;
+     int update = 0;
+     char *anaSpec = NULL;
  
      // Parse arguments
-     setArgs(argc, argv, &n, &in, &out,&p);
+     setArgs(argc, argv, &n, &in, &out, &p, &snapSpec, &nt, &K, &genSpec, &update, &anaSpec);
 
-     omp_set_num_threads(p);
- 
      double *matrix = NULL;
      int rows = 0, cols = 0;
  
-     if (rank == 0) {
+     if (genSpec != NULL) {
+         // Rank 0 only needs the whole grid to gather the result into
+         Gen_parse(genSpec, strstr(genSpec, "/thread") != NULL ? size * p : size, &rows, &cols);
+         if (rank == 0 && out != NULL)
+             matrix = Alloc_grid((size_t) rows * cols);
+     } else if (rank == 0) {
          Read_matrix(in, &matrix, &rows, &cols);
      }
  
      // Broadcast matrix dimensions
-     MPI_Bcast(&rows, 1, MPI_INT, 0, MPI_COMM_WORLD);
-     MPI_Bcast(&cols, 1, MPI_INT, 0, MPI_COMM_WORLD);
+     MPI_Bcast(&rows, 1, MPI_INT, 0, comm);
+     MPI_Bcast(&cols, 1, MPI_INT, 0, comm);
+
+     // No -p: the autotune cache if it was tuned for this many ranks,
+     // else split this node's cores between the ranks placed on it
+     if (p < 1) {
+         tune_entry_t tuned;
+         int found = 0;
+         if (rank == 0 && Tune_lookup("hybrid", rows, cols, &tuned) && tuned.np == size) {
+             p = tuned.p;
+             nt |= tuned.nt;
+             found = 1;
+         }
+         MPI_Bcast(&found, 1, MPI_INT, 0, comm);
+         MPI_Bcast(&p, 1, MPI_INT, 0, comm);
+         MPI_Bcast(&nt, 1, MPI_INT, 0, comm);
+         if (!found) {
+             p = (int) sysconf(_SC_NPROCESSORS_ONLN) / node_size;
+             if (p < 1) p = 1;
+         }
+     }
+     omp_set_num_threads(p);
  
      // Determine local rows
      int local_rows = rows / size;
@@ -94,125 +336,187 @@
      if (rank < remainder) {
          local_rows++;
      }
+     int row_lo = rank * (rows / size) + (rank < remainder ? rank : remainder);
  
-     // Allocate space for local matrix (+2 rows for halo exchange)
-     double *local_matrix = malloc((local_rows + 2) * cols * sizeof(double));
-     double *local_newMatrix = malloc((local_rows + 2) * cols * sizeof(double));
+     // Allocate space for local matrix (+2 rows for halo exchange), rows padded to pitch
+     size_t pitch = Grid_pitch(cols);
+     size_t local_count = (size_t)(local_rows + 2) * pitch;
+     double *local_matrix = Alloc_grid(local_count);
+     double *local_newMatrix = Alloc_grid(local_count);
  
-     // Scatter data
+     // Scatter data in units of whole rows, so counts stay small on 50k+ grids
+     MPI_Datatype row_type;
+     MPI_Datatype pitched_row_type;
+     MPI_Type_contiguous(cols, MPI_DOUBLE, &row_type);
+     MPI_Type_commit(&row_type);
+     MPI_Type_create_resized(row_type, 0, (MPI_Aint)(pitch * sizeof(double)), &pitched_row_type);
+     MPI_Type_commit(&pitched_row_type);
+
      int *sendcounts = malloc(size * sizeof(int));
      int *displs = malloc(size * sizeof(int));
  
      int offset = 0;
      for (int i = 0; i < size; i++) {
          int rows_i = rows / size + (i < remainder ? 1 : 0);
-         sendcounts[i] = rows_i * cols;
+         sendcounts[i] = rows_i;
          displs[i] = offset;
          offset += sendcounts[i];
      }
  
-     // Initialize local_matrix (shift by one row for halos)
-     MPI_Scatterv(matrix, sendcounts, displs, MPI_DOUBLE,
-                  local_matrix + cols, local_rows * cols, MPI_DOUBLE,
-                  0, MPI_COMM_WORLD);
+     // Initialize local_matrix (shift by one row for halos); -g: each
+     // thread fills about the rows it will sweep
+     if (genSpec != NULL) {
+         #pragma omp parallel for schedule(static)
+         for (int i = 0; i < local_rows; i++)
+             Gen_rows(local_matrix + (size_t)(i + 1) * pitch, pitch, row_lo + i, row_lo + i + 1, rows, cols);
+     } else {
+         MPI_Scatterv(matrix, sendcounts, displs, row_type,
+                      local_matrix + pitch, local_rows, pitched_row_type,
+                      0, comm);
+     }
  
      // Copy initial data
-     memcpy(local_newMatrix, local_matrix, (local_rows + 2) * cols * sizeof(double));
+     memcpy(local_newMatrix, local_matrix, local_count * sizeof(double));
+
+     // Rank 0 creates the snapshot file, then every rank streams its own rows
+     snapshot_t snapStream;
+     snapshot_t *snap = NULL;
+     if (snapSpec != NULL) {
+         snap = &snapStream;
+         if (rank == 0) Snapshot_open(snap, snapSpec, rows, cols, 1);
+         MPI_Barrier(comm);
+         if (rank != 0) Snapshot_open(snap, snapSpec, rows, cols, 0);
+     }
+
+     analysis_t anaStore;
+     analysis_t *ana = NULL;
+     if (anaSpec != NULL) {
+         ana = &anaStore;
+         Analysis_open(ana, anaSpec, rows, cols, p, rank == 0);
+     }
  
-     MPI_Barrier(MPI_COMM_WORLD);
+     MPI_Barrier(comm);
      startWork = MPI_Wtime();
+     startWorkJ = Energy_read(&energy);
+
+     Snapshot_capture(snap, 0, local_matrix + pitch, pitch, row_lo, row_lo + local_rows);
+ 
+     // Communication thread for the halo exchange
+     halo_comm_t halo = { .rank = rank, .size = size, .cols = cols, .local_rows = local_rows,
+                          .n = n, .pitch = pitch, .comm = comm, .go = 0, .done = 0 };
+     pthread_mutex_init(&halo.lock, NULL);
+     pthread_cond_init(&halo.cond, NULL);
+     pthread_t comm_thread;
+     pthread_create(&comm_thread, NULL, comm_worker, &halo);
+
+     // One stats page per rank, tagged with rank 0's pid as the job
+     int job = (int) getpid();
+     MPI_Bcast(&job, 1, MPI_INT, 0, comm);
+     stats_page_t *stats = Stats_open("hybrid", genSpec != NULL ? genSpec : in, rows, cols, n, rank, size, job, 1);
  
+     double work = 0.0;
+
      // Stencil iterations
      for (int iter = 0; iter < n; iter++) {
-         MPI_Request requests[4];
-         int req_count = 0;
- 
-         // Exchange ghost rows
-         if (rank > 0) {
-             MPI_Isend(local_matrix + cols, cols, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-             MPI_Irecv(local_matrix, cols, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-         }
-         if (rank < size - 1) {
-             MPI_Isend(local_matrix + local_rows * cols, cols, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-             MPI_Irecv(local_matrix + (local_rows + 1) * cols, cols, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-         }
- 
-         MPI_Waitall(req_count, requests, MPI_STATUSES_IGNORE);
- 
-         #pragma omp parallel for
-         for (int i = 1; i <= local_rows; i++) {
-             int global_row = i - 1 + rank * (rows / size) + (rank < (rows % size) ? rank : (rows % size));
-             if (global_row == 0 || global_row == rows - 1)
-                 continue;
-         
-             pthread_t pthreads[p]; // launch p threads for each row
-             ColumnThreadData thread_data[p];
-         
-             int chunk_size = (cols - 2) / p; // split [1, cols-2] columns among p threads
-             int extra = (cols - 2) % p;
-         
-             int col_start = 1;
-         
-             for (int t = 0; t < p; t++) {
-                 int col_end = col_start + chunk_size + (t < extra ? 1 : 0);
-         
-                 thread_data[t] = (ColumnThreadData){
-                     .start_col = col_start,
-                     .end_col = col_end,
-                     .i = i,
-                     .cols = cols,
-                     .local_matrix = local_matrix,
-                     .local_newMatrix = local_newMatrix
-                 };
-         
-                 pthread_create(&pthreads[t], NULL, column_worker, &thread_data[t]);
-                 col_start = col_end;
-             }
-         
-             for (int t = 0; t < p; t++) {
-                 pthread_join(pthreads[t], NULL);
-             }
-         }
-        
+         halo.buf = local_matrix;
+         halo.local_rows = local_rows;
+         Halo_signal(&halo, &halo.go, iter + 1);
+         // Not MPI_Wtime: the communication thread may be inside MPI now
+         double t0 = omp_get_wtime();
+
+         analysis_t *sample = Analysis_due(ana, iter + 1, n) ? ana : NULL;
+         for (int t = 0; sample != NULL && t < p; t++)
+             Analysis_reset(ana, t);
+
+         // Rows 2..local_rows-1 only read our own rows, overlap them with the exchange
+         if (local_rows > 2)
+             Hybrid_rows(2, local_rows - 1, row_lo, rows, cols, pitch, nt, local_matrix, local_newMatrix, sample);
+
+         double tw = omp_get_wtime();
+         double compute = tw - t0;
+         work += compute;
+         Halo_wait(&halo, &halo.done, iter + 1);
+         t0 = omp_get_wtime();
+         double wait = t0 - tw;
+
+         Hybrid_rows(1, 1, row_lo, rows, cols, pitch, nt, local_matrix, local_newMatrix, sample);
+         if (local_rows > 1)
+             Hybrid_rows(local_rows, local_rows, row_lo, rows, cols, pitch, nt, local_matrix, local_newMatrix, sample);
+         double t1 = omp_get_wtime();
+         compute += t1 - t0;
+         work += t1 - t0;
+         Stats_thread(stats, 0, compute, wait);
+
+         if (sample != NULL)
+             Hybrid_analysis(ana, iter + 1, comm);
 
- 
          // Swap matrices
          double *temp = local_matrix;
          local_matrix = local_newMatrix;
          local_newMatrix = temp;
+
+         Stats_iteration(stats, iter + 1, local_matrix + pitch, local_newMatrix + pitch, local_rows, cols, pitch);
+         Snapshot_capture(snap, iter + 1, local_matrix + pitch, pitch, row_lo, row_lo + local_rows);
+
+         if (K > 0 && (iter + 1) % K == 0 && iter + 1 < n) {
+             if (Rebalance_rows(&local_matrix, &local_newMatrix, sendcounts, displs, pitch,
+                                pitched_row_type, work, iter + 1, comm)) {
+                 local_rows = sendcounts[rank];
+                 row_lo = displs[rank];
+                 local_count = (size_t)(local_rows + 2) * pitch;
+             }
+             work = 0.0;
+         }
      }
  
-     MPI_Barrier(MPI_COMM_WORLD);
+     pthread_join(comm_thread, NULL);
+     pthread_mutex_destroy(&halo.lock);
+     pthread_cond_destroy(&halo.cond);
+
+     MPI_Barrier(comm);
      finishWork = MPI_Wtime();
+     finishWorkJ = Energy_read(&energy);
+
+     Stats_close(stats);
+     Snapshot_close(snap);
+     Analysis_close(ana);
  
-     // Gather final results
-     if (rank == 0) {
-         MPI_Gatherv(local_matrix + cols, local_rows * cols, MPI_DOUBLE,
-                     matrix, sendcounts, displs, MPI_DOUBLE,
-                     0, MPI_COMM_WORLD);
-     } else {
-         MPI_Gatherv(local_matrix + cols, local_rows * cols, MPI_DOUBLE,
-                     NULL, sendcounts, displs, MPI_DOUBLE,
-                     0, MPI_COMM_WORLD);
+     // Gather final results (not needed without -o)
+     if (out != NULL && rank == 0) {
+         MPI_Gatherv(local_matrix + pitch, local_rows, pitched_row_type,
+                     matrix, sendcounts, displs, row_type,
+                     0, comm);
+     } else if (out != NULL) {
+         MPI_Gatherv(local_matrix + pitch, local_rows, pitched_row_type,
+                     NULL, sendcounts, displs, row_type,
+                     0, comm);
      }
  
      // Output results
-     if (rank == 0) {
+     if (out != NULL && rank == 0 && update) {
+         grid_t whole = { matrix, rows, cols, (size_t) cols };
+         Update_grid_file(&whole, out);
+     } else if (out != NULL && rank == 0) {
          write_memory_to_file(matrix, rows, cols, out);
      }
  
      // Cleanup
-     free(local_matrix);
-     free(local_newMatrix);
+     Free_grid(local_matrix, local_count);
+     Free_grid(local_newMatrix, local_count);
      free(sendcounts);
      free(displs);
+     MPI_Type_free(&row_type);
+     MPI_Type_free(&pitched_row_type);
  
-     if (rank == 0) {
-         free(matrix);
+     if (rank == 0 && matrix != NULL) {
+         Free_grid(matrix, (size_t) rows * cols);
      }
  
-     MPI_Barrier(MPI_COMM_WORLD);
+     MPI_Barrier(comm);
      finishOvrll = MPI_Wtime();
+     double workJ = Energy_sum(finishWorkJ - startWorkJ, comm);
+     double overallJ = Energy_sum(Energy_read(&energy), comm);
+     Energy_close(&energy);
  
      if (rank == 0) {
          double overAllTime = finishOvrll - startOvrll;
@@ -224,14 +528,21 @@
 
          FILE *timeFile = fopen("hybridTime.csv", "a");
          if (timeFile) {
-             fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d\n", n, rows, cols, overAllTime, workTime, diffTime, totalThreads);
+             fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, totalThreads);
+             Energy_fields(timeFile, workJ, overallJ, workTime, (double)(rows - 2) * (cols - 2) * n);
              fclose(timeFile);
          } else {
              fprintf(stderr, "Error: Unable to open file 'mpiTime.csv' for writing.\n");
          }
+
+         Roofline_report("hybrid", (double)(rows - 2) * (cols - 2), n, workTime,
+                         p * node_size, CEILING(size, node_size), nt);
      }
  
+     Topology_report(comm, n);
+     MPI_Comm_free(&comm);
+
      MPI_Finalize();
      return 0;
  }
- 
\ No newline at end of file
+ 
\ No newline at end of file
@@ -0,0 +1,513 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     stencil-2d-mpi-tasks.c
+ *
+ * Purpose:  Perform stencil simulation using MPI, with the rows cut into
+ *           several blocks per rank that are run as tasks
+ *
+ * Run:      mpirun -np <ranks> ./stencil-2d-mpi-tasks -n <num iters> -i <in> -o <out> [-k <blocks per rank>] [-N] [-v]
+ *
+ *           -k: blocks per rank (default TASK_BLOCKS_PER_RANK)
+ *           -g <RxC[/rank]>: build the grid in memory, every rank filling
+ *           its own rows (no read, no scatter); /rank makes R rows per rank
+ *           -o is optional: without it nothing is gathered or written
+ *           -u: update the output in place (see stencil-2d.c)
+ *           -a <file,every[,isotherm[,profiles]]>: in-situ analysis (see
+ *           stencil-2d.c); each block folds its rows into the rank's
+ *           accumulator, and the ranks' results are reduced to rank 0
+ *           -N: write the new grid with non-temporal (streaming) stores
+ *           -v: rank 0 reports how often a rank had to wait for a halo
+ *
+ * Input:    Binary file with stencil matrix
+ *
+ * Output:   Output stencil matrix binary file
+ *
+ * Errors:   Usage errors and file permission errors
+ *
+ * Notes:    Every block keeps its own two buffers with halo rows, one per
+ *           iteration parity, and counts the halos that have arrived for
+ *           the iteration it is on. A block is runnable once both of them
+ *           are in, whether the neighbour lives on this rank (its boundary
+ *           row is copied straight in) or on another (MPI_Irecv). Each
+ *           rank runs its runnable blocks, oldest iteration first, and only
+ *           blocks in MPI_Waitsome when none is, so halo messages travel
+ *           while other blocks compute and neighbouring blocks can drift an
+ *           iteration apart. Which rank owns a block comes from a table
+ *           every rank holds, so blocks could later move between ranks.
+ *           With -a, blocks stop at each sampled iteration until all of
+ *           the rank's blocks have made it, so one accumulator (and one
+ *           set of row profiles) holds one sample at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <mpi.h>
+#include "utilities.c"
+
+#define TASK_BLOCKS_PER_RANK 4
+
+typedef struct {
+    int lo, hi;              // global rows [lo, hi)
+    double *buf[2];          // by iteration parity: hi - lo rows plus a halo row above and below
+    size_t count;            // doubles in each buffer
+    int iter;                // iterations done
+    int have[2];             // halos arrived for the iteration of each parity
+    int need;                // halos per iteration: 0, 1 or 2
+    MPI_Request send[2][2];  // [parity][up/down]: boundary rows in flight
+} block_t;
+
+typedef struct {
+    int rows, cols, n, nt;
+    size_t pitch;
+    int nblocks;             // over all ranks
+    int *owner;              // rank of every block
+    int first, nlocal;       // this rank's blocks, [first, first + nlocal)
+    block_t *blocks;         // this rank's blocks
+    MPI_Request *recv;       // [local block][parity][up/down] halo receives
+    MPI_Comm comm;
+    long runs, waits;        // sweeps run, and times the rank had nothing to run
+    stats_page_t *stats;     // live stats page, or NULL
+    analysis_t *ana;         // -a, or NULL
+    int hold;                // no block sweeps past this iteration yet
+} tasks_t;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s -n <num iters> (-i <in file> | -g <RxC[/rank]>) [-o <out file>] [-k <blocks per rank>] [-N] [-v] [-a <file,every[,isotherm[,profiles]]>] [-u]\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Next_sample
+ * Returns:    the first iteration after s that -a samples; n without -a,
+ *             n + 1 after the last sample
+ */
+int Next_sample(const tasks_t *T, int s) {
+    int o = s + 1;
+    while (o < T->n && !Analysis_due(T->ana, o, T->n))
+        o++;
+    return o;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Post_recvs
+ * Purpose:    Post the receives of a block's halos from other ranks for
+ *             iteration s, into the halo rows of buffer s & 1
+ */
+void Post_recvs(tasks_t *T, int lb, int s) {
+    block_t *bk = &T->blocks[lb];
+    int b = T->first + lb, q = s & 1, nr = bk->hi - bk->lo;
+    if (s >= T->n)
+        return;
+
+    // Tag = receiving block and side, so each halo has its own stream
+    if (b > 0 && T->owner[b - 1] != T->owner[b])
+        MPI_Irecv(bk->buf[q], T->cols, MPI_DOUBLE, T->owner[b - 1], 2 * b,
+                  T->comm, &T->recv[(lb * 2 + q) * 2 + 0]);
+    if (b < T->nblocks - 1 && T->owner[b + 1] != T->owner[b])
+        MPI_Irecv(bk->buf[q] + (size_t)(nr + 1) * T->pitch, T->cols, MPI_DOUBLE, T->owner[b + 1], 2 * b + 1,
+                  T->comm, &T->recv[(lb * 2 + q) * 2 + 1]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Publish
+ * Purpose:    Hand a block's boundary rows of iteration s to its
+ *             neighbours: copied into a local neighbour's halo, sent to a
+ *             remote one
+ */
+void Publish(tasks_t *T, int lb, int s) {
+    block_t *bk = &T->blocks[lb];
+    int b = T->first + lb, q = s & 1, nr = bk->hi - bk->lo;
+    size_t pitch = T->pitch;
+    if (s >= T->n)
+        return;
+
+    if (b > 0) {
+        double *row = bk->buf[q] + pitch;
+        if (T->owner[b - 1] == T->owner[b]) {
+            block_t *nb = &T->blocks[lb - 1];
+            memcpy(nb->buf[q] + (size_t)(nb->hi - nb->lo + 1) * pitch, row, T->cols * sizeof(double));
+            nb->have[q]++;
+        } else {
+            MPI_Isend(row, T->cols, MPI_DOUBLE, T->owner[b - 1], 2 * (b - 1) + 1, T->comm, &bk->send[q][0]);
+        }
+    }
+    if (b < T->nblocks - 1) {
+        double *row = bk->buf[q] + (size_t) nr * pitch;
+        if (T->owner[b + 1] == T->owner[b]) {
+            block_t *nb = &T->blocks[lb + 1];
+            memcpy(nb->buf[q], row, T->cols * sizeof(double));
+            nb->have[q]++;
+        } else {
+            MPI_Isend(row, T->cols, MPI_DOUBLE, T->owner[b + 1], 2 * (b + 1), T->comm, &bk->send[q][1]);
+        }
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Run_block
+ * Purpose:    One sweep of a runnable block, then pass its new boundary
+ *             rows on and reuse the buffer it read from for iteration + 2
+ */
+void Run_block(tasks_t *T, int lb) {
+    block_t *bk = &T->blocks[lb];
+    int t = bk->iter, nr = bk->hi - bk->lo;
+    size_t pitch = T->pitch;
+    double *A = bk->buf[t & 1], *B = bk->buf[(t + 1) & 1];
+    int sample = T->ana != NULL && t + 1 == T->hold;
+
+    // B's boundary rows from iteration t - 1 may still be on their way out
+    MPI_Waitall(2, bk->send[(t + 1) & 1], MPI_STATUSES_IGNORE);
+
+    for (int r = 1; r <= nr; r++) {
+        int g = bk->lo + r - 1;
+        if (g == 0 || g == T->rows - 1) {
+            if (sample)
+                Analysis_fold(T->ana, 0, B + (size_t) r * pitch, g);
+            continue;
+        }
+        if (sample)
+            Stencil_row_analyze(A + (size_t)(r - 1) * pitch, A + (size_t) r * pitch, A + (size_t)(r + 1) * pitch,
+                                B + (size_t) r * pitch, g, T->ana, 0);
+        else
+            Stencil_row(A + (size_t)(r - 1) * pitch, A + (size_t) r * pitch, A + (size_t)(r + 1) * pitch,
+                        B + (size_t) r * pitch, 1, T->cols - 1, T->nt);
+    }
+
+    bk->iter = t + 1;
+    bk->have[t & 1] = 0;
+    Post_recvs(T, lb, t + 2);
+    Publish(T, lb, t + 1);
+    T->runs++;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Halo_arrived
+ * Purpose:    Count completed halo receives toward their blocks
+ */
+void Halo_arrived(tasks_t *T, int done, const int *index) {
+    if (done == MPI_UNDEFINED)
+        return;
+    for (int k = 0; k < done; k++) {
+        int lb = index[k] / 4, q = (index[k] / 2) % 2;
+        T->blocks[lb].have[q]++;
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Run_tasks
+ * Purpose:    Run this rank's blocks through n iterations
+ */
+void Run_tasks(tasks_t *T) {
+    int nreq = 4 * T->nlocal, done;
+    int *index = malloc(nreq * sizeof(int));
+    if (index == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    for (int lb = 0; lb < T->nlocal; lb++) {
+        Post_recvs(T, lb, 0);
+        Post_recvs(T, lb, 1);
+    }
+    for (int lb = 0; lb < T->nlocal; lb++)
+        Publish(T, lb, 0);
+
+    // Stats see an iteration once every local block is past it
+    int low = 0;
+    double compute = 0.0, wait = 0.0;
+
+    T->hold = Next_sample(T, 0);
+    if (T->ana != NULL)
+        Analysis_reset(T->ana, 0);
+
+    int remaining = T->n > 0 ? T->nlocal : 0;
+    while (remaining > 0) {
+        MPI_Testsome(nreq, T->recv, &done, index, MPI_STATUSES_IGNORE);
+        Halo_arrived(T, done, index);
+
+        // Oldest runnable block first, so no neighbour is kept waiting
+        int pick = -1;
+        for (int lb = 0; lb < T->nlocal; lb++) {
+            block_t *bk = &T->blocks[lb];
+            if (bk->iter < T->hold && bk->have[bk->iter & 1] == bk->need &&
+                (pick < 0 || bk->iter < T->blocks[pick].iter))
+                pick = lb;
+        }
+
+        if (pick < 0) {
+            T->waits++;
+            double t0 = MPI_Wtime();
+            MPI_Waitsome(nreq, T->recv, &done, index, MPI_STATUSES_IGNORE);
+            wait += MPI_Wtime() - t0;
+            Halo_arrived(T, done, index);
+            continue;
+        }
+
+        double t0 = MPI_Wtime();
+        Run_block(T, pick);
+        compute += MPI_Wtime() - t0;
+        if (T->blocks[pick].iter == T->n)
+            remaining--;
+
+        int oldest = T->n;
+        for (int lb = 0; lb < T->nlocal; lb++)
+            oldest = MIN(oldest, T->blocks[lb].iter);
+        if (T->stats != NULL && oldest > low) {
+            low = oldest;
+            Stats_thread(T->stats, 0, compute, wait);
+            Stats_iteration(T->stats, low, NULL, NULL, 0, 0, 0);
+            compute = wait = 0.0;
+        }
+
+        // Every local block has made the sample: combine it over the ranks
+        // and let the blocks go on. The other ranks' blocks only need halos
+        // that are already sent, so the reduction can't deadlock.
+        if (T->ana != NULL && oldest == T->hold) {
+            Analysis_reduce(T->ana, T->comm);
+            Analysis_write(T->ana, T->hold);
+            Analysis_reset(T->ana, 0);
+            T->hold = Next_sample(T, T->hold);
+        }
+    }
+
+    for (int lb = 0; lb < T->nlocal; lb++)
+        MPI_Waitall(4, &T->blocks[lb].send[0][0], MPI_STATUSES_IGNORE);
+    free(index);
+}
+
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+
+    // Ranks renumbered so that neighbouring blocks share a node/socket
+    int node_size;
+    MPI_Comm comm = Topology_comm(&node_size);
+
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    double startOvrll = 0, finishOvrll = 0, startWork = 0, finishWork = 0;
+    MPI_Barrier(comm);
+    startOvrll = MPI_Wtime();
+
+    // Energy: one rank per node reads RAPL, rank 0 sums the nodes
+    energy_t energy;
+    double startWorkJ = 0, finishWorkJ = 0;
+    Energy_open(&energy, Energy_node_reader(comm));
+
+    int n = 1, k = TASK_BLOCKS_PER_RANK, nt = 0, verbose = 0, update = 0, opt;
+    char *in = NULL, *out = NULL, *genSpec = NULL, *anaSpec = NULL;
+    while ((opt = getopt(argc, argv, "n:i:o:k:Nvg:ua:")) != -1) {
+        switch (opt) {
+            case 'n': n = atoi(optarg); break;
+            case 'i': in = optarg; break;
+            case 'o': out = optarg; break;
+            case 'k': k = atoi(optarg); break;
+            case 'N': nt = 1; break;
+            case 'v': verbose = 1; break;
+            case 'g': genSpec = optarg; break;
+            case 'u': update = 1; break;
+            case 'a': anaSpec = optarg; break;
+            default:
+                if (rank == 0) usage(argv);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    if ((in == NULL && genSpec == NULL) || k < 1) {
+        if (rank == 0) usage(argv);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    double *matrix = NULL;
+    int rows = 0, cols = 0;
+    if (genSpec != NULL) {
+        // Rank 0 only needs the whole grid to gather the result into
+        Gen_parse(genSpec, size, &rows, &cols);
+        if (rank == 0 && out != NULL)
+            matrix = Alloc_grid((size_t) rows * cols);
+    } else if (rank == 0) {
+        Read_matrix(in, &matrix, &rows, &cols);
+    }
+    MPI_Bcast(&rows, 1, MPI_INT, 0, comm);
+    MPI_Bcast(&cols, 1, MPI_INT, 0, comm);
+
+    // Blocks of whole rows; each rank owns a contiguous run of them
+    tasks_t T;
+    memset(&T, 0, sizeof(T));
+    T.rows = rows;
+    T.cols = cols;
+    T.n = n;
+    T.nt = nt;
+    T.pitch = Grid_pitch(cols);
+    T.comm = comm;
+    T.nblocks = MIN(size * k, rows);
+    if (T.nblocks < size) {
+        if (rank == 0) fprintf(stderr, "Error: %d rows can't be split over %d ranks.\n", rows, size);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    int *tag_ub, flag;
+    MPI_Comm_get_attr(comm, MPI_TAG_UB, &tag_ub, &flag);
+    if (flag && 2 * T.nblocks > *tag_ub) {
+        if (rank == 0) fprintf(stderr, "Error: %d blocks need more message tags than this MPI has.\n", T.nblocks);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    T.owner = malloc(T.nblocks * sizeof(int));
+    int *sendcounts = malloc(size * sizeof(int));
+    int *displs = malloc(size * sizeof(int));
+    if (T.owner == NULL || sendcounts == NULL || displs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    for (int b = 0; b < T.nblocks; b++)
+        T.owner[b] = BLOCK_OWNER(b, size, T.nblocks);
+    for (int r = 0; r < size; r++) {
+        displs[r] = BLOCK_LOW(BLOCK_LOW(r, size, T.nblocks), T.nblocks, rows);
+        sendcounts[r] = BLOCK_LOW(BLOCK_LOW(r + 1, size, T.nblocks), T.nblocks, rows) - displs[r];
+    }
+
+    T.first = BLOCK_LOW(rank, size, T.nblocks);
+    T.nlocal = BLOCK_SIZE(rank, size, T.nblocks);
+    T.blocks = calloc(T.nlocal, sizeof(block_t));
+    T.recv = malloc(4 * T.nlocal * sizeof(MPI_Request));
+    if (T.blocks == NULL || T.recv == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    for (int k4 = 0; k4 < 4 * T.nlocal; k4++)
+        T.recv[k4] = MPI_REQUEST_NULL;
+
+    // This rank's rows arrive as one slab and are split into the blocks
+    MPI_Datatype row_type, pitched_row_type;
+    MPI_Type_contiguous(cols, MPI_DOUBLE, &row_type);
+    MPI_Type_commit(&row_type);
+    MPI_Type_create_resized(row_type, 0, (MPI_Aint)(T.pitch * sizeof(double)), &pitched_row_type);
+    MPI_Type_commit(&pitched_row_type);
+
+    size_t slab_count = (size_t) sendcounts[rank] * T.pitch;
+    double *slab = Alloc_grid(slab_count);
+    if (genSpec != NULL)
+        Gen_rows(slab, T.pitch, displs[rank], displs[rank] + sendcounts[rank], rows, cols);
+    else
+        MPI_Scatterv(matrix, sendcounts, displs, row_type,
+                     slab, sendcounts[rank], pitched_row_type, 0, comm);
+
+    for (int lb = 0; lb < T.nlocal; lb++) {
+        block_t *bk = &T.blocks[lb];
+        int b = T.first + lb;
+        bk->lo = BLOCK_LOW(b, T.nblocks, rows);
+        bk->hi = BLOCK_LOW(b + 1, T.nblocks, rows);
+        bk->need = (b > 0) + (b < T.nblocks - 1);
+        bk->count = (size_t)(bk->hi - bk->lo + 2) * T.pitch;
+        for (int q = 0; q < 2; q++) {
+            bk->buf[q] = Alloc_grid(bk->count);
+            memcpy(bk->buf[q] + T.pitch, slab + (size_t)(bk->lo - displs[rank]) * T.pitch,
+                   (size_t)(bk->hi - bk->lo) * T.pitch * sizeof(double));
+            bk->send[q][0] = bk->send[q][1] = MPI_REQUEST_NULL;
+        }
+    }
+
+    // One stats page per rank, tagged with rank 0's pid as the job
+    int job = (int) getpid();
+    MPI_Bcast(&job, 1, MPI_INT, 0, comm);
+    T.stats = Stats_open("mpi-tasks", genSpec != NULL ? genSpec : in, rows, cols, n, rank, size, job, 1);
+
+    analysis_t anaStore;
+    if (anaSpec != NULL) {
+        T.ana = &anaStore;
+        Analysis_open(T.ana, anaSpec, rows, cols, 1, rank == 0);
+    }
+
+    MPI_Barrier(comm);
+    startWork = MPI_Wtime();
+    startWorkJ = Energy_read(&energy);
+
+    Run_tasks(&T);
+
+    MPI_Barrier(comm);
+    finishWork = MPI_Wtime();
+    finishWorkJ = Energy_read(&energy);
+
+    Stats_close(T.stats);
+    Analysis_close(T.ana);
+
+    // Gather final results: blocks back into the slab, slabs to rank 0
+    for (int lb = 0; lb < T.nlocal; lb++) {
+        block_t *bk = &T.blocks[lb];
+        memcpy(slab + (size_t)(bk->lo - displs[rank]) * T.pitch, bk->buf[n & 1] + T.pitch,
+               (size_t)(bk->hi - bk->lo) * T.pitch * sizeof(double));
+    }
+    if (out != NULL)
+        MPI_Gatherv(slab, sendcounts[rank], pitched_row_type,
+                    matrix, sendcounts, displs, row_type, 0, comm);
+
+    if (out != NULL && rank == 0 && update) {
+        grid_t whole = { matrix, rows, cols, (size_t) cols };
+        Update_grid_file(&whole, out);
+    } else if (out != NULL && rank == 0) {
+        write_memory_to_file(matrix, rows, cols, out);
+    }
+
+    long stats[2] = { T.runs, T.waits }, totals[2];
+    MPI_Reduce(stats, totals, 2, MPI_LONG, MPI_SUM, 0, comm);
+
+    // Cleanup
+    for (int lb = 0; lb < T.nlocal; lb++) {
+        Free_grid(T.blocks[lb].buf[0], T.blocks[lb].count);
+        Free_grid(T.blocks[lb].buf[1], T.blocks[lb].count);
+    }
+    Free_grid(slab, slab_count);
+    free(T.blocks);
+    free(T.recv);
+    free(T.owner);
+    free(sendcounts);
+    free(displs);
+    MPI_Type_free(&row_type);
+    MPI_Type_free(&pitched_row_type);
+    if (rank == 0 && matrix != NULL)
+        Free_grid(matrix, (size_t) rows * cols);
+
+    MPI_Barrier(comm);
+    finishOvrll = MPI_Wtime();
+    double workJ = Energy_sum(finishWorkJ - startWorkJ, comm);
+    double overallJ = Energy_sum(Energy_read(&energy), comm);
+    Energy_close(&energy);
+
+    if (rank == 0) {
+        double overAllTime = finishOvrll - startOvrll;
+        double workTime = finishWork - startWork;
+        double diffTime = overAllTime - workTime;
+
+        FILE *timeFile = fopen("mpiTasksTime.csv", "a");
+        if (timeFile) {
+            fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, size);
+            Energy_fields(timeFile, workJ, overallJ, workTime, (double)(rows - 2) * (cols - 2) * n);
+            fclose(timeFile);
+        } else {
+            fprintf(stderr, "Error: Unable to open file 'mpiTasksTime.csv' for writing.\n");
+        }
+
+        if (verbose)
+            printf("tasks: %d blocks (%d per rank), %ld block sweeps, a rank waited for halos %ld times\n",
+                   T.nblocks, k, totals[0], totals[1]);
+        Roofline_report("mpi-tasks", (double)(rows - 2) * (cols - 2), n, workTime,
+                        node_size, CEILING(size, node_size), nt);
+    }
+
+    Topology_report(comm, n);
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    return 0;
+}
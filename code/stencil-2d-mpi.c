@@ -7,6 +7,26 @@
  *
  * Run:      ./stencil-2d-mpi.c -t <num iters> -i <in> -o <out> -p <num process>
  *
+ *           -s <file,every,stride[,r0,c0,r1,c1]>: stream binary snapshot frames,
+ *           each rank writing its own rows of every frame (see stencil-2d.c)
+ *           -N: write the new grid with non-temporal (streaming) stores
+ *           -b <K>: every K iterations move the slab boundaries so each rank's
+ *           rows follow its measured compute speed (see Rebalance_rows)
+ *           -w: halo exchange through RMA windows. Ranks on the same node share
+ *           one MPI_Win_allocate_shared segment and read their neighbours'
+ *           boundary rows in place; neighbours on other nodes MPI_Put the rows
+ *           into each other's halos under post/start/complete/wait
+ *           -u: update the output in place (see stencil-2d.c)
+ *           -g <RxC[/rank]>: build the grid in memory, every rank filling
+ *           its own slab (no read, no scatter); /rank makes R rows per rank
+ *           -o is optional: without it nothing is gathered or written
+ *           -a <file,every[,isotherm[,profiles]]>: in-situ analysis (see
+ *           stencil-2d.c); the ranks' partial results are reduced to rank 0
+ *
+ * Notes:    Ranks are renumbered by node and socket (Topology_comm) so that
+ *           neighbouring slabs share a node; rank 0 reports how many halo
+ *           messages stay on a node.
+ *
  * Input:    Binary file with stencil matrix
  * 
  * Output:   Output stencil matrix binary file
@@ -23,12 +43,139 @@
  #include "utilities.c" // NOTE: Ideally, you should include "utilities.h" instead.
  
  void usage(char **argv) {
-     printf("Usage: %s -n <num iters> -i <in file> -o <out file>\n", argv[0]);
+     printf("Usage: %s -n <num iters> (-i <in file> | -g <RxC[/rank]>) [-o <out file>] [-s <file,every,stride[,r0,c0,r1,c1]>] [-N] [-b <K>] [-w] [-a <file,every[,isotherm[,profiles]]>] [-u]\n", argv[0]);
+ }
+
+ // Halo exchange state for -w: node-local neighbours are read in place,
+ // remote ones are written into our halo rows with MPI_Put
+ typedef struct {
+     MPI_Comm node;              // ranks sharing this node's memory
+     MPI_Win shared;             // both local buffers, in one shared segment
+     MPI_Win remote;             // the same memory, exposed to all ranks
+     MPI_Group peers;            // neighbours on other nodes (PSCW group)
+     int npeers;
+     double *base;               // our two buffers, local_count apart
+     double *nbr_row[2][2];      // [up/down][buffer]: neighbour boundary row, or NULL
+     int put_to[2];              // [up/down]: world rank we MPI_Put to, or MPI_PROC_NULL
+     MPI_Aint put_disp[2][2];    // [up/down][buffer]: their halo row
+ } halo_win_t;
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Halo_win_open
+  * Purpose:    Allocate both local buffers in a node-shared window and work
+  *             out, for each neighbour, where its boundary row lives
+  * In args:    comm, rank, size, pitch, local_count
+  *             counts: the rows of every rank
+  * Out arg:    hw
+  */
+ void Halo_win_open(halo_win_t *hw, MPI_Comm comm, int rank, int size, const int *counts, size_t pitch, size_t local_count) {
+     MPI_Info info;
+     MPI_Group world_group, node_group;
+     int nbr[2] = { rank - 1, rank + 1 };
+     int peer_ranks[2];
+
+     MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &hw->node);
+     MPI_Info_create(&info);
+     MPI_Info_set(info, "alloc_shared_noncontig", "true");
+     MPI_Win_allocate_shared((MPI_Aint)(2 * local_count * sizeof(double)), sizeof(double), info,
+                             hw->node, &hw->base, &hw->shared);
+     MPI_Info_free(&info);
+
+     MPI_Comm_group(comm, &world_group);
+     MPI_Comm_group(hw->node, &node_group);
+     hw->npeers = 0;
+     for (int d = 0; d < 2; d++) {
+         hw->nbr_row[d][0] = hw->nbr_row[d][1] = NULL;
+         hw->put_to[d] = MPI_PROC_NULL;
+         if (nbr[d] < 0 || nbr[d] >= size)
+             continue;
+
+         int nbr_rows = counts[nbr[d]];
+         size_t nbr_count = (size_t)(nbr_rows + 2) * pitch;
+         // Up neighbour: its last interior row / its bottom halo; down: first / top
+         size_t row_off = d == 0 ? (size_t) nbr_rows * pitch : pitch;
+         size_t halo_off = d == 0 ? (size_t)(nbr_rows + 1) * pitch : 0;
+         int node_rank;
+
+         MPI_Group_translate_ranks(world_group, 1, &nbr[d], node_group, &node_rank);
+         if (node_rank != MPI_UNDEFINED) {
+             MPI_Aint bytes;
+             int unit;
+             double *nbr_base;
+             MPI_Win_shared_query(hw->shared, node_rank, &bytes, &unit, &nbr_base);
+             hw->nbr_row[d][0] = nbr_base + row_off;
+             hw->nbr_row[d][1] = nbr_base + nbr_count + row_off;
+         } else {
+             hw->put_to[d] = nbr[d];
+             hw->put_disp[d][0] = (MPI_Aint) halo_off;
+             hw->put_disp[d][1] = (MPI_Aint)(nbr_count + halo_off);
+             peer_ranks[hw->npeers++] = nbr[d];
+         }
+     }
+     MPI_Group_incl(world_group, hw->npeers, peer_ranks, &hw->peers);
+     MPI_Group_free(&world_group);
+     MPI_Group_free(&node_group);
+
+     // The world window only when some rank has a neighbour off its node;
+     // with every rank on one node there is nothing to put
+     int any_peers;
+     MPI_Allreduce(&hw->npeers, &any_peers, 1, MPI_INT, MPI_MAX, comm);
+     hw->remote = MPI_WIN_NULL;
+     if (any_peers > 0)
+         MPI_Win_create(hw->base, (MPI_Aint)(2 * local_count * sizeof(double)), sizeof(double), MPI_INFO_NULL,
+                        comm, &hw->remote);
+
+     MPI_Win_lock_all(MPI_MODE_NOCHECK, hw->shared);
+ }
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Halo_win_exchange
+  * Purpose:    Put our boundary rows of buffer <buf> into the halos of the
+  *             neighbours on other nodes, and wait for theirs
+  * In args:    hw, buf: which of the two buffers is current, A: that buffer,
+  *             local_rows, cols, pitch
+  */
+ void Halo_win_exchange(halo_win_t *hw, int buf, double *A, int local_rows, int cols, size_t pitch) {
+     if (hw->npeers == 0)
+         return;
+
+     MPI_Win_post(hw->peers, 0, hw->remote);
+     MPI_Win_start(hw->peers, 0, hw->remote);
+     if (hw->put_to[0] != MPI_PROC_NULL)
+         MPI_Put(A + pitch, cols, MPI_DOUBLE, hw->put_to[0], hw->put_disp[0][buf], cols, MPI_DOUBLE, hw->remote);
+     if (hw->put_to[1] != MPI_PROC_NULL)
+         MPI_Put(A + (size_t) local_rows * pitch, cols, MPI_DOUBLE, hw->put_to[1], hw->put_disp[1][buf], cols, MPI_DOUBLE, hw->remote);
+     MPI_Win_complete(hw->remote);
+     MPI_Win_wait(hw->remote);
+ }
+
+
+ /*-------------------------------------------------------------------
+  * Function:   Halo_win_fence
+  * Purpose:    Make this sweep's stores visible to the node and wait until
+  *             every rank on it is done reading the buffers we overwrite next
+  */
+ void Halo_win_fence(halo_win_t *hw) {
+     MPI_Win_sync(hw->shared);
+     MPI_Barrier(hw->node);
+     MPI_Win_sync(hw->shared);
+ }
+
+
+ void Halo_win_close(halo_win_t *hw) {
+     MPI_Win_unlock_all(hw->shared);
+     MPI_Group_free(&hw->peers);
+     if (hw->remote != MPI_WIN_NULL)
+         MPI_Win_free(&hw->remote);
+     MPI_Win_free(&hw->shared);
+     MPI_Comm_free(&hw->node);
  }
  
- void setArgs(int argc, char **argv, int *n, char **in, char **out) {
+ void setArgs(int argc, char **argv, int *n, char **in, char **out, char **snap, int *nt, int *win, int *K, char **ana, int *update, char **gen) {
      int opt;
-     while ((opt = getopt(argc, argv, "n:i:o:")) != -1) {
+     while ((opt = getopt(argc, argv, "n:i:o:s:Nwb:a:ug:")) != -1) {
          switch (opt) {
              case 'n':
                  *n = atoi(optarg);
@@ -39,47 +186,93 @@
              case 'o':
                  *out = optarg;
                  break;
+             case 's':
+                 *snap = optarg;
+                 break;
+             case 'N':
+                 *nt = 1;
+                 break;
+             case 'b':
+                 *K = atoi(optarg);
+                 break;
+             case 'w':
+                 *win = 1;
+                 break;
+             case 'a':
+                 *ana = optarg;
+                 break;
+             case 'u':
+                 *update = 1;
+                 break;
+             case 'g':
+                 *gen = optarg;
+                 break;
              default:
                  usage(argv);
                  exit(EXIT_FAILURE);
          }
      }
-     if (*in == NULL || *out == NULL) {
-         fprintf(stderr, "Error: Both input (-i) and output (-o) files must be specified.\n");
+     if (*in == NULL && *gen == NULL) {
+         fprintf(stderr, "Error: An input file (-i) or grid spec (-g) must be specified.\n");
          usage(argv);
          exit(EXIT_FAILURE);
      }
+     if (*win && *K > 0) {
+         fprintf(stderr, "Error: -b cannot be combined with -w (the shared windows are sized once).\n");
+         exit(EXIT_FAILURE);
+     }
  }
  
  int main(int argc, char **argv) {
      MPI_Init(&argc, &argv);
  
+     // Ranks renumbered so that neighbouring slabs share a node/socket
+     int node_size;
+     MPI_Comm comm = Topology_comm(&node_size);
+
      int rank, size;
-     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-     MPI_Comm_size(MPI_COMM_WORLD, &size);
+     MPI_Comm_rank(comm, &rank);
+     MPI_Comm_size(comm, &size);
  
      // Timer variables
      double startOvrll = 0, finishOvrll = 0, startWork = 0, finishWork = 0;
-     MPI_Barrier(MPI_COMM_WORLD);
+     MPI_Barrier(comm);
      startOvrll = MPI_Wtime();
+
+     // Energy: one rank per node reads RAPL, rank 0 sums the nodes
+     energy_t energy;
+     double startWorkJ = 0, finishWorkJ = 0;
+     Energy_open(&energy, Energy_node_reader(comm));
  
      int n = 1;
      char *in = NULL;
      char *out = NULL;
+     char *snapSpec = NULL;
+     int nt = 0;
+     int useWin = 0;
+     int K = 0;
+     char *anaSpec = NULL;
+     int update = 0;
+     char *genSpec = NULL;
  
      // Parse arguments
-     setArgs(argc, argv, &n, &in, &out);
+     setArgs(argc, argv, &n, &in, &out, &snapSpec, &nt, &useWin, &K, &anaSpec, &update, &genSpec);
  
      double *matrix = NULL;
      int rows = 0, cols = 0;
  
-     if (rank == 0) {
+     if (genSpec != NULL) {
+         // Rank 0 only needs the whole grid to gather the result into
+         Gen_parse(genSpec, size, &rows, &cols);
+         if (rank == 0 && out != NULL)
+             matrix = Alloc_grid((size_t) rows * cols);
+     } else if (rank == 0) {
          Read_matrix(in, &matrix, &rows, &cols);
      }
  
      // Broadcast matrix dimensions
-     MPI_Bcast(&rows, 1, MPI_INT, 0, MPI_COMM_WORLD);
-     MPI_Bcast(&cols, 1, MPI_INT, 0, MPI_COMM_WORLD);
+     MPI_Bcast(&rows, 1, MPI_INT, 0, comm);
+     MPI_Bcast(&cols, 1, MPI_INT, 0, comm);
  
      // Determine local rows
      int local_rows = rows / size;
@@ -87,65 +280,146 @@
      if (rank < remainder) {
          local_rows++;
      }
- 
-     // Allocate space for local matrix (+2 rows for halo exchange)
-     double *local_matrix = malloc((local_rows + 2) * cols * sizeof(double));
-     double *local_newMatrix = malloc((local_rows + 2) * cols * sizeof(double));
- 
-     // Scatter data
+     int row_lo = rank * (rows / size) + (rank < remainder ? rank : remainder);
+
      int *sendcounts = malloc(size * sizeof(int));
      int *displs = malloc(size * sizeof(int));
  
      int offset = 0;
      for (int i = 0; i < size; i++) {
          int rows_i = rows / size + (i < remainder ? 1 : 0);
-         sendcounts[i] = rows_i * cols;
+         sendcounts[i] = rows_i;
          displs[i] = offset;
          offset += sendcounts[i];
      }
  
+     // Allocate space for local matrix (+2 rows for halo exchange), rows padded to pitch
+     size_t pitch = Grid_pitch(cols);
+     size_t local_count = (size_t)(local_rows + 2) * pitch;
+     halo_win_t hw;
+     double *local_matrix, *local_newMatrix;
+     if (useWin) {
+         Halo_win_open(&hw, comm, rank, size, sendcounts, pitch, local_count);
+         local_matrix = hw.base;
+         local_newMatrix = hw.base + local_count;
+     } else {
+         local_matrix = Alloc_grid(local_count);
+         local_newMatrix = Alloc_grid(local_count);
+     }
+ 
+     // Scatter data in units of whole rows, so counts stay small on 50k+ grids
+     MPI_Datatype row_type;
+     MPI_Datatype pitched_row_type;
+     MPI_Type_contiguous(cols, MPI_DOUBLE, &row_type);
+     MPI_Type_commit(&row_type);
+     MPI_Type_create_resized(row_type, 0, (MPI_Aint)(pitch * sizeof(double)), &pitched_row_type);
+     MPI_Type_commit(&pitched_row_type);
+ 
      // Initialize local_matrix (shift by one row for halos)
-     MPI_Scatterv(matrix, sendcounts, displs, MPI_DOUBLE,
-                  local_matrix + cols, local_rows * cols, MPI_DOUBLE,
-                  0, MPI_COMM_WORLD);
+     if (genSpec != NULL)
+         Gen_rows(local_matrix + pitch, pitch, row_lo, row_lo + local_rows, rows, cols);
+     else
+         MPI_Scatterv(matrix, sendcounts, displs, row_type,
+                      local_matrix + pitch, local_rows, pitched_row_type,
+                      0, comm);
  
      // Copy initial data
-     memcpy(local_newMatrix, local_matrix, (local_rows + 2) * cols * sizeof(double));
+     memcpy(local_newMatrix, local_matrix, local_count * sizeof(double));
+
+     // Rank 0 creates the snapshot file, then every rank streams its own rows
+     snapshot_t snapStream;
+     snapshot_t *snap = NULL;
+     if (snapSpec != NULL) {
+         snap = &snapStream;
+         if (rank == 0) Snapshot_open(snap, snapSpec, rows, cols, 1);
+         MPI_Barrier(comm);
+         if (rank != 0) Snapshot_open(snap, snapSpec, rows, cols, 0);
+     }
  
-     MPI_Barrier(MPI_COMM_WORLD);
+     analysis_t anaStore;
+     analysis_t *ana = NULL;
+     if (anaSpec != NULL) {
+         ana = &anaStore;
+         Analysis_open(ana, anaSpec, rows, cols, 1, rank == 0);
+     }
+
+     MPI_Barrier(comm);
      startWork = MPI_Wtime();
+     startWorkJ = Energy_read(&energy);
+
+     Snapshot_capture(snap, 0, local_matrix + pitch, pitch, row_lo, row_lo + local_rows);
+
+     // One stats page per rank, tagged with rank 0's pid as the job
+     int job = (int) getpid();
+     MPI_Bcast(&job, 1, MPI_INT, 0, comm);
+     stats_page_t *stats = Stats_open("mpi", genSpec != NULL ? genSpec : in, rows, cols, n, rank, size, job, 1);
  
+     double work = 0.0;
+
      // Stencil iterations
      for (int iter = 0; iter < n; iter++) {
          MPI_Request requests[4];
          int req_count = 0;
- 
+         double tw = MPI_Wtime();
+         double *up = local_matrix;
+         double *down = local_matrix + (local_rows + 1) * pitch;
+
+         if (useWin) {
+             // Node-local boundary rows are used where they lie, no copy
+             int buf = iter & 1;
+             if (hw.nbr_row[0][buf] != NULL) up = hw.nbr_row[0][buf];
+             if (hw.nbr_row[1][buf] != NULL) down = hw.nbr_row[1][buf];
+             Halo_win_exchange(&hw, buf, local_matrix, local_rows, cols, pitch);
+         }
+
          // Exchange ghost rows
-         if (rank > 0) {
-             MPI_Isend(local_matrix + cols, cols, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-             MPI_Irecv(local_matrix, cols, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
+         if (!useWin && rank > 0) {
+             MPI_Isend(local_matrix + pitch, cols, MPI_DOUBLE, rank - 1, 0, comm, &requests[req_count++]);
+             MPI_Irecv(local_matrix, cols, MPI_DOUBLE, rank - 1, 0, comm, &requests[req_count++]);
          }
-         if (rank < size - 1) {
-             MPI_Isend(local_matrix + local_rows * cols, cols, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-             MPI_Irecv(local_matrix + (local_rows + 1) * cols, cols, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
+         if (!useWin && rank < size - 1) {
+             MPI_Isend(local_matrix + local_rows * pitch, cols, MPI_DOUBLE, rank + 1, 0, comm, &requests[req_count++]);
+             MPI_Irecv(local_matrix + (local_rows + 1) * pitch, cols, MPI_DOUBLE, rank + 1, 0, comm, &requests[req_count++]);
          }
  
          MPI_Waitall(req_count, requests, MPI_STATUSES_IGNORE);
  
-         for (int i = 1; i <= local_rows; i++) {
-            int global_row = i - 1 + rank * (rows / size) + (rank < (rows % size) ? rank : (rows % size));
+         double t0 = MPI_Wtime();
+         double wait = t0 - tw;
+         int sample = Analysis_due(ana, iter + 1, n);
+         if (sample)
+             Analysis_reset(ana, 0);
+         for (size_t i = 1; i <= (size_t) local_rows; i++) {
+            int global_row = row_lo + (int) i - 1;
             
-            if (global_row == 0 || global_row == rows - 1)
+            if (global_row == 0 || global_row == rows - 1) {
+                if (sample)
+                    Analysis_fold(ana, 0, local_newMatrix + i * pitch, global_row);
                 continue; // Skip updating first and last rows globally
-        
-            for (int j = 1; j < cols - 1; j++) {
-                local_newMatrix[i * cols + j] = (
-                    local_matrix[(i - 1) * cols + (j - 1)] + local_matrix[(i - 1) * cols + j] + local_matrix[(i - 1) * cols + (j + 1)] +
-                    local_matrix[i * cols + (j - 1)] + local_matrix[i * cols + j] + local_matrix[i * cols + (j + 1)] +
-                    local_matrix[(i + 1) * cols + (j - 1)] + local_matrix[(i + 1) * cols + j] + local_matrix[(i + 1) * cols + (j + 1)]
-                ) / 9.0;
             }
+
+            if (sample) {
+                Stencil_row_analyze(i == 1 ? up : local_matrix + (i - 1) * pitch, local_matrix + i * pitch,
+                                    i == (size_t) local_rows ? down : local_matrix + (i + 1) * pitch,
+                                    local_newMatrix + i * pitch, global_row, ana, 0);
+                continue;
+            }
+        
+            Stencil_row(i == 1 ? up : local_matrix + (i - 1) * pitch, local_matrix + i * pitch,
+                        i == (size_t) local_rows ? down : local_matrix + (i + 1) * pitch,
+                        local_newMatrix + i * pitch, 1, cols - 1, nt);
         }
+
+         double t1 = MPI_Wtime();
+         work += t1 - t0;
+
+         if (useWin) Halo_win_fence(&hw);
+         Stats_thread(stats, 0, t1 - t0, wait + MPI_Wtime() - t1);
+
+         if (sample) {
+             Analysis_reduce(ana, comm);
+             Analysis_write(ana, iter + 1);
+         }
         
 
  
@@ -153,34 +427,69 @@
          double *temp = local_matrix;
          local_matrix = local_newMatrix;
          local_newMatrix = temp;
+
+         Stats_iteration(stats, iter + 1, local_matrix + pitch, local_newMatrix + pitch, local_rows, cols, pitch);
+         Snapshot_capture(snap, iter + 1, local_matrix + pitch, pitch, row_lo, row_lo + local_rows);
+
+         if (K > 0 && (iter + 1) % K == 0 && iter + 1 < n) {
+             if (Rebalance_rows(&local_matrix, &local_newMatrix, sendcounts, displs, pitch,
+                                pitched_row_type, work, iter + 1, comm)) {
+                 local_rows = sendcounts[rank];
+                 row_lo = displs[rank];
+                 local_count = (size_t)(local_rows + 2) * pitch;
+             }
+             work = 0.0;
+         }
      }
  
-     MPI_Barrier(MPI_COMM_WORLD);
+     MPI_Barrier(comm);
      finishWork = MPI_Wtime();
+     finishWorkJ = Energy_read(&energy);
+
+     Stats_close(stats);
+     Snapshot_close(snap);
+     Analysis_close(ana);
  
-     // Gather final results
-     if (rank == 0) {
-         MPI_Gatherv(local_matrix + cols, local_rows * cols, MPI_DOUBLE,
-                     matrix, sendcounts, displs, MPI_DOUBLE,
-                     0, MPI_COMM_WORLD);
-     } else {
-         MPI_Gatherv(local_matrix + cols, local_rows * cols, MPI_DOUBLE,
-                     NULL, sendcounts, displs, MPI_DOUBLE,
-                     0, MPI_COMM_WORLD);
+     // Gather final results (not needed when -a is the only output)
+     if (out != NULL && rank == 0) {
+         MPI_Gatherv(local_matrix + pitch, local_rows, pitched_row_type,
+                     matrix, sendcounts, displs, row_type,
+                     0, comm);
+     } else if (out != NULL) {
+         MPI_Gatherv(local_matrix + pitch, local_rows, pitched_row_type,
+                     NULL, sendcounts, displs, row_type,
+                     0, comm);
+     }
+ 
+     // Output results
+     if (out != NULL && rank == 0 && update) {
+         grid_t whole = { matrix, rows, cols, (size_t) cols };
+         Update_grid_file(&whole, out);
+     } else if (out != NULL && rank == 0) {
+         write_memory_to_file(matrix, rows, cols, out);
      }
  
      // Cleanup
-     free(local_matrix);
-     free(local_newMatrix);
+     if (useWin) {
+         Halo_win_close(&hw);
+     } else {
+         Free_grid(local_matrix, local_count);
+         Free_grid(local_newMatrix, local_count);
+     }
      free(sendcounts);
      free(displs);
+     MPI_Type_free(&row_type);
+     MPI_Type_free(&pitched_row_type);
  
-     if (rank == 0) {
-         free(matrix);
+     if (rank == 0 && matrix != NULL) {
+         Free_grid(matrix, (size_t) rows * cols);
      }
  
-     MPI_Barrier(MPI_COMM_WORLD);
+     MPI_Barrier(comm);
      finishOvrll = MPI_Wtime();
+     double workJ = Energy_sum(finishWorkJ - startWorkJ, comm);
+     double overallJ = Energy_sum(Energy_read(&energy), comm);
+     Energy_close(&energy);
  
      if (rank == 0) {
          double overAllTime = finishOvrll - startOvrll;
@@ -189,14 +498,21 @@
  
          FILE *timeFile = fopen("mpiTime.csv", "a");
          if (timeFile) {
-             fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d\n", n, rows, cols, overAllTime, workTime, diffTime, size);
+             fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, size);
+             Energy_fields(timeFile, workJ, overallJ, workTime, (double)(rows - 2) * (cols - 2) * n);
              fclose(timeFile);
          } else {
              fprintf(stderr, "Error: Unable to open file 'mpiTime.csv' for writing.\n");
          }
+
+         Roofline_report("mpi", (double)(rows - 2) * (cols - 2), n, workTime,
+                         node_size, CEILING(size, node_size), nt);
      }
  
+     Topology_report(comm, n);
+     MPI_Comm_free(&comm);
+
      MPI_Finalize();
      return 0;
  }
- 
\ No newline at end of file
+ 
\ No newline at end of file
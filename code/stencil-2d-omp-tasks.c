@@ -0,0 +1,258 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     stencil-2d-omp-tasks.c
+ *
+ * Purpose:  Perform stencil simulation using OpenMP tasks, with every
+ *           iteration of every row band a task that waits only for the
+ *           bands it reads
+ *
+ * Run:      ./stencil-2d-omp-tasks -n <num iters> -i <in> [-o <out>] [-p <threads>] [-k <bands per thread>] [-N] [-v]
+ *
+ *           -p: threads (default: the autotune cache, else OpenMP's default)
+ *           -k: bands per thread (default: the autotune cache, else
+ *           TASK_BANDS_PER_THREAD)
+ *           -N: write the new grid with non-temporal (streaming) stores
+ *           -v: report the bands and how many iterations were in flight
+ *           at once
+ *           -o is optional: without it the grid is not written
+ *
+ * Input:    Binary file with stencil matrix
+ *
+ * Output:   Output stencil matrix binary file
+ *
+ * Errors:   Usage errors and file permission errors
+ *
+ * Notes:    One thread creates the tasks of all iterations up front. The
+ *           task for band b at iteration o reads bands b-1, b and b+1 of
+ *           iteration o-1 and writes band b of iteration o, and says so in
+ *           its depend clauses, on one token per band and buffer parity.
+ *           Since the same two buffers are reused, the out dependence also
+ *           keeps a band from being overwritten while iteration o-1 still
+ *           reads it. There is no barrier between iterations, so a band can
+ *           run ahead of the far end of the grid by many iterations; only
+ *           the end of the parallel region waits for everything. When the
+ *           task queue gets long the OpenMP runtime makes the creating
+ *           thread run tasks itself, so queued tasks stay bounded.
+ *           On the stats page (see stencil-top) the iteration is the last
+ *           one every band has finished, and a thread's count is the bands
+ *           it ran, with the time between its tasks as its wait.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <omp.h>
+#include "utilities.c"
+
+#define TASK_BANDS_PER_THREAD 8
+
+typedef struct {
+    int n, nb;
+    int *left;               // bands still to finish per iteration
+    int oldest;              // oldest unfinished iteration
+    int span;                // most iterations seen in flight at once
+    stats_page_t *stats;     // told whenever oldest moves, or NULL
+} flight_t;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s -n <num iters> -i <in file> [-o <out file>] [-p <threads>] [-k <bands per thread>] [-N] [-v]\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Flight_start
+ * Purpose:    Note that a task of iteration o starts
+ */
+void Flight_start(flight_t *f, int o) {
+    int oldest = __atomic_load_n(&f->oldest, __ATOMIC_ACQUIRE);
+    int span = o - oldest + 1, seen = __atomic_load_n(&f->span, __ATOMIC_RELAXED);
+    while (span > seen && !__atomic_compare_exchange_n(&f->span, &seen, span, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Flight_finish
+ * Purpose:    Note that a task of iteration o is done, and move the
+ *             oldest unfinished iteration past every finished one
+ */
+void Flight_finish(flight_t *f, int o) {
+    __atomic_sub_fetch(&f->left[o], 1, __ATOMIC_ACQ_REL);
+    int oldest = __atomic_load_n(&f->oldest, __ATOMIC_ACQUIRE), moved = 0;
+    while (oldest <= f->n && __atomic_load_n(&f->left[oldest], __ATOMIC_ACQUIRE) == 0)
+        if (__atomic_compare_exchange_n(&f->oldest, &oldest, oldest + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            oldest++;
+            moved = 1;
+        }
+
+    // The page has one writer at a time, and oldest never goes back
+    if (moved && f->stats != NULL) {
+        #pragma omp critical (stats_page)
+        Stats_iteration(f->stats, __atomic_load_n(&f->oldest, __ATOMIC_ACQUIRE) - 1, NULL, NULL, 0, 0, 0);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    double startOvrll = 0, finishOvrll = 0, startWork = 0, finishWork = 0;
+    GET_TIME(startOvrll);
+
+    energy_t energy;
+    double startWorkJ = 0, finishWorkJ = 0, overallJ = 0;
+    Energy_open(&energy, 1);
+
+    omp_set_dynamic(0);
+
+    int n = 1, p = 0, k = 0, nt = 0, verbose = 0, opt;
+    char *in = NULL, *out = NULL;
+    while ((opt = getopt(argc, argv, "n:i:o:p:k:Nv")) != -1) {
+        switch (opt) {
+            case 'n': n = atoi(optarg); break;
+            case 'i': in = optarg; break;
+            case 'o': out = optarg; break;
+            case 'p': p = atoi(optarg); break;
+            case 'k': k = atoi(optarg); break;
+            case 'N': nt = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (in == NULL || n < 0 || k < 0) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    grid_t grid, newGrid;
+    Read_grid(in, &grid);
+    int rows = grid.rows, cols = grid.cols;
+    size_t pitch = grid.pitch;
+
+    // -p and -k each fall back to the autotune cache when not given
+    if (p < 1 || k < 1) {
+        tune_entry_t tuned;
+        if (Tune_lookup("omp-tasks", rows, cols, &tuned)) {
+            if (p < 1) {
+                p = tuned.p;
+                nt |= tuned.nt;
+            }
+            if (k < 1)
+                k = tuned.k;
+        }
+    }
+    if (k < 1)
+        k = TASK_BANDS_PER_THREAD;
+    if (p > 0)
+        omp_set_num_threads(p);
+    int threads = omp_get_max_threads();
+
+    // Bands of interior rows; rows 0 and rows - 1 never change
+    int nb = MIN(threads * k, rows - 2);
+
+    Grid_alloc(&newGrid, rows, cols);
+    memcpy(newGrid.data, grid.data, (size_t) rows * pitch * sizeof(double));
+    double *buf[2] = { grid.data, newGrid.data };
+
+    // One slot per thread; the page's iteration needs the flight tracking
+    stats_page_t *stats = Stats_open("omp-tasks", in, rows, cols, n, 0, 1, (int) getpid(), threads);
+
+    // Dependence tokens: token[q * nb + b] stands for band b of buffer q
+    char *token = calloc(2 * (size_t) MAX(nb, 1), 1);
+    double *idle_from = malloc(threads * sizeof(double));
+    flight_t flight = { n, nb, NULL, 1, 0, stats };
+    int track = verbose || stats != NULL;
+    if (track)
+        flight.left = malloc((n + 2) * sizeof(int));
+    if (token == NULL || idle_from == NULL || (track && flight.left == NULL)) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int o = 0; track && o <= n + 1; o++)
+        flight.left[o] = nb;
+    flight_t *fl = track ? &flight : NULL;
+
+    GET_TIME(startWork);
+    startWorkJ = Energy_read(&energy);
+    for (int t = 0; t < threads; t++)
+        idle_from[t] = omp_get_wtime();
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        for (int o = 1; o <= n && nb > 0; o++) {
+            const double *src = buf[(o - 1) & 1];
+            double *dst = buf[o & 1];
+
+            for (int b = 0; b < nb; b++) {
+                size_t lo = 1 + BLOCK_LOW(b, nb, rows - 2), hi = 1 + BLOCK_LOW(b + 1, nb, rows - 2);
+
+                // Written out in the clauses: gcc doesn't see variables
+                // only used in depend as used
+                #pragma omp task depend(in: token[((o - 1) & 1) * nb + MAX(b - 1, 0)], token[((o - 1) & 1) * nb + b], \
+                                            token[((o - 1) & 1) * nb + MIN(b + 1, nb - 1)]) \
+                                 depend(out: token[(o & 1) * nb + b])
+                {
+                    // Tied tasks: nothing else runs on this thread (and slot) meanwhile
+                    int tid = omp_get_thread_num();
+                    double t0 = omp_get_wtime();
+                    if (fl != NULL)
+                        Flight_start(fl, o);
+                    for (size_t i = lo; i < hi; i++)
+                        Stencil_row(src + (i - 1) * pitch, src + i * pitch, src + (i + 1) * pitch,
+                                    dst + i * pitch, 1, cols - 1, nt);
+                    double t1 = omp_get_wtime();
+                    Stats_thread(stats, tid, t1 - t0, t0 - idle_from[tid]);
+                    idle_from[tid] = t1;
+                    if (fl != NULL)
+                        Flight_finish(fl, o);
+                }
+            }
+        }
+    }
+
+    GET_TIME(finishWork);
+    finishWorkJ = Energy_read(&energy);
+
+    Stats_close(stats);
+
+    if (verbose)
+        printf("tasks: %d bands (%d per thread) x %d iterations, up to %d iterations in flight at once\n",
+               nb, k, n, flight.span);
+
+    grid.data = buf[n & 1];
+    newGrid.data = buf[(n + 1) & 1];
+    if (out != NULL)
+        Write_grid(&grid, out);
+
+    Grid_free(&grid);
+    Grid_free(&newGrid);
+    free(token);
+    free(idle_from);
+    free(flight.left);
+
+    GET_TIME(finishOvrll);
+    overallJ = Energy_read(&energy);
+    Energy_close(&energy);
+
+    double overAllTime = finishOvrll - startOvrll;
+    double workTime = finishWork - startWork;
+    double diffTime = overAllTime - workTime;
+
+    FILE *timeFile = fopen("ompTasksTime.csv", "a");
+    if (!timeFile) {
+        fprintf(stderr, "Error: Unable to open file 'ompTasksTime.csv' for writing.\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, threads);
+    Energy_fields(timeFile, finishWorkJ - startWorkJ, overallJ, workTime, (double)(rows - 2) * (cols - 2) * n);
+    fclose(timeFile);
+
+    Roofline_report("omp-tasks", (double)(rows - 2) * (cols - 2), n, workTime, threads, 1, nt);
+
+    return 0;
+}
@@ -7,6 +7,21 @@
  *
  * Run:      ./stencil-2d-omp.c -t <num iters> -i <in> -o <out> -p <num process>
  *
+ *           -s <file,every,stride[,r0,c0,r1,c1]>: stream binary snapshot frames
+ *           (see stencil-2d.c)
+ *           -N: write the new grid with non-temporal (streaming) stores
+ *           -c <dir>[,<budget MB>]: result cache (see stencil-2d.c)
+ *           -F: fused I/O (see stencil-2d.c); the fused sweeps hand out
+ *           rows in file order
+ *           -u: update the output in place (see stencil-2d.c)
+ *           -g <RxC[/thread]>: build the grid in memory, each thread
+ *           filling the rows it sweeps; /thread makes R rows per thread
+ *           -o is optional: without it the grid is not written
+ *           -a <file,every[,isotherm[,profiles]]>: in-situ analysis (see
+ *           stencil-2d.c); the threads' partial results meet in a tree
+ *           Without -p the thread count (and -N) come from the autotune
+ *           cache for this host and grid size, if there is one.
+ *
  * Input:    Binary file with stencil matrix
  * 
  * Output:   Output stencil matrix binary file
@@ -24,14 +39,14 @@
 #include <omp.h>
  
  void usage(char **argv){
-	 printf("Usage: %s -n <num iters> -i <in file> -o <out file> -v <debug: 0,1,2>\n", argv[0]);
+	 printf("Usage: %s -n <num iters> (-i <in file> | -g <RxC[/thread]>) [-o <out file>] -v <debug: 0,1,2> [-s <file,every,stride[,r0,c0,r1,c1]>] [-N] [-c <dir>[,<budget MB>]] [-F] [-a <file,every[,isotherm[,profiles]]>] [-u]\n", argv[0]);
  }
  
  // Set arguments
-void setArgs(int argc, char **argv, int *n, char **in, char **out, int *debug){
+void setArgs(int argc, char **argv, int *n, char **in, char **out, int *debug, char **snap, int *nt, int *p, char **cache, int *fused, char **ana, int *update, char **gen){
 	int opt;
  
-	while((opt = getopt(argc, argv, "n:i:o:v:p:")) != -1){
+	while((opt = getopt(argc, argv, "n:i:o:v:p:s:Nc:Fa:ug:")) != -1){
 		switch(opt){
 			case 'n':
 				*n = atoi(optarg);
@@ -46,15 +61,41 @@ void setArgs(int argc, char **argv, int *n, char **in, char **out, int *debug){
 				*debug = atoi(optarg);
 				break;
             case 'p':
-                omp_set_num_threads(atoi(optarg));
+                *p = atoi(optarg);
                 break;
+			case 's':
+				*snap = optarg;
+				break;
+			case 'N':
+				*nt = 1;
+				break;
+			case 'c':
+				*cache = optarg;
+				break;
+			case 'F':
+				*fused = 1;
+				break;
+			case 'a':
+				*ana = optarg;
+				break;
+			case 'u':
+				*update = 1;
+				break;
+			case 'g':
+				*gen = optarg;
+				break;
 			default:
 				usage(argv);
 				exit(1);
 		}
 	}
-	if(*in == NULL ||*out == NULL){
-		perror("Files -i and -o must be provided");
+	if(*in == NULL && *gen == NULL){
+		perror("Input file -i (or -g) must be provided");
+		exit(EXIT_FAILURE);
+	}
+	// The autotune cache is keyed by grid size, which /thread derives from p
+	if(*gen != NULL && strchr(*gen, '/') != NULL && *p < 1){
+		fprintf(stderr, "Error: -g %s needs -p to size the grid.\n", *gen);
 		exit(EXIT_FAILURE);
 	}
 	 
@@ -70,42 +111,170 @@ int main(int argc, char **argv){
  
 	GET_TIME(startOvrll);
 
+	// ---- Energy, read alongside the timers ----
+	energy_t energy;
+	double startWorkJ=0, finishWorkJ=0, overallJ=0;
+	Energy_open(&energy, 1);
+
     omp_set_dynamic(0);
 	 
-	int n=1,debug=0;
+	int n=1,debug=0,nt=0,p=0,fused=0,update=0;
 	char *in = NULL;
 	char *out = NULL;
+	char *snapSpec = NULL;
+	char *cacheSpec = NULL;
+	char *anaSpec = NULL;
+	char *genSpec = NULL;
 	 
 	//set args
-	setArgs(argc, argv, &n, &in, &out, &debug);
+	setArgs(argc, argv, &n, &in, &out, &debug, &snapSpec, &nt, &p, &cacheSpec, &fused, &anaSpec, &update, &genSpec);
  
+	grid_t grid, newGrid;
 	double *matrix;
 	double *newMatrix;
 	int rows, cols;
+	size_t pitch;
  	
-	Read_matrix(in, &matrix, &rows, &cols);
+	// -F: read in the background while the first sweep runs
+	int fusedRead = fused && genSpec == NULL && cacheSpec == NULL && snapSpec == NULL && debug < 2;
+	pipe_io_t inPipe, outPipe;
+	if(genSpec != NULL){
+		int genRows, genCols;
+		Gen_parse(genSpec, p, &genRows, &genCols);
+		Grid_alloc(&grid, genRows, genCols);
+	}
+	else if(fusedRead)
+		Pipe_read_start(&inPipe, in, &grid);
+	else
+		Read_grid(in, &grid);
+	rows = grid.rows;
+	cols = grid.cols;
+	pitch = grid.pitch;
+
+	if(p < 1){
+		tune_entry_t tuned;
+		if(Tune_lookup("omp", rows, cols, &tuned)){
+			p = tuned.p;
+			nt |= tuned.nt;
+		}
+	}
+	if(p > 0)
+		omp_set_num_threads(p);
+
+	// -g: the static schedule hands each thread about the rows it sweeps
+	if(genSpec != NULL){
+		#pragma omp parallel for schedule(static)
+		for(int i = 0; i < rows; i++)
+			Gen_rows(grid.data + (size_t) i * pitch, pitch, i, i + 1, rows, cols);
+	}
+
+	// Start from the furthest cached iteration of this input, if any
+	result_cache_t cacheStore;
+	result_cache_t *cache = NULL;
+	int start = 0;
+	if(cacheSpec != NULL){
+		cache = &cacheStore;
+		Cache_open(cache, cacheSpec, &grid);
+		start = Cache_resume(cache, &grid, n);
+		if(debug >= 1 && start > 0)
+			printf("Resuming from cached iteration %d\n", start);
+	}
 	
-	newMatrix = malloc(rows * cols * sizeof(double));
-	if (newMatrix == NULL) {
-		fprintf(stderr, "Can't allocate storage\n");
-		exit(-1);
+	Grid_alloc(&newGrid, rows, cols);
+	if(genSpec != NULL){
+		#pragma omp parallel for schedule(static)
+		for(int i = 0; i < rows; i++)
+			memcpy(newGrid.data + (size_t) i * pitch, grid.data + (size_t) i * pitch, pitch * sizeof(double));
+	}
+	else if(!fusedRead)
+		memcpy(newGrid.data, grid.data, (size_t) rows * pitch * sizeof(double));	 
+	matrix = grid.data;
+	newMatrix = newGrid.data;
+
+	// The last sweep writes into newMatrix after an odd number of sweeps
+	int fusedWrite = fused && n > start && out != NULL && !update;
+	if(fusedWrite)
+		Pipe_write_start(&outPipe, out, (n - start) % 2 ? newMatrix : matrix, rows, cols, pitch);
+
+	snapshot_t snapStream;
+	snapshot_t *snap = NULL;
+	if(snapSpec != NULL){
+		snap = &snapStream;
+		Snapshot_open(snap, snapSpec, rows, cols, 1);
+	}
+
+	analysis_t anaStore;
+	analysis_t *ana = NULL;
+	if(anaSpec != NULL){
+		ana = &anaStore;
+		Analysis_open(ana, anaSpec, rows, cols, omp_get_max_threads(), 1);
 	}
-	memcpy(newMatrix, matrix, rows * cols * sizeof(double));	 
     
     GET_TIME(startWork);
+    startWorkJ = Energy_read(&energy);
+
+    Snapshot_capture(snap, start, newMatrix, pitch, 0, rows);
     
+    stats_page_t *stats = Stats_open("omp", genSpec != NULL ? genSpec : in, rows, cols, n, 0, 1, (int) getpid(), omp_get_max_threads());
+
     // Loop iterations
     #pragma omp parallel
     {
-        for (int o = 1; o <= n; o++) {
-            #pragma omp for collapse(2) // Parallelize the nested loops
-            for (int i = 1; i < rows - 1; i++) {
-                for (int j = 1; j < cols - 1; j++) {
-                    newMatrix[i * cols + j] = (
-                        matrix[(i - 1) * cols + (j - 1)] + matrix[(i - 1) * cols + j] + matrix[(i - 1) * cols + (j + 1)] +
-                        matrix[i * cols + (j - 1)] + matrix[i * cols + j] + matrix[i * cols + (j + 1)] +
-                        matrix[(i + 1) * cols + (j - 1)] + matrix[(i + 1) * cols + j] + matrix[(i + 1) * cols + (j + 1)]
-                    ) / 9.0;
+        for (int o = start + 1; o <= n; o++) {
+            double t0 = omp_get_wtime();
+            pipe_io_t *pin = fusedRead && o == start + 1 ? &inPipe : NULL;
+            pipe_io_t *pout = fusedWrite && o == n ? &outPipe : NULL;
+            int tid = omp_get_thread_num();
+            int sample = Analysis_due(ana, o, n);
+            if (sample)
+                Analysis_reset(ana, tid);
+            if (pin != NULL || pout != NULL) {
+                // Fused sweep: every row, boundaries included, in file order
+                #pragma omp for schedule(dynamic) nowait
+                for (int i = 0; i < rows; i++) {
+                    Pipe_row(pin, pout, matrix, newMatrix, i, rows, cols, pitch, nt);
+                    if (sample)
+                        Analysis_fold(ana, tid, newMatrix + i * pitch, i);
+                }
+            } else if (sample) {
+                // Analysis folded into the sweep, whole rows per thread
+                #pragma omp for nowait
+                for (int i = 0; i < rows; i++) {
+                    if (i == 0 || i == rows - 1)
+                        Analysis_fold(ana, tid, newMatrix + (size_t) i * pitch, i);
+                    else
+                        Stencil_row_analyze(matrix + (size_t)(i - 1) * pitch, matrix + (size_t) i * pitch,
+                                            matrix + (size_t)(i + 1) * pitch, newMatrix + (size_t) i * pitch, i, ana, tid);
+                }
+            } else if (nt) {
+                // Whole rows per thread so each output row is one aligned stream
+                #pragma omp for nowait
+                for (size_t i = 1; i < (size_t) rows - 1; i++) {
+                    Stencil_row(matrix + (i - 1) * pitch, matrix + i * pitch, matrix + (i + 1) * pitch,
+                                newMatrix + i * pitch, 1, cols - 1, 1);
+                }
+            } else {
+                #pragma omp for collapse(2) nowait // Parallelize the nested loops
+                for (size_t i = 1; i < (size_t) rows - 1; i++) {
+                    for (size_t j = 1; j < (size_t) cols - 1; j++) {
+                        newMatrix[i * pitch + j] = (
+                            matrix[(i - 1) * pitch + (j - 1)] + matrix[(i - 1) * pitch + j] + matrix[(i - 1) * pitch + (j + 1)] +
+                            matrix[i * pitch + (j - 1)] + matrix[i * pitch + j] + matrix[i * pitch + (j + 1)] +
+                            matrix[(i + 1) * pitch + (j - 1)] + matrix[(i + 1) * pitch + j] + matrix[(i + 1) * pitch + (j + 1)]
+                        ) / 9.0;
+                    }
+                }
+            }
+
+            // Time in the barrier is this thread waiting for the slowest one
+            double t1 = omp_get_wtime();
+            #pragma omp barrier
+            Stats_thread(stats, tid, t1 - t0, omp_get_wtime() - t1);
+
+            if (sample) {
+                for (int s = 1; s < omp_get_num_threads(); s *= 2) {
+                    Analysis_tree(ana, tid, omp_get_num_threads(), s);
+                    #pragma omp barrier
                 }
             }
 
@@ -115,20 +284,46 @@ int main(int argc, char **argv){
                 matrix = newMatrix;
                 newMatrix = temp;
 
+                Stats_iteration(stats, o, matrix, newMatrix, rows, cols, pitch);
+                if (sample)
+                    Analysis_write(ana, o);
+
+                Snapshot_capture(snap, o, matrix, pitch, 0, rows);
+                Cache_checkpoint(cache, matrix, rows, cols, pitch, o, n);
             }
         }
     }
 	 
+	if(fusedRead)
+		Pipe_read_finish(&inPipe);
+
 	GET_TIME(finishWork);
+	finishWorkJ = Energy_read(&energy);
+
+	Stats_close(stats);
+	Snapshot_close(snap);
+	Analysis_close(ana);
  
-	write_memory_to_file(matrix, rows, cols, out);
+	grid.data = matrix;
+	newGrid.data = newMatrix;
+	if(fusedWrite)
+		Pipe_write_finish(&outPipe);
+	else if(out != NULL && update){
+		size_t bytes = Update_grid_file(&grid, out);
+		if(debug >= 1)
+			printf("Updated %zu of %zu bytes of %s\n", bytes, (size_t) rows * cols * sizeof(double), out);
+	}
+	else if(out != NULL)
+		Write_grid(&grid, out);
 
 	 
  
-	free(matrix);
-	if (newMatrix != NULL && newMatrix != matrix) free(newMatrix);
+	Grid_free(&grid);
+	Grid_free(&newGrid);
 
 	GET_TIME(finishOvrll);
+	overallJ = Energy_read(&energy);
+	Energy_close(&energy);
  
 	 
 	double overAllTime = finishOvrll-startOvrll;
@@ -143,11 +338,14 @@ int main(int argc, char **argv){
 	}
   
 	// Write the values to the file
-	fprintf(timeFile, "%d,%d,%d,%f,%f,%.6f,%d\n", n, rows, cols, overAllTime, workTime, diffTime, omp_get_max_threads());
+	fprintf(timeFile, "%d,%d,%d,%f,%f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, omp_get_max_threads());
+	Energy_fields(timeFile, finishWorkJ - startWorkJ, overallJ, workTime, (double)(rows-2)*(cols-2)*(n-start));
   
 	// Close the file
 	fclose(timeFile);
+
+	Roofline_report("omp", (double)(rows-2)*(cols-2), n-start, workTime, omp_get_max_threads(), 1, nt);
  
 	return 0;
  
-}
\ No newline at end of file
+}
\ No newline at end of file
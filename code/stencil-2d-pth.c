@@ -7,6 +7,21 @@
  *
  * Run:      ./stencil-2d-pth.c -t <num iters> -i <in> -o <out> -p <num process>
  *
+ *           -s <file,every,stride[,r0,c0,r1,c1]>: stream binary snapshot frames
+ *           (see stencil-2d.c)
+ *           -N: write the new grid with non-temporal (streaming) stores
+ *           -c <dir>[,<budget MB>]: result cache (see stencil-2d.c)
+ *           -F: fused I/O (see stencil-2d.c); the fused sweeps hand out
+ *           rows in file order
+ *           -u: update the output in place (see stencil-2d.c)
+ *           -g <RxC[/thread]>: build the grid in memory, each thread
+ *           filling the rows it sweeps; /thread makes R rows per thread
+ *           -o is optional: without it the grid is not written
+ *           -a <file,every[,isotherm[,profiles]]>: in-situ analysis (see
+ *           stencil-2d.c); the threads' partial results meet in a tree
+ *           Without -p the thread count (and -N) come from the autotune
+ *           cache for this host and grid size, if there is one.
+ *
  * Input:    Binary file with stencil matrix
  * 
  * Output:   Output stencil matrix binary file
@@ -26,14 +41,14 @@
 
  
  void usage(char **argv){
-	 printf("Usage: %s -t <num iters> -i <in file> -o <out file> -p <num processes>\n", argv[0]);
+	 printf("Usage: %s -t <num iters> (-i <in file> | -g <RxC[/thread]>) [-o <out file>] -p <num processes> [-s <file,every,stride[,r0,c0,r1,c1]>] [-N] [-c <dir>[,<budget MB>]] [-F] [-a <file,every[,isotherm[,profiles]]>] [-u]\n", argv[0]);
  }
  
  // Set arguments
- void setArgs(int argc, char **argv, int *n, char **in, char **out, int *p){
+ void setArgs(int argc, char **argv, int *n, char **in, char **out, int *p, char **snap, int *nt, char **cache, int *fused, char **ana, int *update, char **gen){
 	 int opt;
  
-	 while((opt = getopt(argc, argv, "n:i:o:p:")) != -1){
+	 while((opt = getopt(argc, argv, "n:i:o:p:s:Nc:Fa:ug:")) != -1){
 		 switch(opt){
 			 case 'n':
 				 *n = atoi(optarg);
@@ -47,13 +62,39 @@
 			 case 'p':
 				 *p = atoi(optarg);
 				 break;
+			 case 's':
+				 *snap = optarg;
+				 break;
+			 case 'N':
+				 *nt = 1;
+				 break;
+			 case 'c':
+				 *cache = optarg;
+				 break;
+			 case 'F':
+				 *fused = 1;
+				 break;
+			 case 'a':
+				 *ana = optarg;
+				 break;
+			 case 'u':
+				 *update = 1;
+				 break;
+			 case 'g':
+				 *gen = optarg;
+				 break;
 			 default:
 				 usage(argv);
 				 exit(1);
 		 }
 	 }
-	 if(*in == NULL ||*out == NULL){
-		 perror("Files -i and -o must be provided");
+	 if(*in == NULL && *gen == NULL){
+		 perror("Input file -i (or -g) must be provided");
+		 exit(EXIT_FAILURE);
+	 }
+	 // The autotune cache is keyed by grid size, which /thread derives from p
+	 if(*gen != NULL && strchr(*gen, '/') != NULL && *p < 1){
+		 fprintf(stderr, "Error: -g %s needs -p to size the grid.\n", *gen);
 		 exit(EXIT_FAILURE);
 	 }
 	 
@@ -69,34 +110,106 @@
 	 double finishWork=0;
  
 	 GET_TIME(startOvrll);
+
+	 // ---- Energy, read alongside the timers ----
+	 energy_t energy;
+	 double startWorkJ=0, finishWorkJ=0, overallJ=0;
+	 Energy_open(&energy, 1);
 	 
-	 int n=1,NUM_THREADS=1;
+	 int n=1,NUM_THREADS=0,nt=0,fused=0,update=0;
 	 char *in = NULL;
 	 char *out = NULL;
+	 char *snapSpec = NULL;
+	 char *cacheSpec = NULL;
+	 char *anaSpec = NULL;
+	 char *genSpec = NULL;
 	 
 	 //set args
-	 setArgs(argc, argv, &n, &in, &out, &NUM_THREADS);
+	 setArgs(argc, argv, &n, &in, &out, &NUM_THREADS, &snapSpec, &nt, &cacheSpec, &fused, &anaSpec, &update, &genSpec);
  
+	 grid_t grid, newGrid;
 	 double *matrix;
 	 double *newMatrix;
 	 int rows, cols;
+	 size_t pitch;
  	
-	 Read_matrix(in, &matrix, &rows, &cols);
+	 // -F: read in the background while the first sweep runs
+	 int fusedRead = fused && genSpec == NULL && cacheSpec == NULL && snapSpec == NULL;
+	 pipe_io_t inPipe, outPipe;
+	 // -g: the threads fill their own rows, unless -c or -s need the grid first
+	 int genInThreads = genSpec != NULL && cacheSpec == NULL && snapSpec == NULL;
+	 if(genSpec != NULL){
+		int genRows, genCols;
+		Gen_parse(genSpec, NUM_THREADS, &genRows, &genCols);
+		Grid_alloc(&grid, genRows, genCols);
+		if(!genInThreads)
+			Gen_rows(grid.data, grid.pitch, 0, genRows, genRows, genCols);
+	 }
+	 else if(fusedRead)
+		Pipe_read_start(&inPipe, in, &grid);
+	 else
+		Read_grid(in, &grid);
+	 rows = grid.rows;
+	 cols = grid.cols;
+	 pitch = grid.pitch;
+
+	 if(NUM_THREADS < 1){
+		 tune_entry_t tuned;
+		 NUM_THREADS = 1;
+		 if(Tune_lookup("pth", rows, cols, &tuned)){
+			 NUM_THREADS = tuned.p;
+			 nt |= tuned.nt;
+		 }
+	 }
+
+	 // Start from the furthest cached iteration of this input, if any
+	 result_cache_t cacheStore;
+	 result_cache_t *cache = NULL;
+	 int start = 0;
+	 if(cacheSpec != NULL){
+		cache = &cacheStore;
+		Cache_open(cache, cacheSpec, &grid);
+		start = Cache_resume(cache, &grid, n);
+	 }
 	
-	 newMatrix = malloc(rows * cols * sizeof(double));
-	if (newMatrix == NULL) {
-		fprintf(stderr, "Can't allocate storage\n");
-		exit(-1);
-	}
-	memcpy(newMatrix, matrix, rows * cols * sizeof(double));	 
+	 Grid_alloc(&newGrid, rows, cols);
+	 if(!fusedRead && !genInThreads)
+		memcpy(newGrid.data, grid.data, (size_t) rows * pitch * sizeof(double));	 
+	 matrix = grid.data;
+	 newMatrix = newGrid.data;
+
+	 // The last sweep writes into newMatrix after an odd number of sweeps
+	 int fusedWrite = fused && n > start && out != NULL && !update;
+	 if(fusedWrite)
+		Pipe_write_start(&outPipe, out, (n-start) % 2 ? newMatrix : matrix, rows, cols, pitch);
+
+	 snapshot_t snapStream;
+	 snapshot_t *snap = NULL;
+	 if(snapSpec != NULL){
+		snap = &snapStream;
+		Snapshot_open(snap, snapSpec, rows, cols, 1);
+	 }
+
+	 analysis_t anaStore;
+	 analysis_t *ana = NULL;
+	 if(anaSpec != NULL){
+		ana = &anaStore;
+		Analysis_open(ana, anaSpec, rows, cols, NUM_THREADS, 1);
+	 }
 	 
 	 GET_TIME(startWork);
+	 startWorkJ = Energy_read(&energy);
+
+	 Snapshot_capture(snap, start, newMatrix, pitch, 0, rows);
 
      
+    stats_page_t *stats = Stats_open("pth", genSpec != NULL ? genSpec : in, rows, cols, n, 0, 1, (int) getpid(), NUM_THREADS);
+
     pthread_t threads[NUM_THREADS];
     thread_arg_t targs[NUM_THREADS];
     pthread_barrier_t barrier;
     pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    int nextRow[2] = { 0, 0 };
 
  
     // Create threads
@@ -104,11 +217,22 @@
         targs[t].thread_id = t;
         targs[t].num_threads = NUM_THREADS;
         targs[t].n_iters = n;
+        targs[t].iter0 = start;
         targs[t].rows = rows;
         targs[t].cols = cols;
+        targs[t].pitch = pitch;
+        targs[t].nt = nt;
         targs[t].matrix = matrix;
         targs[t].newMatrix = newMatrix;
         targs[t].barrier = &barrier;
+        targs[t].snap = snap;
+        targs[t].cache = cache;
+        targs[t].in = fusedRead ? &inPipe : NULL;
+        targs[t].out = fusedWrite ? &outPipe : NULL;
+        targs[t].next_row = nextRow;
+        targs[t].stats = stats;
+        targs[t].ana = ana;
+        targs[t].gen = genInThreads;
         pthread_create(&threads[t], NULL, pthread_stencil, (void*) &targs[t]);
     }
 
@@ -122,15 +246,31 @@
     newMatrix = targs[0].newMatrix;
 
     pthread_barrier_destroy(&barrier);
+    if(fusedRead)
+        Pipe_read_finish(&inPipe);
 
     GET_TIME(finishWork);
+    finishWorkJ = Energy_read(&energy);
+
+    Stats_close(stats);
+    Snapshot_close(snap);
+    Analysis_close(ana);
 
-    write_memory_to_file(matrix, rows, cols, out);
+    grid.data = matrix;
+    newGrid.data = newMatrix;
+    if(fusedWrite)
+        Pipe_write_finish(&outPipe);
+    else if(out != NULL && update)
+        Update_grid_file(&grid, out);
+    else if(out != NULL)
+        Write_grid(&grid, out);
 
-    free(matrix);
-    if (newMatrix != NULL && newMatrix != matrix) free(newMatrix);
+    Grid_free(&grid);
+    Grid_free(&newGrid);
 
     GET_TIME(finishOvrll);
+    overallJ = Energy_read(&energy);
+    Energy_close(&energy);
 
     double overAllTime = finishOvrll - startOvrll;
     double workTime = finishWork - startWork;
@@ -142,8 +282,11 @@
         return EXIT_FAILURE;
     }
 
-    fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d\n", n, rows, cols, overAllTime, workTime, diffTime, NUM_THREADS);
+    fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, NUM_THREADS);
+    Energy_fields(timeFile, finishWorkJ - startWorkJ, overallJ, workTime, (double)(rows - 2) * (cols - 2) * (n - start));
     fclose(timeFile);
 
+    Roofline_report("pth", (double)(rows - 2) * (cols - 2), n - start, workTime, NUM_THREADS, 1, nt);
+
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,428 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     stencil-2d-server.c
+ *
+ * Purpose:  Resident stencil server: keep grids in memory and advance them
+ *           on request with a pool of pinned worker threads, so interactive
+ *           and iterative runs don't pay for startup and I/O every time
+ *
+ * Run:      ./stencil-2d-server [-p <threads>] [-S <socket>]
+ *
+ *           -p: worker threads, pinned one per cpu (default: online cpus)
+ *           -S: UNIX socket path (default $STENCIL_SOCKET, else
+ *               /tmp/stencil-2d.sock)
+ *
+ * Input:    One command per connection (see stencil-2d-client):
+ *               load <name> <file>            read a grid and keep it as <name>
+ *               advance <name> <n>            run n more iterations
+ *               snapshot <name> r0,c0,r1,c1   print the window [r0,r1) x [c0,c1)
+ *               write <name> <file>           write the grid (*.t2d: tiled)
+ *               info                          list the resident grids
+ *               free <name>                   drop a grid
+ *               shutdown                      stop the server
+ *
+ * Output:   A reply starting with "ok" or "error" on the same connection
+ *
+ * Errors:   Usage errors and socket errors stop the server; errors in a
+ *           command are reported to the client
+ *
+ * Notes:    File names are opened by the server, relative to the directory
+ *           it was started in. Files are checked before they are read or
+ *           written, since the shared readers and writers exit on errors
+ *           and a bad command must not take the resident grids with it.
+ *           The socket is only accessible to the user running the server.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "utilities.c"
+
+#define SERVER_SOCKET  "/tmp/stencil-2d.sock"
+#define MAX_GRIDS      16
+#define MAX_LINE       4096
+
+// One resident simulation
+typedef struct {
+    char name[64];
+    grid_t cur, next;
+    long iters;              // iterations run since load
+    int used;
+} resident_t;
+
+// Worker pool: the main thread hands out a job through the start barrier
+// and waits for it on the done barrier; workers sync each sweep on step
+typedef struct {
+    int nthreads;
+    pthread_t *threads;
+    pthread_barrier_t start, step, done;
+    resident_t *job;
+    int n;
+    int quit;
+} pool_t;
+
+typedef struct {
+    pool_t *pool;
+    int id;
+} worker_arg_t;
+
+static resident_t grids[MAX_GRIDS];
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-p <threads>] [-S <socket>]\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   pool_worker
+ * Purpose:    Pin to a cpu, then run the sweeps of every job handed out,
+ *             one band of rows per worker
+ */
+void* pool_worker(void *arg) {
+    worker_arg_t *w = (worker_arg_t*) arg;
+    pool_t *pool = w->pool;
+    cpu_set_t set;
+    int ncpu = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(w->id % (ncpu > 0 ? ncpu : 1), &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit)
+            break;
+
+        resident_t *r = pool->job;
+        int rows = r->cur.rows, cols = r->cur.cols;
+        size_t pitch = r->cur.pitch;
+        size_t lo = MAX(1, BLOCK_LOW(w->id, pool->nthreads, rows));
+        size_t hi = MIN(rows - 1, BLOCK_HIGH(w->id, pool->nthreads, rows) + 1);
+        double *A = r->cur.data, *B = r->next.data;
+
+        for (int o = 0; o < pool->n; o++) {
+            for (size_t i = lo; i < hi; i++) {
+                Stencil_row(A + (i - 1) * pitch, A + i * pitch, A + (i + 1) * pitch, B + i * pitch, 1, cols - 1, 0);
+            }
+            double *temp = A;
+            A = B;
+            B = temp;
+            pthread_barrier_wait(&pool->step);
+        }
+        pthread_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Pool_advance
+ * Purpose:    Run n iterations of a resident grid on the pool
+ */
+void Pool_advance(pool_t *pool, resident_t *r, int n) {
+    pool->job = r;
+    pool->n = n;
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+
+    if (n % 2 == 1) {
+        grid_t temp = r->cur;
+        r->cur = r->next;
+        r->next = temp;
+    }
+    r->iters += n;
+}
+
+
+static resident_t* Find_grid(const char *name) {
+    for (int k = 0; k < MAX_GRIDS; k++) {
+        if (grids[k].used && strcmp(grids[k].name, name) == 0)
+            return &grids[k];
+    }
+    return NULL;
+}
+
+
+static void Drop_grid(resident_t *r) {
+    Grid_free(&r->cur);
+    Grid_free(&r->next);
+    r->used = 0;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Check_grid_file
+ * Purpose:    Make sure Read_grid will get through a file: a regular file
+ *             whose header is sane and whose size covers every row (raw)
+ *             or every tile in the index (tiled)
+ * Out args:   rows, cols: the matrix size
+ *             why: the reason when the file is refused
+ * Returns:    1 if the file can be read, 0 otherwise
+ */
+static int Check_grid_file(const char *file, int *rows, int *cols, char *why, size_t len) {
+    int header[TILED_HEADER_INTS] = { 0 };
+    struct stat st;
+    int ok = 0;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        snprintf(why, len, "cannot read %s", file);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    ssize_t got = pread(fd, header, sizeof(header), 0);
+    int tiled = got >= (ssize_t) sizeof(int) && header[0] == TILED_MAGIC;
+    *rows = header[tiled];
+    *cols = header[tiled + 1];
+
+    if (got < (ssize_t)(2 * sizeof(int)) || *rows <= 0 || *cols <= 0) {
+        snprintf(why, len, "%s has no valid matrix header", file);
+    } else if (!tiled) {
+        size_t need = 2 * sizeof(int) + (size_t) *rows * (size_t) *cols * sizeof(double);
+        if ((size_t) st.st_size < need)
+            snprintf(why, len, "%s is truncated (%lld of %zu bytes)", file, (long long) st.st_size, need);
+        else
+            ok = 1;
+    } else if (got != (ssize_t) sizeof(header) || header[3] <= 0 || header[4] != CEILING(*rows, header[3])) {
+        snprintf(why, len, "%s has an invalid tiled header", file);
+    } else {
+        size_t index_bytes = (size_t) header[4] * sizeof(tile_entry_t);
+        tile_entry_t *index = malloc(index_bytes);
+        ok = index != NULL && pread(fd, index, index_bytes, sizeof(header)) == (ssize_t) index_bytes;
+        for (int t = 0; ok && t < header[4]; t++)
+            ok = index[t].bytes > 0 && index[t].offset + index[t].bytes <= (uint64_t) st.st_size;
+        if (!ok)
+            snprintf(why, len, "%s is truncated", file);
+        free(index);
+    }
+    close(fd);
+    return ok;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Serve
+ * Purpose:    Run one command and write the reply
+ * In args:    pool, line: the command
+ * Out arg:    out: the connection
+ * Returns:    1 if the server should stop
+ */
+int Serve(pool_t *pool, char *line, FILE *out) {
+    char cmd[32] = "", name[64] = "", arg[MAX_LINE] = "";
+    int words = sscanf(line, "%31s %63s %4095s", cmd, name, arg);
+    resident_t *r = words >= 2 ? Find_grid(name) : NULL;
+
+    if (strcmp(cmd, "load") == 0 && words == 3) {
+        int rows, cols;
+        char why[MAX_LINE + 64];
+        if (!Check_grid_file(arg, &rows, &cols, why, sizeof(why))) {
+            fprintf(out, "error %s\n", why);
+            return 0;
+        }
+        if (r == NULL) {
+            for (int k = 0; k < MAX_GRIDS && r == NULL; k++)
+                if (!grids[k].used) r = &grids[k];
+            if (r == NULL) {
+                fprintf(out, "error all %d grid slots are in use\n", MAX_GRIDS);
+                return 0;
+            }
+        }
+
+        // A grid being reloaded stays until the new one is in
+        double t0, t1;
+        grid_t cur, next;
+        GET_TIME(t0);
+        Read_grid(arg, &cur);
+        Grid_alloc(&next, cur.rows, cur.cols);
+        memcpy(next.data, cur.data, (size_t) cur.rows * cur.pitch * sizeof(double));
+        GET_TIME(t1);
+        if (r->used)
+            Drop_grid(r);
+        r->cur = cur;
+        r->next = next;
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        r->iters = 0;
+        r->used = 1;
+        fprintf(out, "ok %s %dx%d loaded in %.6f s\n", name, rows, cols, t1 - t0);
+
+    } else if (strcmp(cmd, "advance") == 0 && words == 3) {
+        int n = atoi(arg);
+        if (r == NULL || n < 0) {
+            fprintf(out, "error %s\n", r == NULL ? "no such grid" : "bad iteration count");
+            return 0;
+        }
+        double t0, t1;
+        GET_TIME(t0);
+        Pool_advance(pool, r, n);
+        GET_TIME(t1);
+        fprintf(out, "ok %s iteration %ld (%d in %.6f s)\n", name, r->iters, n, t1 - t0);
+
+    } else if (strcmp(cmd, "snapshot") == 0 && words == 3) {
+        int r0, c0, r1, c1;
+        if (r == NULL || sscanf(arg, "%d,%d,%d,%d", &r0, &c0, &r1, &c1) != 4 ||
+            r0 < 0 || c0 < 0 || r1 > r->cur.rows || c1 > r->cur.cols || r0 >= r1 || c0 >= c1) {
+            fprintf(out, "error %s\n", r == NULL ? "no such grid" : "bad window");
+            return 0;
+        }
+        fprintf(out, "ok %s iteration %ld window %d,%d,%d,%d\n", name, r->iters, r0, c0, r1, c1);
+        for (int i = r0; i < r1; i++) {
+            const double *row = r->cur.data + (size_t) i * r->cur.pitch;
+            for (int j = c0; j < c1; j++)
+                fprintf(out, "%6.2f ", row[j]);
+            fprintf(out, "\n");
+        }
+
+    } else if (strcmp(cmd, "write") == 0 && words == 3) {
+        if (r == NULL) {
+            fprintf(out, "error no such grid\n");
+            return 0;
+        }
+        struct stat st;
+        int fd = open(arg, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            fprintf(out, "error cannot write %s\n", arg);
+            if (fd >= 0) close(fd);
+            return 0;
+        }
+        close(fd);
+
+        double t0, t1;
+        GET_TIME(t0);
+        Write_grid(&r->cur, arg);
+        GET_TIME(t1);
+        fprintf(out, "ok %s iteration %ld written to %s in %.6f s\n", name, r->iters, arg, t1 - t0);
+
+    } else if (strcmp(cmd, "free") == 0 && words == 2) {
+        if (r == NULL) {
+            fprintf(out, "error no such grid\n");
+            return 0;
+        }
+        Drop_grid(r);
+        fprintf(out, "ok %s freed\n", name);
+
+    } else if (strcmp(cmd, "info") == 0 && words == 1) {
+        fprintf(out, "ok %d threads\n", pool->nthreads);
+        for (int k = 0; k < MAX_GRIDS; k++) {
+            if (grids[k].used)
+                fprintf(out, "%s %dx%d iteration %ld\n", grids[k].name, grids[k].cur.rows, grids[k].cur.cols, grids[k].iters);
+        }
+
+    } else if (strcmp(cmd, "shutdown") == 0 && words == 1) {
+        fprintf(out, "ok shutting down\n");
+        return 1;
+
+    } else {
+        fprintf(out, "error unknown command: %s", line);
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char *path = getenv("STENCIL_SOCKET") != NULL ? getenv("STENCIL_SOCKET") : SERVER_SOCKET;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:S:")) != -1) {
+        switch (opt) {
+            case 'p': nthreads = atoi(optarg); break;
+            case 'S': path = optarg; break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc || nthreads < 1) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    // Only a stale socket is replaced, never some other file
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: '%s' exists and is not a socket.\n", path);
+            exit(EXIT_FAILURE);
+        }
+        unlink(path);
+    }
+
+    // Created 0600: the server reads and writes files as its user
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077);
+    int bound = sock >= 0 && bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(sock, 8) != 0) {
+        fprintf(stderr, "Error: Unable to listen on '%s'.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);   // a client hanging up must not stop the server
+
+    // Warm pool: the workers live as long as the server
+    pool_t pool = { .nthreads = nthreads, .quit = 0 };
+    worker_arg_t *wargs = malloc(nthreads * sizeof(worker_arg_t));
+    pool.threads = malloc(nthreads * sizeof(pthread_t));
+    if (wargs == NULL || pool.threads == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&pool.start, NULL, nthreads + 1);
+    pthread_barrier_init(&pool.done, NULL, nthreads + 1);
+    pthread_barrier_init(&pool.step, NULL, nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        wargs[t] = (worker_arg_t){ .pool = &pool, .id = t };
+        pthread_create(&pool.threads[t], NULL, pool_worker, &wargs[t]);
+    }
+
+    printf("stencil-2d-server: %d threads on %s\n", nthreads, path);
+    fflush(stdout);
+
+    int stop = 0;
+    while (!stop) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+            continue;
+
+        FILE *in = fdopen(conn, "r");
+        FILE *out = fdopen(dup(conn), "w");
+        char line[MAX_LINE];
+        if (in != NULL && out != NULL && fgets(line, sizeof(line), in) != NULL)
+            stop = Serve(&pool, line, out);
+        if (out != NULL) fclose(out);
+        if (in != NULL) fclose(in);
+    }
+
+    pool.quit = 1;
+    pthread_barrier_wait(&pool.start);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(pool.threads[t], NULL);
+    pthread_barrier_destroy(&pool.start);
+    pthread_barrier_destroy(&pool.step);
+    pthread_barrier_destroy(&pool.done);
+
+    for (int k = 0; k < MAX_GRIDS; k++)
+        if (grids[k].used) Drop_grid(&grids[k]);
+    free(pool.threads);
+    free(wargs);
+    close(sock);
+    unlink(path);
+    return 0;
+}
@@ -13,6 +13,34 @@
  *		1: basic debugging information (file sizes, names, etc.). Minimal output
  *  	2: verbose output. Print state of matrix after each iteration, like this:
  *
+ *      -s <file,every,stride[,r0,c0,r1,c1]>: stream a binary snapshot frame of the
+ *      (optionally cropped) grid every <every> iterations, keeping every <stride>-th
+ *      row and column. Frames are written by a background thread.
+ *
+ *      -N: write the new grid with non-temporal (streaming) stores
+ *
+ *      -c <dir>[,<budget MB>]: result cache. Resume from the cached grid with
+ *      the most iterations <= n of this input, and store the result (and
+ *      power-of-two checkpoints) there. Shared by all the backends.
+ *
+ *      -F: fused I/O. The first sweep starts on the rows already read while
+ *      the rest of the input is still arriving, and the last sweep's rows
+ *      are written as they are finished. The read is not fused with -c, -s
+ *      or -v 2, which need the whole input first.
+ *
+ *      -u: update the output in place: only row bands whose checksum differs
+ *      from the one recorded in <out>.sum are rewritten (see _UPDATE_H_).
+ *
+ *      -g <RxC>: build an R x C grid like make-2d's in memory instead of
+ *      reading -i (see _GEN_H_).
+ *
+ *      -a <file,every[,isotherm[,profiles]]>: in-situ analysis. Every <every>
+ *      iterations and after the last, write min/max/mean, total heat and
+ *      isotherm crossings (and with profiles=1, row and column profiles),
+ *      computed inside the sweep.
+ *
+ *      -o is optional: without it the grid is not written.
+ *
  * Input:    Binary file with stencil matrix
  * 
  * Output:   Output stencil matrix binary file
@@ -30,14 +58,14 @@
  
  
  void usage(char **argv){
-	 printf("Usage: %s -n <num iters> -i <in file> -o <out file> -d <debug: 0,1,2>\n", argv[0]);
+	 printf("Usage: %s -n <num iters> (-i <in file> | -g <RxC>) [-o <out file>] -d <debug: 0,1,2> [-s <file,every,stride[,r0,c0,r1,c1]>] [-N] [-c <dir>[,<budget MB>]] [-F] [-a <file,every[,isotherm[,profiles]]>] [-u]\n", argv[0]);
  }
  
  // Set arguments
- void setArgs(int argc, char **argv, int *n, char **in, char **out, int *debug){
+ void setArgs(int argc, char **argv, int *n, char **in, char **out, int *debug, char **snap, int *nt, char **cache, int *fused, char **ana, int *update, char **gen){
 	 int opt;
  
-	 while((opt = getopt(argc, argv, "n:i:o:v:")) != -1){
+	 while((opt = getopt(argc, argv, "n:i:o:v:s:Nc:Fa:ug:")) != -1){
 		 switch(opt){
 			 case 'n':
 				 *n = atoi(optarg);
@@ -51,13 +79,34 @@
 			 case 'v':
 				 *debug = atoi(optarg);
 				 break;
+			 case 's':
+				 *snap = optarg;
+				 break;
+			 case 'N':
+				 *nt = 1;
+				 break;
+			 case 'c':
+				 *cache = optarg;
+				 break;
+			 case 'F':
+				 *fused = 1;
+				 break;
+			 case 'a':
+				 *ana = optarg;
+				 break;
+			 case 'u':
+				 *update = 1;
+				 break;
+			 case 'g':
+				 *gen = optarg;
+				 break;
 			 default:
 				 usage(argv);
 				 exit(1);
 		 }
 	 }
-	 if(*in == NULL ||*out == NULL){
-		 perror("Files -i and -o must be provided");
+	 if(*in == NULL && *gen == NULL){
+		 perror("Input file -i (or -g) must be provided");
 		 exit(EXIT_FAILURE);
 	 }
 	 
@@ -72,74 +121,181 @@
 	 double finishWork=0;
  
 	 GET_TIME(startOvrll);
+
+	 // ---- Energy, read alongside the timers ----
+	 energy_t energy;
+	 double startWorkJ=0, finishWorkJ=0, overallJ=0;
+	 Energy_open(&energy, 1);
 	 
-	 int n=1,debug=0;
+	 int n=1,debug=0,nt=0,fused=0,update=0;
 	 char *in = NULL;
 	 char *out = NULL;
+	 char *snapSpec = NULL;
+	 char *cacheSpec = NULL;
+	 char *anaSpec = NULL;
+	 char *genSpec = NULL;
 	 
 	 //set args
-	 setArgs(argc, argv, &n, &in, &out, &debug);
+	 setArgs(argc, argv, &n, &in, &out, &debug, &snapSpec, &nt, &cacheSpec, &fused, &anaSpec, &update, &genSpec);
  
+	 grid_t grid, newGrid;
 	 double *matrix;
 	 double *newMatrix;
 	 int rows, cols;
+	 size_t pitch;
  	
-	 Read_matrix(in, &matrix, &rows, &cols);
+	 // -F: read in the background while the first sweep runs
+	 int fusedRead = fused && genSpec == NULL && cacheSpec == NULL && snapSpec == NULL && debug < 2;
+	 pipe_io_t inPipe, outPipe;
+	 if(genSpec != NULL){
+		int genRows, genCols;
+		Gen_parse(genSpec, 1, &genRows, &genCols);
+		Grid_alloc(&grid, genRows, genCols);
+		Gen_rows(grid.data, grid.pitch, 0, genRows, genRows, genCols);
+	 }
+	 else if(fusedRead)
+		Pipe_read_start(&inPipe, in, &grid);
+	 else
+		Read_grid(in, &grid);
+	 rows = grid.rows;
+	 cols = grid.cols;
+	 pitch = grid.pitch;
+
+	 // Start from the furthest cached iteration of this input, if any
+	 result_cache_t cacheStore;
+	 result_cache_t *cache = NULL;
+	 int start = 0;
+	 if(cacheSpec != NULL){
+		cache = &cacheStore;
+		Cache_open(cache, cacheSpec, &grid);
+		start = Cache_resume(cache, &grid, n);
+		if(debug >= 1 && start > 0)
+			printf("Resuming from cached iteration %d\n", start);
+	 }
 	
-	 newMatrix = malloc(rows * cols * sizeof(double));
-	if (newMatrix == NULL) {
-		fprintf(stderr, "Can't allocate storage\n");
-		exit(-1);
-	}
-	memcpy(newMatrix, matrix, rows * cols * sizeof(double));	 
+	 Grid_alloc(&newGrid, rows, cols);
+	 if(!fusedRead)
+		memcpy(newGrid.data, grid.data, (size_t) rows * pitch * sizeof(double));	 
+	 matrix = grid.data;
+	 newMatrix = newGrid.data;
+
+	 // The last sweep writes into newMatrix after an odd number of sweeps
+	 int fusedWrite = fused && n > start && out != NULL && !update;
+	 if(fusedWrite)
+		Pipe_write_start(&outPipe, out, (n-start) % 2 ? newMatrix : matrix, rows, cols, pitch);
+
+	 snapshot_t snapStream;
+	 snapshot_t *snap = NULL;
+	 if(snapSpec != NULL){
+		snap = &snapStream;
+		Snapshot_open(snap, snapSpec, rows, cols, 1);
+	 }
+
+	 analysis_t anaStore;
+	 analysis_t *ana = NULL;
+	 if(anaSpec != NULL){
+		ana = &anaStore;
+		Analysis_open(ana, anaSpec, rows, cols, 1, 1);
+	 }
 	 
 	 GET_TIME(startWork);
+	 startWorkJ = Energy_read(&energy);
+
+	 Snapshot_capture(snap, start, newMatrix, pitch, 0, rows);
  
 	 if(debug==2){
-		printf("Iteration 0:\n");
-		Print_matrix(newMatrix,rows,cols);
+		printf("Iteration %d:\n", start);
+		Print_matrix(newMatrix,rows,cols,pitch);
 		printf("\n");
 	 }
 
+	 stats_page_t *stats = Stats_open("serial", genSpec != NULL ? genSpec : in, rows, cols, n, 0, 1, (int) getpid(), 1);
+
 	 // Loop iterations
-	 for(int o=1; o<=n; o++){
-		 // Loop rows
-		 for(int i=1;i<rows-1;i++){
-			 //Loop Cols
-			 for(int j=1; j<cols-1;j++){
-				 newMatrix[i * cols + j] = (
-					 matrix[(i-1) * cols + (j-1)] + matrix[(i-1) * cols + j] + matrix[(i-1) * cols + (j+1)] +
-					 matrix[i * cols + (j-1)]     + matrix[i * cols + j]     + matrix[i * cols + (j+1)] +
-					 matrix[(i+1) * cols + (j-1)] + matrix[(i+1) * cols + j] + matrix[(i+1) * cols + (j+1)]
-				 ) / 9.0;
-				  
+	 for(int o=start+1; o<=n; o++){
+		 double t0, t1;
+		 GET_TIME(t0);
+		 pipe_io_t *pin = fusedRead && o == start+1 ? &inPipe : NULL;
+		 pipe_io_t *pout = fusedWrite && o == n ? &outPipe : NULL;
+		 int sample = Analysis_due(ana, o, n);
+		 if(sample)
+			 Analysis_reset(ana, 0);
+		 if(pin != NULL || pout != NULL){
+			 // Fused sweep: every row, boundaries included
+			 for(int i=0;i<rows;i++){
+				 Pipe_row(pin, pout, matrix, newMatrix, i, rows, cols, pitch, nt);
+				 if(sample)
+					 Analysis_fold(ana, 0, newMatrix + i * pitch, i);
+			 }
+		 } else if(sample){
+			 // Analysis folded into the sweep, boundary rows as they are
+			 Analysis_fold(ana, 0, newMatrix, 0);
+			 for(size_t i=1;i<(size_t) rows-1;i++)
+				 Stencil_row_analyze(matrix + (i-1) * pitch, matrix + i * pitch, matrix + (i+1) * pitch,
+				                     newMatrix + i * pitch, i, ana, 0);
+			 Analysis_fold(ana, 0, newMatrix + (size_t)(rows-1) * pitch, rows-1);
+		 } else {
+			 // Loop rows
+			 for(size_t i=1;i<(size_t) rows-1;i++){
+				 //Loop Cols
+				 Stencil_row(matrix + (i-1) * pitch, matrix + i * pitch, matrix + (i+1) * pitch,
+				             newMatrix + i * pitch, 1, cols-1, nt);
 			 }
-			 
 		 }
+		 GET_TIME(t1);
+
+		 if(sample)
+			 Analysis_write(ana, o);
 
 		 double* temp = matrix;
 		 matrix = newMatrix;
 		 newMatrix = temp;
 
+		 Stats_thread(stats, 0, t1-t0, 0.0);
+		 Stats_iteration(stats, o, matrix, newMatrix, rows, cols, pitch);
+
+		 Snapshot_capture(snap, o, matrix, pitch, 0, rows);
+		 Cache_checkpoint(cache, matrix, rows, cols, pitch, o, n);
+
 		 if(debug==2){
 			printf("Iteration %d:\n",o);
-			Print_matrix(matrix,rows,cols);
+			Print_matrix(matrix,rows,cols,pitch);
 			printf("\n");
 		 }
 
 	 }
  
 	 
+	 if(fusedRead)
+		Pipe_read_finish(&inPipe);
+
 	 GET_TIME(finishWork);
+	 finishWorkJ = Energy_read(&energy);
+
+	 Stats_close(stats);
+	 Snapshot_close(snap);
+	 Analysis_close(ana);
  
-	 write_memory_to_file(matrix, rows, cols, out);
+	 grid.data = matrix;
+	 newGrid.data = newMatrix;
+	 if(fusedWrite)
+		Pipe_write_finish(&outPipe);
+	 else if(out != NULL && update){
+		size_t bytes = Update_grid_file(&grid, out);
+		if(debug >= 1)
+			printf("Updated %zu of %zu bytes of %s\n", bytes, (size_t) rows * cols * sizeof(double), out);
+	 }
+	 else if(out != NULL)
+		Write_grid(&grid, out);
 
 	 
  
-	 free(matrix);
-	 if (newMatrix != NULL && newMatrix != matrix) free(newMatrix);
+	 Grid_free(&grid);
+	 Grid_free(&newGrid);
 
 	 GET_TIME(finishOvrll);
+	 overallJ = Energy_read(&energy);
+	 Energy_close(&energy);
  
 	 
 	 double overAllTime = finishOvrll-startOvrll;
@@ -154,10 +310,13 @@
 	 }
   
 	 // Write the values to the file
-	 fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d\n", n, rows, cols, overAllTime, workTime, diffTime, 1);
+	 fprintf(timeFile, "%d,%d,%d,%.6f,%.6f,%.6f,%d", n, rows, cols, overAllTime, workTime, diffTime, 1);
+	 Energy_fields(timeFile, finishWorkJ - startWorkJ, overallJ, workTime, (double)(rows-2)*(cols-2)*(n-start));
   
 	 // Close the file
 	 fclose(timeFile);
+
+	 Roofline_report("serial", (double)(rows-2)*(cols-2), n-start, workTime, 1, 1, nt);
  
 	 return 0;
  
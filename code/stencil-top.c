@@ -0,0 +1,296 @@
+/*
+ * Author:   Justin LaForge Kyle Wallace
+ *
+ * File:     stencil-top.c
+ *
+ * Purpose:  Watch running stencil jobs through the stats pages the
+ *           drivers keep in $STENCIL_STATS_DIR (default /dev/shm)
+ *
+ * Run:      ./stencil-top [-d <seconds>] [-1]
+ *
+ *           -d: refresh interval (default 1)
+ *           -1: print once and exit
+ *
+ * Output:   Per job (all ranks of one run): the grid, and per rank its
+ *           iteration, rate, residual, elapsed time and ETA, then the
+ *           compute and wait time of every thread. Ranks and threads that
+ *           compute over 10% slower than their peers are marked "slow", a
+ *           page that hasn't moved in a long while "STALLED", and a page
+ *           whose process is gone "dead".
+ *
+ * Errors:   Usage errors
+ *
+ * Notes:    Pages are only read, never locked: a header that changes while
+ *           it is copied is simply copied again, so watching a job does
+ *           not slow it down.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include "utilities.c"
+
+#define TOP_MAX_PAGES 1024
+#define TOP_SLOW      1.1       // compute per iteration over the mean that is "slow"
+#define TOP_STALL     5.0       // seconds without progress before a page can be "STALLED"
+
+typedef struct {
+    stats_page_t page;       // consistent copy
+    int dead;
+    double rate;             // iterations per second
+    double per_iter;         // compute seconds per iteration, over all slots
+} top_entry_t;
+
+typedef struct {
+    int pid;
+    uint64_t iter;
+    double updated;
+} top_sample_t;
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-d <seconds>] [-1]\n", argv[0]);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Read_page
+ * Purpose:    Copy a stats page, retrying while its writer is mid-update
+ * Returns:    1 on a consistent copy of a live page, 0 otherwise
+ */
+int Read_page(const char *path, stats_page_t *copy) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(stats_page_t)) {
+        close(fd);
+        return 0;
+    }
+    const stats_page_t *s = mmap(NULL, sizeof(stats_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+        return 0;
+
+    int ok = 0;
+    for (int tries = 0; tries < 1000 && !ok; tries++) {
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(copy, s, sizeof(stats_page_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        ok = __atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq;
+    }
+    munmap((void *) s, sizeof(stats_page_t));
+    return ok && copy->magic == STATS_MAGIC && !copy->done;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Scan_pages
+ * Purpose:    Read every page in the stats directory
+ * Returns:    number of entries filled
+ */
+int Scan_pages(top_entry_t *pages, int max) {
+    const char *dir = Stats_dir();
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+
+    int count = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL && count < max) {
+        size_t len = strlen(e->d_name);
+        if (strncmp(e->d_name, "stencil-", 8) != 0 || len < 6 || strcmp(e->d_name + len - 6, ".stats") != 0)
+            continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (Read_page(path, &pages[count].page))
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+
+int Compare_pages(const void *a, const void *b) {
+    const stats_page_t *x = &((const top_entry_t *) a)->page, *y = &((const top_entry_t *) b)->page;
+    if (x->job != y->job)
+        return x->job < y->job ? -1 : 1;
+    return x->rank - y->rank;
+}
+
+
+void Format_secs(double s, char *buf, size_t len) {
+    if (s < 0)
+        snprintf(buf, len, "-");
+    else if (s < 3600)
+        snprintf(buf, len, "%d:%02d", (int) s / 60, (int) s % 60);
+    else
+        snprintf(buf, len, "%d:%02d:%02d", (int) s / 3600, ((int) s / 60) % 60, (int) s % 60);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Show_slots
+ * Purpose:    One line per thread of a page with more than one
+ */
+void Show_slots(const stats_page_t *p) {
+    if (p->nslots < 2)
+        return;
+
+    double mean = 0.0;
+    for (int t = 0; t < p->nslots; t++)
+        mean += p->slot[t].iter ? p->slot[t].compute / p->slot[t].iter : 0.0;
+    mean /= p->nslots;
+
+    for (int t = 0; t < p->nslots; t++) {
+        const stats_slot_t *sl = &p->slot[t];
+        double busy = sl->compute + sl->wait;
+        double per = sl->iter ? sl->compute / sl->iter : 0.0;
+        printf("      thread %3d  iter %7llu  compute %9.3fs  wait %9.3fs (%5.1f%%)%s\n",
+               t, (unsigned long long) sl->iter, sl->compute, sl->wait,
+               busy > 0 ? 100.0 * sl->wait / busy : 0.0,
+               mean > 0 && per > TOP_SLOW * mean ? "  slow" : "");
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Show_jobs
+ * Purpose:    Print every page, grouped by job, with rates measured since
+ *             the previous refresh (prev, nprev), and remember this one
+ */
+void Show_jobs(top_entry_t *pages, int count, top_sample_t *prev, int *nprev) {
+    double now;
+    char host[64];
+    GET_TIME(now);
+    if (gethostname(host, sizeof(host)) != 0)
+        host[0] = '\0';
+    host[sizeof(host) - 1] = '\0';
+
+    qsort(pages, count, sizeof(top_entry_t), Compare_pages);
+
+    for (int k = 0; k < count; k++) {
+        top_entry_t *e = &pages[k];
+        stats_page_t *p = &e->page;
+
+        e->rate = p->updated > p->start ? p->iter / (p->updated - p->start) : 0.0;
+        for (int j = 0; j < *nprev; j++)
+            if (prev[j].pid == p->pid && p->updated > prev[j].updated)
+                e->rate = (p->iter - prev[j].iter) / (p->updated - prev[j].updated);
+
+        double compute = 0.0;
+        uint64_t iters = 0;
+        for (int t = 0; t < p->nslots; t++) {
+            compute += p->slot[t].compute;
+            iters += p->slot[t].iter;
+        }
+        e->per_iter = iters ? compute / iters : 0.0;
+
+        // Only a local pid can be checked
+        e->dead = strcmp(p->host, host) == 0 && kill(p->pid, 0) != 0 && errno == ESRCH;
+    }
+
+    for (int first = 0; first < count; ) {
+        int last = first;
+        while (last < count && pages[last].page.job == pages[first].page.job)
+            last++;
+
+        const stats_page_t *head = &pages[first].page;
+        double mean = 0.0;
+        for (int k = first; k < last; k++)
+            mean += pages[k].per_iter;
+        mean /= last - first;
+
+        printf("job %d  %s  %s  %dx%d  %d iterations  %d/%d ranks\n", head->job, head->backend,
+               head->input, head->rows, head->cols, head->n, last - first, head->size);
+        printf("  rank  host              pid      iter/n           it/s    residual   elapsed       ETA\n");
+
+        for (int k = first; k < last; k++) {
+            const top_entry_t *e = &pages[k];
+            const stats_page_t *p = &e->page;
+            char elapsed[32], eta[32], residual[32];
+
+            Format_secs(now - p->start, elapsed, sizeof(elapsed));
+            Format_secs(e->rate > 0 ? (p->n - (double) p->iter) / e->rate : -1.0, eta, sizeof(eta));
+            if (p->residual < 0)
+                snprintf(residual, sizeof(residual), "n/a");
+            else
+                snprintf(residual, sizeof(residual), "%.3e", p->residual);
+
+            // A page is stalled when it has gone quiet for far longer than an iteration takes
+            double iter_time = p->iter > 0 ? (p->updated - p->start) / p->iter : 0.0;
+            int stalled = p->iter < (uint64_t) p->n && now - p->updated > MAX(TOP_STALL, 10.0 * iter_time);
+
+            printf("  %4d  %-16.16s  %-7d  %7llu/%-7d  %8.2f  %10s  %8s  %8s%s%s%s\n",
+                   p->rank, p->host, p->pid, (unsigned long long) p->iter, p->n, e->rate,
+                   residual, elapsed, eta,
+                   mean > 0 && last - first > 1 && e->per_iter > TOP_SLOW * mean ? "  slow" : "",
+                   stalled ? "  STALLED" : "", e->dead ? "  dead" : "");
+            Show_slots(p);
+        }
+        printf("\n");
+        first = last;
+    }
+
+    *nprev = 0;
+    for (int k = 0; k < count && *nprev < TOP_MAX_PAGES; k++) {
+        prev[*nprev].pid = pages[k].page.pid;
+        prev[*nprev].iter = pages[k].page.iter;
+        prev[*nprev].updated = pages[k].page.updated;
+        (*nprev)++;
+    }
+}
+
+
+int main(int argc, char **argv) {
+    double delay = 1.0;
+    int once = 0, opt;
+
+    while ((opt = getopt(argc, argv, "d:1")) != -1) {
+        switch (opt) {
+            case 'd':
+                delay = atof(optarg);
+                break;
+            case '1':
+                once = 1;
+                break;
+            default:
+                usage(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc || delay <= 0) {
+        usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    top_entry_t *pages = malloc(TOP_MAX_PAGES * sizeof(top_entry_t));
+    top_sample_t *prev = malloc(TOP_MAX_PAGES * sizeof(top_sample_t));
+    if (pages == NULL || prev == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    int nprev = 0;
+
+    for (;;) {
+        int count = Scan_pages(pages, TOP_MAX_PAGES);
+        if (!once)
+            printf("\033[H\033[2J");
+        printf("stencil-top  %s  %d process(es)\n\n", Stats_dir(), count);
+        Show_jobs(pages, count, prev, &nprev);
+        fflush(stdout);
+        if (once)
+            break;
+        usleep((useconds_t)(delay * 1e6));
+    }
+
+    free(pages);
+    free(prev);
+    return 0;
+}
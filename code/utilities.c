@@ -2,6 +2,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h> // For log and power
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "utilities.h"
  #include <pthread.h>
 //#include <mpi.h>
@@ -20,15 +29,408 @@ void Create_stencil(
     int     m         /* in  */, 
     int     n         /* in  */) {
     
-    int i, j;
-    for (i = 0; i < m; i++) {
-        for (j = 0; j < n; j++) {
-            if(j==0 || j==n-1){
-                A[i * n + j] = 1;
-            } else {
-                A[i * n + j] = 0;
-            }
+    stencil_bc_t bc = STENCIL_BC_DEFAULT;
+    Fill_stencil_rows(A, 0, m, m, n, &bc);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Fill_stencil_rows
+ * Purpose:    Fill rows [row_lo, row_hi) of an m x n stencil matrix.
+ *             Columns 0 and n-1 hold the left/right values (corners
+ *             included), rows 0 and m-1 the top/bottom values and every
+ *             other cell the interior value.
+ * In args:    row_lo:  first global row to fill
+ *             row_hi:  one past the last global row to fill
+ *             m:       number of rows of the whole matrix
+ *             n:       number of cols
+ *             bc:      boundary and interior values
+ * Out arg:    A:       the rows, A[0] is global row row_lo
+ */
+void Fill_stencil_rows(
+    double              A[]     /* out */,
+    int                 row_lo  /* in  */,
+    int                 row_hi  /* in  */,
+    int                 m       /* in  */,
+    int                 n       /* in  */,
+    const stencil_bc_t *bc      /* in  */) {
+
+    for (int i = row_lo; i < row_hi; i++) {
+        double *row = A + (size_t)(i - row_lo) * n;
+        double fill = i == 0 ? bc->top : (i == m - 1 ? bc->bottom : bc->interior);
+        for (int j = 1; j < n - 1; j++) {
+            row[j] = fill;
+        }
+        row[0] = bc->left;
+        row[n - 1] = bc->right;
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Gen_parse
+ * Purpose:    Grid shape of a -g spec: RxC, or RxC/rank (/thread) for R
+ *             rows per worker
+ * In args:    workers: ranks or threads sharing the grid
+ */
+void Gen_parse(const char *spec, int workers, int *rows, int *cols) {
+    int r, c, used = 0;
+
+    if (sscanf(spec, "%dx%d%n", &r, &c, &used) != 2 || r < 3 || c < 3 ||
+        (spec[used] != '\0' && strcmp(spec + used, "/rank") != 0 && strcmp(spec + used, "/thread") != 0)) {
+        fprintf(stderr, "Error: Invalid grid spec '%s' (want RxC, RxC/rank or RxC/thread).\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    if (spec[used] != '\0' && (long) r * workers > INT_MAX) {
+        fprintf(stderr, "Error: Grid spec '%s' is too large for %d workers.\n", spec, workers);
+        exit(EXIT_FAILURE);
+    }
+    *rows = spec[used] != '\0' ? r * workers : r;
+    *cols = c;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Gen_rows
+ * Purpose:    Fill rows [row_lo, row_hi) of a generated rows x cols grid
+ *             as make-2d would, with row_lo at A and rows pitch apart
+ */
+void Gen_rows(double *A, size_t pitch, int row_lo, int row_hi, int rows, int cols) {
+    stencil_bc_t bc = STENCIL_BC_DEFAULT;
+
+    for (int i = row_lo; i < row_hi; i++)
+        Fill_stencil_rows(A + (size_t)(i - row_lo) * pitch, i, i + 1, rows, cols, &bc);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Grid_page_bytes
+ * Purpose:    Page size a grid of <bytes> is rounded to, from
+ *             STENCIL_HUGEPAGES:
+ *               "1g"  explicit 1 GB hugetlb pages for grids of 1 GB or
+ *                     more, THP below that (so small slabs and blocks
+ *                     don't each take a whole page of the pool)
+ *               "2m"  explicit 2 MB hugetlb pages
+ *               "off" plain 4 KB pages
+ *               unset or anything else: transparent huge pages (madvise)
+ *             Explicit pages need a hugetlbfs pool (vm.nr_hugepages); if
+ *             the pool runs dry the allocation falls back to THP.
+ * Out arg:    flags: extra mmap flags for the explicit page size
+ */
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static size_t Grid_page_bytes(size_t bytes, int *flags) {
+    char *mode = getenv("STENCIL_HUGEPAGES");
+    *flags = 0;
+    if (mode != NULL && strcmp(mode, "1g") == 0 && bytes >= (size_t) 1 << 30) {
+        *flags = MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+        return (size_t) 1 << 30;
+    }
+    if (mode != NULL && strcmp(mode, "2m") == 0) {
+        *flags = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+    }
+    if (mode != NULL && strcmp(mode, "off") == 0) {
+        return (size_t) sysconf(_SC_PAGESIZE);
+    }
+    return (size_t) 2 << 20;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Alloc_grid
+ * Purpose:    Allocate a grid of count doubles backed by huge pages, so
+ *             12+ GB grids don't thrash the TLB with 4 KB pages
+ * In args:    count: number of doubles
+ * Returns:    the grid, release it with Free_grid(A, count)
+ */
+double* Alloc_grid(size_t count) {
+    int flags;
+    size_t page = Grid_page_bytes(count * sizeof(double), &flags);
+    size_t bytes = CEILING(count * sizeof(double), page) * page;
+    void *A = MAP_FAILED;
+
+    if (flags != 0)
+        A = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (A == MAP_FAILED) {
+        A = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (A == MAP_FAILED) {
+            fprintf(stderr, "Can't allocate storage\n");
+            exit(-1);
+        }
+#ifdef MADV_HUGEPAGE
+        if (page > (size_t) sysconf(_SC_PAGESIZE))
+            madvise(A, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    return (double*) A;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Free_grid
+ * Purpose:    Release a grid from Alloc_grid
+ * In args:    A: the grid, count: the count it was allocated with
+ */
+void Free_grid(double *A, size_t count) {
+    int flags;
+    size_t page = Grid_page_bytes(count * sizeof(double), &flags);
+    if (A != NULL)
+        munmap(A, CEILING(count * sizeof(double), page) * page);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Grid_pitch
+ * Purpose:    Padded row length for a grid with cols columns: whole
+ *             cache lines, and an odd number of them
+ */
+size_t Grid_pitch(int cols) {
+    size_t lines = CEILING((size_t) cols, GRID_LINE);
+    if (lines % 2 == 0)
+        lines++;
+    return lines * GRID_LINE;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Grid_alloc
+ * Purpose:    Allocate a padded, aligned rows x cols grid (zero filled)
+ */
+void Grid_alloc(grid_t *g, int rows, int cols) {
+    g->rows = rows;
+    g->cols = cols;
+    g->pitch = Grid_pitch(cols);
+    g->data = Alloc_grid((size_t) rows * g->pitch);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Grid_free
+ * Purpose:    Release a grid from Grid_alloc
+ */
+void Grid_free(grid_t *g) {
+    Free_grid(g->data, (size_t) g->rows * g->pitch);
+    g->data = NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Read_grid
+ * Purpose:    Read a raw or tiled matrix file into a padded grid
+ * In args:    file_name: the file holding the matrix
+ * Out arg:    g: newly allocated grid holding the matrix
+ */
+void Read_grid(char *file_name, grid_t *g) {
+    int rows, cols;
+    Read_matrix_dims(file_name, &rows, &cols);
+    Grid_alloc(g, rows, cols);
+    Read_matrix_rows(file_name, 0, rows, g->data, g->pitch);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Write_grid
+ * Purpose:    Write a padded grid as a packed raw or tiled (*.t2d) file
+ * In args:    g: the grid, fname: the output file
+ */
+void Write_grid(const grid_t *g, char *fname) {
+    if (g->pitch == (size_t) g->cols) {
+        write_memory_to_file(g->data, g->rows, g->cols, fname);
+        return;
+    }
+    if (Is_tiled_name(fname)) {
+        Tiled_write(fname, g->data, g->rows, g->cols, g->pitch, NULL);
+        return;
+    }
+
+    FILE *file = fopen(fname, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: Unable to open file for writing.\n");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(file, NULL, _IOFBF, 4 << 20);
+
+    if (fwrite(&g->rows, sizeof(int), 1, file) != 1 || fwrite(&g->cols, sizeof(int), 1, file) != 1) {
+        fprintf(stderr, "Error: Failed to write matrix dimensions.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < g->rows; i++) {
+        if (fwrite(g->data + (size_t) i * g->pitch, sizeof(double), g->cols, file) != (size_t) g->cols) {
+            fprintf(stderr, "Error: Failed to write matrix data.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(file);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Band_checksum
+ * Purpose:    64-bit checksum of rows [r0, r1) of A, over the bit patterns
+ *             of the values, in four independent lanes
+ */
+static uint64_t Band_checksum(const double *A, int r0, int r1, int cols, size_t pitch) {
+    uint64_t h[4] = { 1, 2, 3, 4 };
+
+    for (int i = r0; i < r1; i++) {
+        const double *row = A + (size_t) i * pitch;
+        for (int j = 0; j < cols; j++) {
+            uint64_t w;
+            memcpy(&w, &row[j], sizeof(w));
+            uint64_t x = (h[j & 3] ^ w) * 0x9E3779B97F4A7C15ULL;
+            h[j & 3] = x ^ (x >> 32);
+        }
+    }
+    return h[0] ^ (h[1] * 31) ^ (h[2] * 961) ^ (h[3] * 29791);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Update_grid_file
+ * Purpose:    Bring the raw file fname up to date with g, writing only
+ *             the bands that differ from what the sidecar says the file
+ *             holds (see _UPDATE_H_). Tiled files are written in full.
+ * Returns:    bytes of grid data written
+ */
+size_t Update_grid_file(const grid_t *g, char *fname) {
+    size_t full = (size_t) g->rows * g->cols * sizeof(double);
+    if (Is_tiled_name(fname)) {
+        Write_grid(g, fname);
+        return full;
+    }
+
+    update_header_t h = { UPDATE_MAGIC, g->rows, g->cols, 0, 0, 0, 0, 0, 0 };
+    h.band_rows = MAX(1, UPDATE_BAND_BYTES / (int) (g->cols * sizeof(double)));
+    h.nbands = CEILING(g->rows, h.band_rows);
+    h.size = (int64_t) (2 * sizeof(int) + full);
+
+    uint64_t *sums = malloc(2 * h.nbands * sizeof(uint64_t));
+    double *band = malloc((size_t) h.band_rows * g->cols * sizeof(double));
+    if (sums == NULL || band == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t *old = sums + h.nbands;
+    for (int b = 0; b < h.nbands; b++)
+        sums[b] = Band_checksum(g->data, b * h.band_rows, MIN((b + 1) * h.band_rows, g->rows),
+                                g->cols, g->pitch);
+
+    int fd = open(fname, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Unable to open file %s for writing.\n", fname);
+        exit(EXIT_FAILURE);
+    }
+
+    // The sidecar is only trusted if it describes exactly this file
+    char side[4096];
+    update_header_t sh;
+    int valid = 0;
+    snprintf(side, sizeof(side), "%s%s", fname, UPDATE_SUFFIX);
+    FILE *sf = fopen(side, "rb");
+    if (sf != NULL) {
+        valid = fread(&sh, sizeof(sh), 1, sf) == 1 && sh.magic == h.magic && sh.rows == h.rows &&
+                sh.cols == h.cols && sh.band_rows == h.band_rows && sh.nbands == h.nbands &&
+                sh.size == h.size && st.st_size == h.size && sh.mtime_sec == st.st_mtim.tv_sec &&
+                sh.mtime_nsec == st.st_mtim.tv_nsec &&
+                fread(old, sizeof(uint64_t), h.nbands, sf) == (size_t) h.nbands;
+        fclose(sf);
+    }
+
+    size_t written = 0;
+    if (!valid) {
+        int dims[2] = { g->rows, g->cols };
+        if (ftruncate(fd, h.size) != 0 || pwrite(fd, dims, sizeof(dims), 0) != (ssize_t) sizeof(dims)) {
+            fprintf(stderr, "Error: Failed to write matrix dimensions.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int b = 0; b < h.nbands; b++) {
+        if (valid && sums[b] == old[b])
+            continue;
+        int r0 = b * h.band_rows, r1 = MIN(r0 + h.band_rows, g->rows);
+        for (int i = r0; i < r1; i++)
+            memcpy(band + (size_t) (i - r0) * g->cols, g->data + (size_t) i * g->pitch, g->cols * sizeof(double));
+        size_t bytes = (size_t) (r1 - r0) * g->cols * sizeof(double);
+        off_t offset = 2 * sizeof(int) + (off_t) r0 * g->cols * sizeof(double);
+        if (pwrite(fd, band, bytes, offset) != (ssize_t) bytes) {
+            fprintf(stderr, "Error: Failed to write matrix data.\n");
+            exit(EXIT_FAILURE);
+        }
+        written += bytes;
+    }
+
+    // New sidecar, renamed into place so a crash leaves the old one (which
+    // then no longer matches the file's mtime)
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Unable to stat %s.\n", fname);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", side);
+    sf = fopen(tmp, "wb");
+    int ok = sf != NULL && fwrite(&h, sizeof(h), 1, sf) == 1 &&
+             fwrite(sums, sizeof(uint64_t), h.nbands, sf) == (size_t) h.nbands;
+    if (sf != NULL && fclose(sf) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, side) != 0) {
+        fprintf(stderr, "Warning: Unable to write %s; the next update will rewrite %s in full.\n", side, fname);
+        unlink(tmp);
+    }
+
+    free(sums);
+    free(band);
+    return written;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Stencil_row
+ * Purpose:    9-point average of one row: out[j] for j in [j0, j1)
+ * In args:    up, mid, down: rows i-1, i, i+1
+ *             nt: 1 to write out with non-temporal (streaming) stores so
+ *                 the output row doesn't evict the input rows from cache.
+ *                 out must then be 16-byte aligned, as grid rows are.
+ * Out arg:    out: row i of the new grid
+ */
+void Stencil_row(const double *up, const double *mid, const double *down, double *out,
+                 size_t j0, size_t j1, int nt) {
+    size_t j = j0;
+
+#ifdef __SSE2__
+    if (nt) {
+        // Plain store up to a 16-byte boundary, then two cells per stream
+        if (j < j1 && ((uintptr_t) (out + j) & 15) != 0) {
+            out[j] = (up[j-1] + up[j] + up[j+1] + mid[j-1] + mid[j] + mid[j+1] +
+                      down[j-1] + down[j] + down[j+1]) / 9.0;
+            j++;
+        }
+        for (; j + 1 < j1; j += 2) {
+            double a = (up[j-1] + up[j] + up[j+1] + mid[j-1] + mid[j] + mid[j+1] +
+                        down[j-1] + down[j] + down[j+1]) / 9.0;
+            double b = (up[j] + up[j+1] + up[j+2] + mid[j] + mid[j+1] + mid[j+2] +
+                        down[j] + down[j+1] + down[j+2]) / 9.0;
+            _mm_stream_pd(out + j, _mm_set_pd(b, a));
         }
+        _mm_sfence();
+    }
+#else
+    (void) nt;
+#endif
+
+    for (; j < j1; j++) {
+        out[j] = (up[j-1] + up[j] + up[j+1] + mid[j-1] + mid[j] + mid[j+1] +
+                  down[j-1] + down[j] + down[j+1]) / 9.0;
     }
 }
 
@@ -55,22 +457,33 @@ void Read_matrix(char* file_name, double **matrix, int *rows, int *cols){
         exit(0);
     }
 
+    int tiled = *rows == TILED_MAGIC;
+    if (tiled) {
+        int dims[2];
+        if (fread(dims, sizeof(int), 2, file) != 2) {
+            fprintf(stderr, "Error: Failed to read matrix dimensions.\n");
+            fclose(file);
+            exit(0);
+        }
+        *rows = *cols;
+        *cols = dims[0];
+    }
+
     if (*rows <= 0 || *cols <= 0) {
         fprintf(stderr, "Error: Invalid matrix dimensions.\n");
         fclose(file);
         exit(0);
     }
 
-    *matrix = (double *)malloc(*rows * *cols * sizeof(double));
-    if (!(*matrix)) {
-        fprintf(stderr, "Error: Memory allocation failed.\n");
-        fclose(file);
-        exit(0);
-    }
+    size_t count = (size_t) *rows * *cols;
+    *matrix = Alloc_grid(count);
 
-    if (fread(*matrix, sizeof(double), *rows * *cols, file) != (size_t)(*rows * *cols)) {
+    if (tiled) {
+        // Tiled file: decode the tiles in parallel
+        Tiled_read_rows(fileno(file), *rows, *cols, 0, *rows, *matrix, *cols);
+    } else if (fread(*matrix, sizeof(double), count, file) != count) {
         fprintf(stderr, "Error: Failed to read matrix data.\n");
-        free(*matrix);
+        Free_grid(*matrix, count);
         fclose(file);
         exit(0);
     }
@@ -85,11 +498,12 @@ void Read_matrix(char* file_name, double **matrix, int *rows, int *cols){
  * In args:    matrix: the matrix to be printed
  *             rows: the number of rows in A and components in y
  *             cols: the number of columns in A components in x
+ *             pitch: doubles between rows (cols if packed)
  */
-void Print_matrix(double* matrix, int rows, int cols) {
+void Print_matrix(double* matrix, int rows, int cols, size_t pitch) {
     for (int i = 0; i < rows; i++) {
         for (int j = 0; j < cols; j++) {
-            printf("%6.2f ", matrix[i * cols + j]);
+            printf("%6.2f ", matrix[(size_t) i * pitch + j]);
         }
         printf("\n");
     }
@@ -97,6 +511,11 @@ void Print_matrix(double* matrix, int rows, int cols) {
 
 void write_memory_to_file(double *A, int rows, int cols, char *fname){
 
+     if (Is_tiled_name(fname)) {
+         Tiled_write(fname, A, rows, cols, cols, NULL);
+         return;
+     }
+
      // Writing matrix to binary file
      FILE *file = fopen(fname, "wb");
      if (!file) {
@@ -111,7 +530,7 @@ void write_memory_to_file(double *A, int rows, int cols, char *fname){
      }
  
      // Write the matrix data
-     if (fwrite(A, sizeof(double), rows * cols, file) != (size_t)(rows * cols)) {
+     if (fwrite(A, sizeof(double), (size_t) rows * cols, file) != (size_t) rows * cols) {
          fprintf(stderr, "Error: Failed to write matrix data.\n");
          exit(EXIT_FAILURE);
      }
@@ -121,88 +540,2289 @@ void write_memory_to_file(double *A, int rows, int cols, char *fname){
 }
 
 
-/* Start of Justin's Section */
+/*-------------------------------------------------------------------
+ * Function:   Map_matrix
+ * Purpose:    Map a matrix file read-only instead of reading it, so tools
+ *             only fault in the pages they actually touch
+ * In args:    file_name: the file holding the matrix
+ * Out args:   rows: the number of rows in the matrix
+ *             cols: the number of cols in the matrix
+ *             map_bytes: the size of the mapping, for Unmap_matrix
+ * Returns:    pointer to element [0][0] of the mapped matrix
+ */
+double* Map_matrix(char* file_name, int *rows, int *cols, size_t *map_bytes) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to open file %s for reading.\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)(2 * sizeof(int))) {
+        fprintf(stderr, "Error: Failed to read matrix dimensions.\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Unable to map file %s.\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    int *header = (int*) map;
+    if (header[0] == TILED_MAGIC) {
+        // Tiled files can't be mapped as is: decode into an anonymous
+        // mapping laid out like a raw file so Unmap_matrix still works
+        *rows = header[1];
+        *cols = header[2];
+        munmap(map, (size_t) st.st_size);
+        st.st_size = (off_t)(2 * sizeof(int)) + (off_t) *rows * *cols * (off_t) sizeof(double);
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (*rows <= 0 || *cols <= 0 || map == MAP_FAILED) {
+            fprintf(stderr, "Error: Unable to map file %s.\n", file_name);
+            exit(EXIT_FAILURE);
+        }
+        header = (int*) map;
+        header[0] = *rows;
+        header[1] = *cols;
+        Tiled_read_rows(fd, *rows, *cols, 0, *rows, (double*) (header + 2), *cols);
+    }
+    close(fd);
+
+    *rows = header[0];
+    *cols = header[1];
+    if (*rows <= 0 || *cols <= 0 ||
+        (size_t) st.st_size < 2 * sizeof(int) + (size_t) *rows * (size_t) *cols * sizeof(double)) {
+        fprintf(stderr, "Error: Invalid matrix dimensions.\n");
+        munmap(map, (size_t) st.st_size);
+        exit(EXIT_FAILURE);
+    }
+
+    *map_bytes = (size_t) st.st_size;
+    return (double*) (header + 2);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Unmap_matrix
+ * Purpose:    Release a matrix mapped by Map_matrix
+ * In args:    matrix: pointer returned by Map_matrix
+ *             map_bytes: size returned by Map_matrix
+ */
+void Unmap_matrix(double *matrix, size_t map_bytes) {
+    munmap((int*) matrix - 2, map_bytes);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Read_matrix_dims
+ * Purpose:    Read only the dimensions of a raw or tiled matrix file
+ * In args:    file_name: the file holding the matrix
+ * Out args:   rows, cols
+ */
+void Read_matrix_dims(char* file_name, int *rows, int *cols) {
+    int header[3];
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to open file %s for reading.\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, header, sizeof(header), 0) < (ssize_t)(2 * sizeof(int))) {
+        fprintf(stderr, "Error: Failed to read matrix dimensions.\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    int tiled = header[0] == TILED_MAGIC;
+    *rows = header[tiled];
+    *cols = header[tiled + 1];
+    if (*rows <= 0 || *cols <= 0) {
+        fprintf(stderr, "Error: Invalid matrix dimensions.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Read_matrix_rows
+ * Purpose:    Read rows [row_lo, row_hi) of a raw or tiled matrix file
+ *             without touching the rest of it
+ * In args:    file_name: the file holding the matrix
+ *             row_lo:    first row to read
+ *             row_hi:    one past the last row to read
+ *             pitch:     doubles between rows in dst (cols if packed)
+ * Out arg:    dst:       (row_hi - row_lo) rows of cols doubles
+ */
+void Read_matrix_rows(char* file_name, int row_lo, int row_hi, double *dst, size_t pitch) {
+    int rows, cols, header[1];
+    Read_matrix_dims(file_name, &rows, &cols);
+    if (row_lo < 0 || row_hi > rows || row_lo > row_hi) {
+        fprintf(stderr, "Error: Rows [%d, %d) are outside the matrix in %s.\n", row_lo, row_hi, file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0 || pread(fd, header, sizeof(int), 0) != sizeof(int)) {
+        fprintf(stderr, "Error: Unable to open file %s for reading.\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (header[0] == TILED_MAGIC) {
+        Tiled_read_rows(fd, rows, cols, row_lo, row_hi, dst, pitch);
+    } else {
+        // One pread for packed rows, one per row when dst is padded
+        int step = pitch == (size_t) cols ? row_hi - row_lo : 1;
+        for (int i = row_lo; i < row_hi; i += step) {
+            size_t bytes = (size_t) MIN(step, row_hi - i) * cols * sizeof(double);
+            off_t offset = (off_t)(2 * sizeof(int)) + (off_t) i * cols * (off_t) sizeof(double);
+            char *buf = (char*) (dst + (size_t)(i - row_lo) * pitch);
+            size_t done = 0;
+            while (done < bytes) {
+                ssize_t got = pread(fd, buf + done, bytes - done, offset + (off_t) done);
+                if (got <= 0) {
+                    fprintf(stderr, "Error: Failed to read matrix data.\n");
+                    exit(EXIT_FAILURE);
+                }
+                done += (size_t) got;
+            }
+        }
+    }
+    close(fd);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Read_matrix_window
+ * Purpose:    Read the cells [r0, r1) x [c0, c1) of a raw or tiled matrix
+ *             file. Raw files get one pread of (c1 - c0) cells per row;
+ *             tiled files decode whole rows (tiles are row bands) and keep
+ *             the columns asked for.
+ * In args:    file_name, r0, c0, r1, c1: the window, half open
+ *             pitch:     doubles between rows in dst
+ * Out arg:    dst:       (r1 - r0) rows of (c1 - c0) doubles
+ */
+void Read_matrix_window(char* file_name, int r0, int c0, int r1, int c1, double *dst, size_t pitch) {
+    int rows, cols, header[1];
+    Read_matrix_dims(file_name, &rows, &cols);
+    if (r0 < 0 || c0 < 0 || r1 > rows || c1 > cols || r0 > r1 || c0 > c1) {
+        fprintf(stderr, "Error: Window %d,%d,%d,%d is outside the matrix in %s.\n", r0, c0, r1, c1, file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0 || pread(fd, header, sizeof(int), 0) != sizeof(int)) {
+        fprintf(stderr, "Error: Unable to open file %s for reading.\n", file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t width = (size_t)(c1 - c0);
+    if (header[0] == TILED_MAGIC) {
+        double *band = malloc((size_t)(r1 - r0) * cols * sizeof(double));
+        if (band == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        Tiled_read_rows(fd, rows, cols, r0, r1, band, cols);
+        for (int i = r0; i < r1; i++)
+            memcpy(dst + (size_t)(i - r0) * pitch, band + (size_t)(i - r0) * cols + c0, width * sizeof(double));
+        free(band);
+    } else {
+        for (int i = r0; i < r1; i++) {
+            size_t bytes = width * sizeof(double);
+            off_t offset = (off_t)(2 * sizeof(int)) + ((off_t) i * cols + c0) * (off_t) sizeof(double);
+            char *buf = (char*) (dst + (size_t)(i - r0) * pitch);
+            size_t done = 0;
+            while (done < bytes) {
+                ssize_t got = pread(fd, buf + done, bytes - done, offset + (off_t) done);
+                if (got <= 0) {
+                    fprintf(stderr, "Error: Failed to read matrix data.\n");
+                    exit(EXIT_FAILURE);
+                }
+                done += (size_t) got;
+            }
+        }
+    }
+    close(fd);
+}
+
+
+/* ---- Tiled grid format ---- */
 
 typedef struct {
-    int thread_id;
-    int num_threads;
-    int n_iters;
-    int rows;
-    int cols;
-    double *matrix;
-    double *newMatrix;
+    int id, num_threads;
+    int fd, rows, cols, tile_rows, ntiles;
+    int row_lo, row_hi;              // rows wanted (decode only)
+    const double *A;                 // source rows (encode, NULL = generate)
+    const stencil_bc_t *bc;          // boundary values when generating
+    double *dst;                     // destination rows (decode)
+    size_t pitch;                    // doubles between rows of A / dst
+    tile_entry_t *index;
+    unsigned char **payload;
     pthread_barrier_t *barrier;
-    int debug;
- } thread_arg_t;
+} tiled_arg_t;
 
- typedef struct {
-    int start_col;
-    int end_col;
-    int i; // current row
-    int cols;
-    double* local_matrix;
-    double* local_newMatrix;
-} ColumnThreadData;
 
+/*-------------------------------------------------------------------
+ * Function:   Is_tiled_name
+ * Purpose:    Tiled output is chosen by the file name suffix
+ */
+int Is_tiled_name(char *fname) {
+    size_t len = strlen(fname), slen = strlen(TILED_SUFFIX);
+    return len > slen && strcmp(fname + len - slen, TILED_SUFFIX) == 0;
+}
 
 
-void* pthread_stencil(void *arg) {
-    thread_arg_t *targs = (thread_arg_t*) arg;
+/*-------------------------------------------------------------------
+ * Function:   Tiled_threads
+ * Purpose:    Number of threads used to encode/decode ntiles tiles
+ */
+static int Tiled_threads(int ntiles) {
+    int p = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (p < 1) p = 1;
+    return p < ntiles ? p : (ntiles > 0 ? ntiles : 1);
+}
 
-    int id = targs->thread_id;
-    int num_threads = targs->num_threads;
-    int n = targs->n_iters;
-    int rows = targs->rows;
-    int cols = targs->cols;
-    double *matrix = targs->matrix;
-    double *newMatrix = targs->newMatrix;
-    pthread_barrier_t *barrier = targs->barrier;
 
-    // Divide rows using provided macros
-    int local_start = BLOCK_LOW(id, num_threads, rows-2) + 1;  // offset by 1 because of boundary
-    int local_end = BLOCK_HIGH(id, num_threads, rows-2) + 1;
+/*-------------------------------------------------------------------
+ * Function:   Tile_encode
+ * Purpose:    Compress count doubles: xor each value with the previous
+ *             one, shuffle the bytes into 8 planes so the (mostly zero)
+ *             high bytes line up, then run-length encode the zero runs as
+ *             <literal length, literals, zero run length> varint tokens.
+ *             Falls back to a raw copy if that doesn't pay off.
+ * In args:    src: the values, count: the number of values
+ *             scratch: count * 8 bytes of work space
+ * Out arg:    out: at least 2 * count * 8 + 32 bytes
+ * Returns:    the number of bytes written to out
+ */
+static size_t Tile_encode(const double *src, size_t count, unsigned char *out, unsigned char *scratch) {
+    size_t nbytes = count * sizeof(double);
+    uint64_t prev = 0;
+
+    for (size_t k = 0; k < count; k++) {
+        uint64_t bits;
+        memcpy(&bits, &src[k], sizeof(bits));
+        uint64_t x = bits ^ prev;
+        prev = bits;
+        for (int b = 0; b < 8; b++)
+            scratch[b * count + k] = (unsigned char) (x >> (8 * b));
+    }
 
-    for (int iter = 1; iter <= n; iter++) {
-        for (int i = local_start; i <= local_end; i++) {
-            for (int j = 1; j < cols-1; j++) {
-                newMatrix[i * cols + j] = (
-                    matrix[(i-1) * cols + (j-1)] + matrix[(i-1) * cols + j] + matrix[(i-1) * cols + (j+1)] +
-                    matrix[i * cols + (j-1)]     + matrix[i * cols + j]     + matrix[i * cols + (j+1)] +
-                    matrix[(i+1) * cols + (j-1)] + matrix[(i+1) * cols + j] + matrix[(i+1) * cols + (j+1)]
-                ) / 9.0;
+    size_t o = 0, k = 0;
+    out[o++] = TILE_CODEC_XOR;
+    while (k < nbytes) {
+        // Find the next run of at least 4 zero bytes
+        size_t lit = k, run = 0;
+        while (lit < nbytes) {
+            if (scratch[lit] == 0) {
+                run = 1;
+                while (lit + run < nbytes && scratch[lit + run] == 0) run++;
+                if (run >= 4 || lit + run == nbytes) break;
+                lit += run;
+                run = 0;
+            } else {
+                lit++;
             }
         }
 
-        pthread_barrier_wait(barrier);
+        uint64_t v = lit - k;
+        do { out[o++] = (unsigned char) ((v & 0x7f) | (v > 0x7f ? 0x80 : 0)); v >>= 7; } while (v);
+        memcpy(out + o, scratch + k, lit - k);
+        o += lit - k;
+        v = run;
+        do { out[o++] = (unsigned char) ((v & 0x7f) | (v > 0x7f ? 0x80 : 0)); v >>= 7; } while (v);
+        k = lit + run;
 
-            double *temp = targs->matrix;
-            targs->matrix = targs->newMatrix;
-            targs->newMatrix = temp;
-      
-    
-        pthread_barrier_wait(barrier);
-    
-        // update local pointers
-        matrix = targs->matrix;
-        newMatrix = targs->newMatrix;
-            
-        
-    
+        if (o > nbytes) break;
     }
 
-    return NULL;
+    if (o > nbytes) {
+        out[0] = TILE_CODEC_RAW;
+        memcpy(out + 1, src, nbytes);
+        o = nbytes + 1;
+    }
+    return o;
 }
 
-void* column_worker(void* arg) {
-    ColumnThreadData* data = (ColumnThreadData*)arg;
-    int i = data->i;
 
-    for (int j = data->start_col; j < data->end_col; j++) {
-        data->local_newMatrix[i * data->cols + j] = (
-            data->local_matrix[(i - 1) * data->cols + (j - 1)] + data->local_matrix[(i - 1) * data->cols + j] + data->local_matrix[(i - 1) * data->cols + (j + 1)] +
-            data->local_matrix[i * data->cols + (j - 1)] + data->local_matrix[i * data->cols + j] + data->local_matrix[i * data->cols + (j + 1)] +
-            data->local_matrix[(i + 1) * data->cols + (j - 1)] + data->local_matrix[(i + 1) * data->cols + j] + data->local_matrix[(i + 1) * data->cols + (j + 1)]
-        ) / 9.0;
+/*-------------------------------------------------------------------
+ * Function:   Tile_varint
+ * Purpose:    Read one varint of a tile, checking the bounds
+ */
+static uint64_t Tile_varint(const unsigned char *in, size_t in_bytes, size_t *pos) {
+    uint64_t v = 0;
+    for (int shift = 0; *pos < in_bytes && shift < 64; shift += 7) {
+        unsigned char c = in[(*pos)++];
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
     }
+    fprintf(stderr, "Error: Corrupt tile in tiled matrix file.\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tile_decode
+ * Purpose:    Invert Tile_encode
+ * In args:    in, in_bytes: the compressed tile
+ *             count: the number of values in the tile
+ *             scratch: count * 8 bytes of work space
+ * Out arg:    dst: the count values
+ */
+static void Tile_decode(const unsigned char *in, size_t in_bytes, double *dst, size_t count, unsigned char *scratch) {
+    size_t nbytes = count * sizeof(double);
+
+    if (in_bytes == nbytes + 1 && in[0] == TILE_CODEC_RAW) {
+        memcpy(dst, in + 1, nbytes);
+        return;
+    }
+    if (in_bytes < 1 || in[0] != TILE_CODEC_XOR) {
+        fprintf(stderr, "Error: Corrupt tile in tiled matrix file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t pos = 1, k = 0;
+    while (k < nbytes) {
+        uint64_t lit = Tile_varint(in, in_bytes, &pos);
+        if (lit > nbytes - k || lit > in_bytes - pos) break;
+        memcpy(scratch + k, in + pos, lit);
+        pos += lit;
+        k += lit;
+        uint64_t run = Tile_varint(in, in_bytes, &pos);
+        if (run > nbytes - k) break;
+        memset(scratch + k, 0, run);
+        k += run;
+    }
+    if (k != nbytes) {
+        fprintf(stderr, "Error: Corrupt tile in tiled matrix file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t x = 0;
+        for (int b = 0; b < 8; b++)
+            x |= (uint64_t) scratch[b * count + i] << (8 * b);
+        prev ^= x;
+        memcpy(&dst[i], &prev, sizeof(prev));
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tiled_encode_worker
+ * Purpose:    Compress this thread's block of tiles, let thread 0 lay out
+ *             the index, then pwrite the tiles at their offsets
+ */
+static void* Tiled_encode_worker(void *arg) {
+    tiled_arg_t *a = (tiled_arg_t*) arg;
+    int t_lo = BLOCK_LOW(a->id, a->num_threads, a->ntiles);
+    int t_hi = BLOCK_HIGH(a->id, a->num_threads, a->ntiles) + 1;
+    size_t tile_count = (size_t) a->tile_rows * a->cols;
+
+    // Rows are gathered into rowbuf unless they are already packed in A
+    int packed = a->A != NULL && a->pitch == (size_t) a->cols;
+    unsigned char *scratch = malloc(tile_count * sizeof(double));
+    double *rowbuf = packed ? NULL : malloc(tile_count * sizeof(double));
+    if (scratch == NULL || (!packed && rowbuf == NULL)) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = t_lo; t < t_hi; t++) {
+        int lo = t * a->tile_rows;
+        int hi = MIN(lo + a->tile_rows, a->rows);
+        size_t count = (size_t)(hi - lo) * a->cols;
+        const double *src = packed ? a->A + (size_t) lo * a->cols : rowbuf;
+        if (a->A == NULL)
+            Fill_stencil_rows(rowbuf, lo, hi, a->rows, a->cols, a->bc);
+        else if (!packed)
+            for (int i = lo; i < hi; i++)
+                memcpy(rowbuf + (size_t)(i - lo) * a->cols, a->A + (size_t) i * a->pitch, a->cols * sizeof(double));
+
+        unsigned char *out = malloc(2 * count * sizeof(double) + 32);
+        if (out == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        a->index[t].bytes = Tile_encode(src, count, out, scratch);
+        a->payload[t] = out;
+    }
+    free(scratch);
+    free(rowbuf);
+
+    pthread_barrier_wait(a->barrier);
+    if (a->id == 0) {
+        uint64_t offset = TILED_HEADER_INTS * sizeof(int) + (uint64_t) a->ntiles * sizeof(tile_entry_t);
+        for (int t = 0; t < a->ntiles; t++) {
+            a->index[t].offset = offset;
+            offset += a->index[t].bytes;
+        }
+    }
+    pthread_barrier_wait(a->barrier);
+
+    for (int t = t_lo; t < t_hi; t++) {
+        if (pwrite(a->fd, a->payload[t], a->index[t].bytes, (off_t) a->index[t].offset) != (ssize_t) a->index[t].bytes) {
+            fprintf(stderr, "Error: Failed to write matrix data.\n");
+            exit(EXIT_FAILURE);
+        }
+        free(a->payload[t]);
+    }
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tiled_write
+ * Purpose:    Write a matrix in the tiled format, encoding tiles in parallel
+ * In args:    fname: the output file
+ *             A:     the matrix, or NULL to generate it from bc
+ *             rows, cols: the matrix size
+ *             pitch: doubles between rows of A
+ *             bc:    boundary values used when A is NULL
+ */
+void Tiled_write(char *fname, const double *A, int rows, int cols, size_t pitch, const stencil_bc_t *bc) {
+    int tile_rows = TILE_BYTES / (int)(cols * sizeof(double)) > 0 ? TILE_BYTES / (int)(cols * sizeof(double)) : 1;
+    int ntiles = CEILING(rows, tile_rows);
+    int num_threads = Tiled_threads(ntiles);
+
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to open file for writing.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    tile_entry_t *index = malloc(ntiles * sizeof(tile_entry_t));
+    unsigned char **payload = malloc(ntiles * sizeof(unsigned char*));
+    if (index == NULL || payload == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t threads[num_threads];
+    tiled_arg_t args[num_threads];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        args[t] = (tiled_arg_t){ .id = t, .num_threads = num_threads, .fd = fd, .rows = rows, .cols = cols,
+                                 .tile_rows = tile_rows, .ntiles = ntiles, .A = A, .bc = bc, .pitch = pitch,
+                                 .index = index, .payload = payload, .barrier = &barrier };
+        pthread_create(&threads[t], NULL, Tiled_encode_worker, &args[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    int header[TILED_HEADER_INTS] = { TILED_MAGIC, rows, cols, tile_rows, ntiles, 0 };
+    size_t index_bytes = ntiles * sizeof(tile_entry_t);
+    if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        pwrite(fd, index, index_bytes, sizeof(header)) != (ssize_t) index_bytes) {
+        fprintf(stderr, "Error: Failed to write matrix dimensions.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(index);
+    free(payload);
+    close(fd);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tiled_decode_worker
+ * Purpose:    Read and decode this thread's block of the wanted tiles
+ */
+static void* Tiled_decode_worker(void *arg) {
+    tiled_arg_t *a = (tiled_arg_t*) arg;
+    int first = a->row_lo / a->tile_rows;
+    int last = (a->row_hi - 1) / a->tile_rows + 1;
+    int t_lo = first + BLOCK_LOW(a->id, a->num_threads, last - first);
+    int t_hi = first + BLOCK_HIGH(a->id, a->num_threads, last - first) + 1;
+    size_t tile_count = (size_t) a->tile_rows * a->cols;
+
+    unsigned char *scratch = malloc(tile_count * sizeof(double));
+    double *tile = malloc(tile_count * sizeof(double));
+    unsigned char *in = NULL;
+    if (scratch == NULL || tile == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = t_lo; t < t_hi; t++) {
+        int lo = t * a->tile_rows;
+        int hi = MIN(lo + a->tile_rows, a->rows);
+        size_t count = (size_t)(hi - lo) * a->cols;
+
+        in = realloc(in, a->index[t].bytes);
+        if (in == NULL || pread(a->fd, in, a->index[t].bytes, (off_t) a->index[t].offset) != (ssize_t) a->index[t].bytes) {
+            fprintf(stderr, "Error: Failed to read matrix data.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Decode straight into dst when the whole tile is wanted and dst is packed
+        int want_lo = MAX(lo, a->row_lo), want_hi = MIN(hi, a->row_hi);
+        int direct = want_lo == lo && want_hi == hi && a->pitch == (size_t) a->cols;
+        double *out = direct ? a->dst + (size_t)(lo - a->row_lo) * a->cols : tile;
+        Tile_decode(in, a->index[t].bytes, out, count, scratch);
+        if (!direct)
+            for (int i = want_lo; i < want_hi; i++)
+                memcpy(a->dst + (size_t)(i - a->row_lo) * a->pitch, tile + (size_t)(i - lo) * a->cols,
+                       a->cols * sizeof(double));
+    }
+
+    free(in);
+    free(tile);
+    free(scratch);
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tiled_read_rows
+ * Purpose:    Decode rows [row_lo, row_hi) of an open tiled file in parallel
+ * In args:    fd:   the open file
+ *             rows, cols: the matrix size from the header
+ *             row_lo, row_hi: the rows wanted
+ *             pitch: doubles between rows in dst
+ * Out arg:    dst:  (row_hi - row_lo) rows of cols doubles
+ */
+void Tiled_read_rows(int fd, int rows, int cols, int row_lo, int row_hi, double *dst, size_t pitch) {
+    int header[TILED_HEADER_INTS];
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) || header[0] != TILED_MAGIC ||
+        header[1] != rows || header[2] != cols || header[3] <= 0 || header[4] != CEILING(rows, header[3])) {
+        fprintf(stderr, "Error: Invalid tiled matrix header.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (row_lo >= row_hi)
+        return;
+
+    int tile_rows = header[3], ntiles = header[4];
+    size_t index_bytes = ntiles * sizeof(tile_entry_t);
+    tile_entry_t *index = malloc(index_bytes);
+    if (index == NULL || pread(fd, index, index_bytes, sizeof(header)) != (ssize_t) index_bytes) {
+        fprintf(stderr, "Error: Failed to read tile index.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int num_threads = Tiled_threads((row_hi - 1) / tile_rows - row_lo / tile_rows + 1);
+    pthread_t threads[num_threads];
+    tiled_arg_t args[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        args[t] = (tiled_arg_t){ .id = t, .num_threads = num_threads, .fd = fd, .rows = rows, .cols = cols,
+                                 .tile_rows = tile_rows, .ntiles = ntiles, .row_lo = row_lo, .row_hi = row_hi,
+                                 .dst = dst, .pitch = pitch, .index = index };
+        pthread_create(&threads[t], NULL, Tiled_decode_worker, &args[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(index);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Snapshot_writer
+ * Purpose:    Background thread that drains the snapshot queue and
+ *             pwrites each job at its frame offset
+ * In args:    arg: the snapshot_t being written
+ */
+static void* Snapshot_writer(void *arg) {
+    snapshot_t *snap = (snapshot_t*) arg;
+
+    pthread_mutex_lock(&snap->lock);
+    for (;;) {
+        while (snap->head == NULL && !snap->done)
+            pthread_cond_wait(&snap->cond, &snap->lock);
+        if (snap->head == NULL)
+            break;
+
+        snap_job_t *job = snap->head;
+        snap->head = job->next;
+        if (snap->head == NULL) snap->tail = NULL;
+        pthread_mutex_unlock(&snap->lock);
+
+        if (pwrite(snap->fd, job->data, job->bytes, job->offset) != (ssize_t) job->bytes) {
+            fprintf(stderr, "Error: Failed to write snapshot frame.\n");
+            exit(EXIT_FAILURE);
+        }
+        free(job->data);
+        free(job);
+
+        pthread_mutex_lock(&snap->lock);
+        snap->pending--;
+        pthread_cond_broadcast(&snap->cond);
+    }
+    pthread_mutex_unlock(&snap->lock);
+
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Snapshot_open
+ * Purpose:    Parse a snapshot spec, open the stream and start the writer
+ * In args:    spec:  "<file>,<every>,<stride>[,<r0>,<c0>,<r1>,<c1>]"
+ *                    frames are taken every <every> iterations, keeping
+ *                    every <stride>-th row and column of the region
+ *                    [r0,r1) x [c0,c1) (whole grid if omitted)
+ *             rows:  the number of rows in the grid
+ *             cols:  the number of cols in the grid
+ *             owner: 1 if this process creates the file and writes the
+ *                    header (rank 0), 0 if it only adds its own rows
+ * Out arg:    snap:  the open snapshot stream
+ */
+void Snapshot_open(snapshot_t *snap, char *spec, int rows, int cols, int owner) {
+    char fname[4096];
+    int fields;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->r1 = rows;
+    snap->c1 = cols;
+    fields = sscanf(spec, "%4095[^,],%d,%d,%d,%d,%d,%d", fname, &snap->every, &snap->stride,
+                    &snap->r0, &snap->c0, &snap->r1, &snap->c1);
+    if ((fields != 3 && fields != 7) || snap->every < 1 || snap->stride < 1 ||
+        snap->r0 < 0 || snap->c0 < 0 || snap->r1 > rows || snap->c1 > cols ||
+        snap->r0 >= snap->r1 || snap->c0 >= snap->c1) {
+        fprintf(stderr, "Error: Invalid snapshot spec '%s' (want file,every,stride[,r0,c0,r1,c1]).\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    snap->frame_rows = CEILING(snap->r1 - snap->r0, snap->stride);
+    snap->frame_cols = CEILING(snap->c1 - snap->c0, snap->stride);
+    snap->frame_bytes = (size_t) snap->frame_rows * snap->frame_cols * sizeof(double);
+
+    snap->fd = open(fname, owner ? (O_WRONLY | O_CREAT | O_TRUNC) : O_WRONLY, 0644);
+    if (snap->fd < 0) {
+        fprintf(stderr, "Error: Unable to open snapshot file %s for writing.\n", fname);
+        exit(EXIT_FAILURE);
+    }
+
+    if (owner) {
+        int header[SNAP_HEADER_INTS] = { SNAP_MAGIC, rows, cols, snap->r0, snap->c0, snap->r1, snap->c1,
+                                         snap->stride, snap->every, snap->frame_rows, snap->frame_cols, 0 };
+        if (pwrite(snap->fd, header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+            fprintf(stderr, "Error: Failed to write snapshot header.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_init(&snap->lock, NULL);
+    pthread_cond_init(&snap->cond, NULL);
+    pthread_create(&snap->writer, NULL, Snapshot_writer, snap);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Snapshot_capture
+ * Purpose:    Copy this process' part of a frame and hand it to the writer.
+ *             Does nothing unless iter is a multiple of the frame interval.
+ *             Only blocks if the writer has fallen SNAP_MAX_PENDING jobs behind.
+ * In args:    snap:  the open snapshot stream
+ *             iter:  the iteration the grid holds
+ *             A:     the rows owned by the caller, starting at global row g0
+ *             pitch: doubles between rows of A
+ *             g0:    first global row held in A
+ *             g1:    one past the last global row held in A
+ */
+void Snapshot_capture(snapshot_t *snap, int iter, double *A, size_t pitch, int g0, int g1) {
+    if (snap == NULL || iter % snap->every != 0)
+        return;
+
+    // Frame rows whose source row falls inside [g0, g1)
+    int lo = g0 > snap->r0 ? g0 : snap->r0;
+    int hi = g1 < snap->r1 ? g1 : snap->r1;
+    if (lo >= hi)
+        return;
+    int fr_lo = CEILING(lo - snap->r0, snap->stride);
+    int fr_hi = CEILING(hi - snap->r0, snap->stride);
+    if (fr_lo >= fr_hi)
+        return;
+
+    size_t count = (size_t)(fr_hi - fr_lo) * snap->frame_cols;
+    snap_job_t *job = malloc(sizeof(snap_job_t));
+    double *data = malloc(count * sizeof(double));
+    if (job == NULL || data == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    job->data = data;
+    double *dst = data;
+    for (int fr = fr_lo; fr < fr_hi; fr++) {
+        double *src = A + (size_t)(snap->r0 + fr * snap->stride - g0) * pitch;
+        for (int j = snap->c0; j < snap->c1; j += snap->stride)
+            *dst++ = src[j];
+    }
+
+    job->bytes = count * sizeof(double);
+    job->offset = (off_t)(SNAP_HEADER_INTS * sizeof(int))
+                + (off_t)(iter / snap->every) * (off_t) snap->frame_bytes
+                + (off_t) fr_lo * snap->frame_cols * (off_t) sizeof(double);
+    job->next = NULL;
+
+    pthread_mutex_lock(&snap->lock);
+    while (snap->pending >= SNAP_MAX_PENDING)
+        pthread_cond_wait(&snap->cond, &snap->lock);
+    if (snap->tail) snap->tail->next = job;
+    else snap->head = job;
+    snap->tail = job;
+    snap->pending++;
+    pthread_cond_broadcast(&snap->cond);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Snapshot_close
+ * Purpose:    Flush outstanding frames, stop the writer and close the file
+ * In args:    snap: the open snapshot stream
+ */
+void Snapshot_close(snapshot_t *snap) {
+    if (snap == NULL)
+        return;
+
+    pthread_mutex_lock(&snap->lock);
+    snap->done = 1;
+    pthread_cond_broadcast(&snap->cond);
+    pthread_mutex_unlock(&snap->lock);
+
+    pthread_join(snap->writer, NULL);
+    pthread_mutex_destroy(&snap->lock);
+    pthread_cond_destroy(&snap->cond);
+    close(snap->fd);
+}
+
+
+
+/* ---- Fused I/O ---- */
+
+static void* Pipe_reader(void *arg) {
+    pipe_io_t *io = (pipe_io_t*) arg;
+
+    for (int lo = 0; lo < io->rows; lo += io->band_rows) {
+        int hi = MIN(lo + io->band_rows, io->rows);
+        Read_matrix_rows(io->file, lo, hi, io->A + (size_t) lo * io->pitch, io->pitch);
+
+        pthread_mutex_lock(&io->lock);
+        __atomic_store_n(&io->ready, hi, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+    }
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Pipe_read_start
+ * Purpose:    Allocate the grid for a matrix file and start reading it in
+ *             the background, a band of rows at a time (whole tiles for
+ *             *.t2d input)
+ * In args:    file: the matrix file
+ * Out args:   io: the reader, g: the grid being filled
+ */
+void Pipe_read_start(pipe_io_t *io, char *file, grid_t *g) {
+    int rows, cols, header[TILED_HEADER_INTS];
+    Read_matrix_dims(file, &rows, &cols);
+    Grid_alloc(g, rows, cols);
+
+    memset(io, 0, sizeof(*io));
+    io->file = file;
+    io->A = g->data;
+    io->rows = rows;
+    io->cols = cols;
+    io->pitch = g->pitch;
+    io->band_rows = MAX(1, PIPE_BAND_BYTES / (int)(cols * sizeof(double)));
+
+    int fd = open(file, O_RDONLY);
+    if (fd >= 0 && pread(fd, header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+        header[0] == TILED_MAGIC && header[3] > 0)
+        io->band_rows = CEILING(io->band_rows, header[3]) * header[3];
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    if (pthread_create(&io->thread, NULL, Pipe_reader, io) != 0) {
+        fprintf(stderr, "Error: Unable to start the reader thread.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Pipe_read_finish
+ * Purpose:    Wait for the reader (the whole grid is in afterwards)
+ */
+void Pipe_read_finish(pipe_io_t *io) {
+    pthread_join(io->thread, NULL);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+}
+
+
+static void Pipe_pwrite(int fd, const void *buf, size_t bytes, off_t offset) {
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t put = pwrite(fd, (const char*) buf + done, bytes - done, offset + (off_t) done);
+        if (put <= 0) {
+            fprintf(stderr, "Error: Failed to write matrix data.\n");
+            exit(EXIT_FAILURE);
+        }
+        done += (size_t) put;
+    }
+}
+
+
+static void* Pipe_writer(void *arg) {
+    pipe_io_t *io = (pipe_io_t*) arg;
+    size_t row_bytes = (size_t) io->cols * sizeof(double);
+
+    for (int b = 0; b < io->nbands; b++) {
+        pthread_mutex_lock(&io->lock);
+        while (io->pending[b] > 0)
+            pthread_cond_wait(&io->cond, &io->lock);
+        pthread_mutex_unlock(&io->lock);
+
+        int lo = b * io->band_rows, hi = MIN(lo + io->band_rows, io->rows);
+        off_t offset = (off_t)(2 * sizeof(int)) + (off_t) lo * (off_t) row_bytes;
+        if (io->pitch == (size_t) io->cols) {
+            Pipe_pwrite(io->fd, io->A + (size_t) lo * io->pitch, (size_t)(hi - lo) * row_bytes, offset);
+        } else {
+            for (int i = lo; i < hi; i++, offset += (off_t) row_bytes)
+                Pipe_pwrite(io->fd, io->A + (size_t) i * io->pitch, row_bytes, offset);
+        }
+    }
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Pipe_write_start
+ * Purpose:    Create the output file and start a writer that writes each
+ *             band of A once Pipe_row has marked all of its rows. A tiled
+ *             (*.t2d) output is encoded by Pipe_write_finish instead.
+ * In args:    file: the output, A, rows, cols, pitch: the grid the last
+ *             sweep writes into
+ * Out arg:    io: the writer
+ */
+void Pipe_write_start(pipe_io_t *io, char *file, double *A, int rows, int cols, size_t pitch) {
+    memset(io, 0, sizeof(*io));
+    io->file = file;
+    io->A = A;
+    io->rows = rows;
+    io->cols = cols;
+    io->pitch = pitch;
+    io->tiled = Is_tiled_name(file);
+    if (io->tiled)
+        return;
+
+    io->band_rows = MAX(1, PIPE_BAND_BYTES / (int)(cols * sizeof(double)));
+    io->nbands = CEILING(rows, io->band_rows);
+    io->pending = malloc(io->nbands * sizeof(int));
+    // 0666 & ~umask, the mode fopen gives the non-fused writers
+    io->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (io->pending == NULL || io->fd < 0) {
+        fprintf(stderr, "Error: Unable to open file for writing.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int b = 0; b < io->nbands; b++)
+        io->pending[b] = MIN(io->band_rows, rows - b * io->band_rows);
+
+    int dims[2] = { rows, cols };
+    Pipe_pwrite(io->fd, dims, sizeof(dims), 0);
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    if (pthread_create(&io->thread, NULL, Pipe_writer, io) != 0) {
+        fprintf(stderr, "Error: Unable to start the writer thread.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Pipe_write_finish
+ * Purpose:    Wait for the writer to write the last band and close the file
+ */
+void Pipe_write_finish(pipe_io_t *io) {
+    if (io->tiled) {
+        Tiled_write(io->file, io->A, io->rows, io->cols, io->pitch, NULL);
+        return;
+    }
+
+    pthread_join(io->thread, NULL);
+    if (close(io->fd) != 0) {
+        fprintf(stderr, "Error: Failed to write matrix data.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(io->pending);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Pipe_row
+ * Purpose:    Row i of a fused sweep from A into B. Every row 0..rows-1
+ *             must be passed, in any order and from any thread.
+ * In args:    in: the reader when this is the first sweep (else NULL); the
+ *                 row waits for rows up to i+1, and copies the boundary
+ *                 cells into B, which hasn't been initialized
+ *             out: the writer when this is the last sweep (else NULL); the
+ *                  row is marked final once it is computed
+ *             A, B, rows, cols, pitch: the grids, nt: streaming stores
+ */
+void Pipe_row(pipe_io_t *in, pipe_io_t *out, const double *A, double *B, int i,
+              int rows, int cols, size_t pitch, int nt) {
+    const double *mid = A + (size_t) i * pitch;
+    double *dst = B + (size_t) i * pitch;
+
+    if (in != NULL) {
+        int need = MIN(i + 2, rows);
+        if (__atomic_load_n(&in->ready, __ATOMIC_ACQUIRE) < need) {
+            pthread_mutex_lock(&in->lock);
+            while (in->ready < need)
+                pthread_cond_wait(&in->cond, &in->lock);
+            pthread_mutex_unlock(&in->lock);
+        }
+        if (i == 0 || i == rows - 1)
+            memcpy(dst, mid, cols * sizeof(double));
+    }
+
+    if (i > 0 && i < rows - 1) {
+        Stencil_row(mid - pitch, mid, mid + pitch, dst, 1, cols - 1, nt);
+        if (in != NULL) {
+            dst[0] = mid[0];
+            dst[cols - 1] = mid[cols - 1];
+        }
+    }
+
+    if (out != NULL && !out->tiled) {
+        int b = i / out->band_rows;
+        pthread_mutex_lock(&out->lock);
+        if (--out->pending[b] == 0)
+            pthread_cond_broadcast(&out->cond);
+        pthread_mutex_unlock(&out->lock);
+    }
+}
+
+
+/* ---- Live stats page ---- */
+
+/*-------------------------------------------------------------------
+ * Function:   Stats_dir
+ * Purpose:    Directory of the stats pages: $STENCIL_STATS_DIR, else
+ *             /dev/shm when it is writable, else /tmp
+ */
+const char* Stats_dir(void) {
+    char *dir = getenv(STATS_DIR_ENV);
+    if (dir == NULL || *dir == '\0')
+        return access(STATS_DIR, W_OK) == 0 ? STATS_DIR : "/tmp";
+    return dir;
+}
+
+
+static void Stats_path(int pid, char *path, size_t len) {
+    snprintf(path, len, "%s/stencil-%d.stats", Stats_dir(), pid);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Stats_open
+ * Purpose:    Create and map this process's stats page
+ * In args:    backend, input, rows, cols, n: what is running
+ *             rank, size: this rank of size (0 and 1 without MPI)
+ *             job: rank 0's pid, so stencil-top can group the ranks
+ *             nslots: threads (or 1) reporting compute/wait times
+ * Returns:    the page, or NULL when the page is turned off or can't be
+ *             created (the run goes on without it)
+ */
+stats_page_t* Stats_open(const char *backend, const char *input, int rows, int cols, int n,
+                         int rank, int size, int job, int nslots) {
+    char path[4096];
+    char *env = getenv("STENCIL_STATS");
+    if (env != NULL && strcmp(env, "0") == 0)
+        return NULL;
+
+    Stats_path((int) getpid(), path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(stats_page_t)) != 0) {
+        fprintf(stderr, "Warning: Unable to create stats page %s.\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    stats_page_t *s = mmap(NULL, sizeof(stats_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        fprintf(stderr, "Warning: Unable to map stats page %s.\n", path);
+        unlink(path);
+        return NULL;
+    }
+
+    s->pid = (int) getpid();
+    s->job = job;
+    s->rank = rank;
+    s->size = size;
+    s->nslots = MIN(MAX(nslots, 1), STATS_MAX_SLOTS);
+    s->rows = rows;
+    s->cols = cols;
+    s->n = n;
+    snprintf(s->backend, sizeof(s->backend), "%s", backend);
+    snprintf(s->input, sizeof(s->input), "%s", input);
+    if (gethostname(s->host, sizeof(s->host)) != 0)
+        snprintf(s->host, sizeof(s->host), "unknown");
+    s->host[sizeof(s->host) - 1] = '\0';
+    s->residual = -1.0;
+    GET_TIME(s->start);
+    s->updated = s->start;
+    __atomic_store_n(&s->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return s;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Stats_thread
+ * Purpose:    Add one iteration's compute and wait time to a slot; only
+ *             the slot's own thread (or rank) calls this
+ */
+void Stats_thread(stats_page_t *s, int slot, double compute, double wait) {
+    if (s == NULL)
+        return;
+    stats_slot_t *t = &s->slot[slot % STATS_MAX_SLOTS];
+    t->compute += compute;
+    t->wait += wait;
+    __atomic_store_n(&t->iter, t->iter + 1, __ATOMIC_RELEASE);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Stats_iteration
+ * Purpose:    Publish that iteration iter is done, with a fresh residual
+ *             when the last one is older than STATS_RESIDUAL_SECS
+ * In args:    A, B: the new and the previous grid, nrows x cols with the
+ *             given pitch (A NULL: no residual)
+ */
+void Stats_iteration(stats_page_t *s, int iter, const double *A, const double *B,
+                     int nrows, int cols, size_t pitch) {
+    if (s == NULL)
+        return;
+
+    double now, residual = -1.0;
+    GET_TIME(now);
+    if (A != NULL && now - s->measured >= STATS_RESIDUAL_SECS) {
+        residual = 0.0;
+        for (int r = 0; r < nrows; r += STATS_RESIDUAL_STRIDE) {
+            const double *a = A + (size_t) r * pitch, *b = B + (size_t) r * pitch;
+            for (int j = 0; j < cols; j++)
+                residual = MAX(residual, fabs(a[j] - b[j]));
+        }
+    }
+
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->iter = iter;
+    s->updated = now;
+    if (residual >= 0.0) {
+        s->residual = residual;
+        s->measured = now;
+    }
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Stats_close
+ * Purpose:    Mark the run finished and remove its page
+ */
+void Stats_close(stats_page_t *s) {
+    char path[4096];
+    if (s == NULL)
+        return;
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    Stats_path(s->pid, path, sizeof(path));
+    munmap(s, sizeof(stats_page_t));
+    unlink(path);
+}
+
+
+/* ---- In-situ analysis ---- */
+
+/*-------------------------------------------------------------------
+ * Function:   Analysis_open
+ * Purpose:    Parse an analysis spec and set up nacc accumulators
+ * In args:    spec: file,every[,isotherm[,profiles]]
+ *             write: this process writes the time series (rank 0)
+ */
+void Analysis_open(analysis_t *a, char *spec, int rows, int cols, int nacc, int write) {
+    char fname[4096];
+    int fields;
+
+    memset(a, 0, sizeof(*a));
+    a->iso = ANALYSIS_ISO;
+    fields = sscanf(spec, "%4095[^,],%d,%lf,%d", fname, &a->every, &a->iso, &a->profiles);
+    if (fields < 2 || a->every < 1) {
+        fprintf(stderr, "Error: Invalid analysis spec '%s' (want file,every[,isotherm[,profiles]]).\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    a->rows = rows;
+    a->cols = cols;
+    a->nacc = nacc;
+
+    a->acc = calloc(nacc, sizeof(ana_acc_t));
+    if (a->acc == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (a->profiles) {
+        a->row_mean = calloc(rows, sizeof(double));
+        a->row_cross = calloc(rows, sizeof(int));
+        if (a->row_mean == NULL || a->row_cross == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int t = 0; t < nacc; t++) {
+            a->acc[t].cols = calloc(cols, sizeof(double));
+            if (a->acc[t].cols == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (!write)
+        return;
+    a->csv = fopen(fname, "w");
+    if (a->csv == NULL) {
+        fprintf(stderr, "Error: Unable to open analysis file %s for writing.\n", fname);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(a->csv, "iter,min,max,mean,heat,crossings\n");
+    if (a->profiles) {
+        char pname[4200];
+        int dims[2] = { rows, cols };
+        snprintf(pname, sizeof(pname), "%s.prof", fname);
+        a->prof = fopen(pname, "wb");
+        if (a->prof == NULL || fwrite(dims, sizeof(int), 2, a->prof) != 2) {
+            fprintf(stderr, "Error: Unable to open profile file %s for writing.\n", pname);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+int Analysis_due(const analysis_t *a, int iter, int n) {
+    return a != NULL && (iter % a->every == 0 || iter == n);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Analysis_reset
+ * Purpose:    Empty accumulator t before a sampled sweep; only thread t
+ *             calls this
+ */
+void Analysis_reset(analysis_t *a, int t) {
+    ana_acc_t *acc = &a->acc[t];
+    acc->min = INFINITY;
+    acc->max = -INFINITY;
+    acc->sum = 0.0;
+    acc->cross = 0;
+    if (acc->cols != NULL)
+        memset(acc->cols, 0, a->cols * sizeof(double));
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Analysis_fold
+ * Purpose:    Fold an existing row i (boundary rows, and the rows of a
+ *             fused I/O sweep) into accumulator t
+ */
+void Analysis_fold(analysis_t *a, int t, const double *row, int i) {
+    ana_acc_t *acc = &a->acc[t];
+    double lo = acc->min, hi = acc->max, sum = 0.0;
+    long cross = 0;
+
+    for (int j = 0; j < a->cols; j++) {
+        double v = row[j];
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+        sum += v;
+        if (j > 0)
+            cross += (row[j-1] > a->iso) != (v > a->iso);
+    }
+    if (acc->cols != NULL) {
+        for (int j = 0; j < a->cols; j++)
+            acc->cols[j] += row[j];
+        a->row_mean[i] = sum / a->cols;
+        a->row_cross[i] = (int) cross;
+    }
+    acc->min = lo;
+    acc->max = hi;
+    acc->sum += sum;
+    acc->cross += cross;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Stencil_row_analyze
+ * Purpose:    Stencil_row over the interior of row i, folding each new
+ *             value into accumulator t as it is made (the row's two
+ *             boundary cells are folded as well)
+ */
+void Stencil_row_analyze(const double *up, const double *mid, const double *down, double *out,
+                         int i, analysis_t *a, int t) {
+    ana_acc_t *acc = &a->acc[t];
+    double iso = a->iso, prev = out[0];
+    double lo = MIN(acc->min, prev), hi = MAX(acc->max, prev), sum = prev;
+    long cross = 0;
+    int j1 = a->cols - 1;
+
+    for (int j = 1; j < j1; j++) {
+        double v = (up[j-1] + up[j] + up[j+1] + mid[j-1] + mid[j] + mid[j+1] +
+                    down[j-1] + down[j] + down[j+1]) / 9.0;
+        out[j] = v;
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+        sum += v;
+        cross += (prev > iso) != (v > iso);
+        prev = v;
+    }
+    double last = out[j1];
+    lo = MIN(lo, last);
+    hi = MAX(hi, last);
+    sum += last;
+    cross += (prev > iso) != (last > iso);
+
+    // The row was just written, so this pass runs from L1
+    if (acc->cols != NULL) {
+        for (int j = 0; j <= j1; j++)
+            acc->cols[j] += out[j];
+        a->row_mean[i] = sum / a->cols;
+        a->row_cross[i] = (int) cross;
+    }
+    acc->min = lo;
+    acc->max = hi;
+    acc->sum += sum;
+    acc->cross += cross;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Analysis_tree
+ * Purpose:    One level of the tree that combines p accumulators into
+ *             accumulator 0: at stride s, t takes over t + s. Threads call
+ *             this for s = 1, 2, 4, ... < p with a barrier after each level.
+ */
+void Analysis_tree(analysis_t *a, int t, int p, int s) {
+    if (t % (2 * s) != 0 || t + s >= p)
+        return;
+    ana_acc_t *dst = &a->acc[t], *src = &a->acc[t + s];
+    dst->min = MIN(dst->min, src->min);
+    dst->max = MAX(dst->max, src->max);
+    dst->sum += src->sum;
+    dst->cross += src->cross;
+    if (dst->cols != NULL)
+        for (int j = 0; j < a->cols; j++)
+            dst->cols[j] += src->cols[j];
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Analysis_write
+ * Purpose:    Append accumulator 0 (the combined one) as the sample of
+ *             iteration iter, then clear the row profiles for the next
+ */
+void Analysis_write(analysis_t *a, int iter) {
+    ana_acc_t *acc = &a->acc[0];
+    double cells = (double) a->rows * a->cols;
+
+    if (a->csv != NULL)
+        fprintf(a->csv, "%d,%.17g,%.17g,%.17g,%.17g,%ld\n", iter, acc->min, acc->max,
+                acc->sum / cells, acc->sum, acc->cross);
+
+    if (a->prof != NULL) {
+        for (int j = 0; j < a->cols; j++)
+            acc->cols[j] /= a->rows;
+        if (fwrite(&iter, sizeof(int), 1, a->prof) != 1 ||
+            fwrite(a->row_mean, sizeof(double), a->rows, a->prof) != (size_t) a->rows ||
+            fwrite(acc->cols, sizeof(double), a->cols, a->prof) != (size_t) a->cols ||
+            fwrite(a->row_cross, sizeof(int), a->rows, a->prof) != (size_t) a->rows) {
+            fprintf(stderr, "Error: Failed to write analysis profiles.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The MPI reduction sums the row profiles, so rows this rank doesn't own must stay 0
+    if (a->profiles) {
+        memset(a->row_mean, 0, a->rows * sizeof(double));
+        memset(a->row_cross, 0, a->rows * sizeof(int));
+    }
+}
+
+
+void Analysis_close(analysis_t *a) {
+    if (a == NULL)
+        return;
+    if (a->csv != NULL)
+        fclose(a->csv);
+    if (a->prof != NULL)
+        fclose(a->prof);
+    for (int t = 0; t < a->nacc; t++)
+        free(a->acc[t].cols);
+    free(a->acc);
+    free(a->row_mean);
+    free(a->row_cross);
+}
+
+
+/* ---- Energy (RAPL) ---- */
+
+static int Energy_file(const char *dir, const char *file, char *buf, size_t len) {
+    char path[400];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    int ok = fgets(buf, (int) len, f) != NULL;
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+
+static int Energy_joules(const char *dir, const char *file, double *joules) {
+    char buf[64];
+    if (!Energy_file(dir, file, buf, sizeof(buf)))
+        return 0;
+    *joules = strtoull(buf, NULL, 10) * 1e-6;
+    return 1;
+}
+
+
+// Caller holds e->lock
+static void Energy_poll(energy_t *e) {
+    for (int d = 0; d < e->n; d++) {
+        double j;
+        if (!Energy_joules(e->path[d], "energy_uj", &j))
+            continue;
+        double delta = j - e->last[d];
+        if (delta < 0)
+            delta += e->range[d];
+        e->total += delta;
+        e->last[d] = j;
+    }
+}
+
+
+static void* Energy_sampler(void *arg) {
+    energy_t *e = (energy_t*) arg;
+
+    pthread_mutex_lock(&e->lock);
+    while (!e->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += ENERGY_POLL_SECS;
+        pthread_cond_timedwait(&e->cond, &e->lock, &until);
+        Energy_poll(e);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Energy_open
+ * Purpose:    Find the readable RAPL domains and start counting
+ * In args:    reader: 0 for processes that leave the counting to another
+ *             one on their node
+ */
+void Energy_open(energy_t *e, int reader) {
+    memset(e, 0, sizeof(*e));
+    e->reader = reader;
+    if (!reader)
+        return;
+
+    DIR *dir = opendir(ENERGY_ROOT);
+    if (dir == NULL)
+        return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL && e->n < ENERGY_MAX_DOMAINS) {
+        if (strncmp(ent->d_name, "intel-rapl:", 11) != 0)
+            continue;
+
+        // intel-rapl:P is a package, intel-rapl:P:S one of its subdomains
+        char name[64], *path = e->path[e->n];
+        int sub = strchr(ent->d_name + 11, ':') != NULL;
+        snprintf(path, sizeof(e->path[0]), "%s/%s", ENERGY_ROOT, ent->d_name);
+        if (!Energy_file(path, "name", name, sizeof(name)))
+            continue;
+        if (sub ? strcmp(name, "dram") != 0 : strcmp(name, "psys") == 0)
+            continue;
+        if (!Energy_joules(path, "max_energy_range_uj", &e->range[e->n]) ||
+            !Energy_joules(path, "energy_uj", &e->last[e->n]))
+            continue;
+        e->n++;
+    }
+    closedir(dir);
+
+    if (e->n > 0) {
+        pthread_mutex_init(&e->lock, NULL);
+        pthread_cond_init(&e->cond, NULL);
+        pthread_create(&e->sampler, NULL, Energy_sampler, e);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Energy_read
+ * Returns:    joules used since Energy_open, 0 for non-readers, NAN when
+ *             RAPL can't be read
+ */
+double Energy_read(energy_t *e) {
+    if (!e->reader)
+        return 0.0;
+    if (e->n == 0)
+        return NAN;
+
+    pthread_mutex_lock(&e->lock);
+    Energy_poll(e);
+    double total = e->total;
+    pthread_mutex_unlock(&e->lock);
+    return total;
+}
+
+
+void Energy_close(energy_t *e) {
+    if (e->n == 0)
+        return;
+    pthread_mutex_lock(&e->lock);
+    e->stop = 1;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+    pthread_join(e->sampler, NULL);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+    e->n = 0;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Energy_fields
+ * Purpose:    Finish a timing record with its energy columns:
+ *             ,work J,overall J,work W,J per cell update
+ * In args:    updates: cell updates in the work phase
+ */
+void Energy_fields(FILE *f, double work_j, double overall_j, double work_seconds, double updates) {
+    fprintf(f, ",%.3f,%.3f,%.3f,%.4e\n", work_j, overall_j,
+            work_seconds > 0.0 ? work_j / work_seconds : NAN,
+            updates > 0.0 ? work_j / updates : NAN);
+}
+
+
+/* ---- Result cache ---- */
+
+static inline uint64_t Cache_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Cache_open
+ * Purpose:    Parse -c dir[,budget_mb], create the directory and hash the
+ *             input grid (shape and every cell, padding excluded)
+ * In args:    spec, g: the input grid
+ * Out arg:    c
+ */
+void Cache_open(result_cache_t *c, char *spec, const grid_t *g) {
+    long budget_mb = CACHE_BUDGET_MB;
+    char *comma = strchr(spec, ',');
+
+    snprintf(c->dir, sizeof(c->dir), "%.*s", comma ? (int)(comma - spec) : (int) strlen(spec), spec);
+    if (comma != NULL)
+        budget_mb = atol(comma + 1);
+    if (c->dir[0] == '\0' || budget_mb <= 0) {
+        fprintf(stderr, "Error: Expected -c <dir>[,<budget MB>].\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(c->dir, 0755) != 0 && access(c->dir, W_OK) != 0) {
+        fprintf(stderr, "Error: Unable to use cache directory %s.\n", c->dir);
+        exit(EXIT_FAILURE);
+    }
+    c->budget = (off_t) budget_mb << 20;
+    c->rows = g->rows;
+    c->cols = g->cols;
+
+    // Four independent lanes keep the multiplies pipelined
+    uint64_t h[4] = { 1, 2, 3, 4 };
+    for (size_t i = 0; i < (size_t) g->rows; i++) {
+        const uint64_t *row = (const uint64_t*) (g->data + i * g->pitch);
+        size_t j = 0;
+        for (; j + 4 <= (size_t) g->cols; j += 4)
+            for (int l = 0; l < 4; l++)
+                h[l] = ((h[l] << 29 | h[l] >> 35) ^ row[j + l]) * 0x9e3779b97f4a7c15ULL;
+        for (; j < (size_t) g->cols; j++)
+            h[0] = ((h[0] << 29 | h[0] >> 35) ^ row[j]) * 0x9e3779b97f4a7c15ULL;
+    }
+    c->key = Cache_mix(Cache_mix(h[0] ^ Cache_mix(h[1])) ^ Cache_mix(h[2] ^ Cache_mix(h[3])) ^
+                       ((uint64_t) g->rows << 32 | (uint32_t) g->cols));
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Cache_resume
+ * Purpose:    Replace g by the cached grid with the most iterations <= n
+ * In args:    c, n: iterations wanted
+ * In/out:     g: the input grid, or the cached one
+ * Returns:    iterations already done (0 if nothing was cached)
+ */
+int Cache_resume(result_cache_t *c, grid_t *g, int n) {
+    char path[4096], variant[16];
+    unsigned long long key;
+    int k, best = 0;
+
+    DIR *dir = opendir(c->dir);
+    if (dir == NULL)
+        return 0;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (sscanf(e->d_name, "%16llx.%15[^.].%d.t2d", &key, variant, &k) == 3 &&
+            key == c->key && strcmp(variant, CACHE_VARIANT) == 0 && k <= n && k > best)
+            best = k;
+    }
+    closedir(dir);
+    if (best == 0)
+        return 0;
+
+    grid_t cached;
+    snprintf(path, sizeof(path), "%s/%016llx.%s.%d.t2d", c->dir, (unsigned long long) c->key, CACHE_VARIANT, best);
+    Read_grid(path, &cached);
+    if (cached.rows != g->rows || cached.cols != g->cols) {
+        Grid_free(&cached);
+        return 0;
+    }
+    Grid_free(g);
+    *g = cached;
+    utimensat(AT_FDCWD, path, NULL, 0);    // recently used
+    return best;
+}
+
+
+typedef struct {
+    char name[256];
+    off_t bytes;
+    double used;             // mtime, refreshed on every hit
+} cache_file_t;
+
+static int Cache_by_age(const void *a, const void *b) {
+    const cache_file_t *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Cache_evict
+ * Purpose:    Delete the least recently used grids until the cache fits
+ *             its budget
+ */
+static void Cache_evict(result_cache_t *c) {
+    char path[4096], variant[16];
+    unsigned long long key;
+    int k, count = 0, cap = 64;
+    off_t total = 0;
+    cache_file_t *files = malloc(cap * sizeof(cache_file_t));
+
+    DIR *dir = opendir(c->dir);
+    if (dir == NULL || files == NULL) {
+        if (dir != NULL) closedir(dir);
+        free(files);
+        return;
+    }
+    struct dirent *e;
+    struct stat st;
+    while ((e = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", c->dir, e->d_name);
+        if (sscanf(e->d_name, "%16llx.%15[^.].%d.t2d", &key, variant, &k) != 3 || stat(path, &st) != 0)
+            continue;
+        if (count == cap) {
+            cap *= 2;
+            cache_file_t *grown = realloc(files, cap * sizeof(cache_file_t));
+            if (grown == NULL)
+                break;
+            files = grown;
+        }
+        snprintf(files[count].name, sizeof(files[count].name), "%s", e->d_name);
+        files[count].bytes = st.st_size;
+        files[count].used = st.st_mtim.tv_sec + 1e-9 * st.st_mtim.tv_nsec;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    qsort(files, count, sizeof(cache_file_t), Cache_by_age);
+    for (int f = 0; f < count && total > c->budget; f++) {
+        snprintf(path, sizeof(path), "%s/%s", c->dir, files[f].name);
+        if (unlink(path) == 0)
+            total -= files[f].bytes;
+    }
+    free(files);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Cache_checkpoint
+ * Purpose:    Store the grid after k iterations if k is the last iteration
+ *             or a power of two >= CACHE_MIN_CHECKPOINT not cached yet
+ * In args:    c (NULL: caching is off), A, rows, cols, pitch: the grid,
+ *             k: iterations done, n: iterations of the run
+ */
+void Cache_checkpoint(result_cache_t *c, const double *A, int rows, int cols, size_t pitch, int k, int n) {
+    char path[4096], tmp[4200];
+
+    if (c == NULL || k <= 0 || (k != n && (k < CACHE_MIN_CHECKPOINT || (k & (k - 1)) != 0)))
+        return;
+
+    snprintf(path, sizeof(path), "%s/%016llx.%s.%d.t2d", c->dir, (unsigned long long) c->key, CACHE_VARIANT, k);
+    if (access(path, F_OK) == 0)
+        return;
+
+    // Written under a temporary name so other runs never read half a grid
+    snprintf(tmp, sizeof(tmp), "%s/.tmp.%ld.t2d", c->dir, (long) getpid());
+    Tiled_write(tmp, A, rows, cols, pitch, NULL);
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: Unable to store %s in the cache.\n", path);
+        unlink(tmp);
+        return;
+    }
+    Cache_evict(c);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tune_path
+ * Purpose:    Location of a per-host settings file: $var if set, else
+ *             file in the home directory
+ */
+static void Tune_path(const char *var, const char *file, char *path, size_t len) {
+    char *env = getenv(var);
+    char *home = getenv("HOME");
+
+    if (env != NULL && *env != '\0') {
+        snprintf(path, len, "%s", env);
+    } else if (home != NULL) {
+        snprintf(path, len, "%s/%s", home, file);
+    } else {
+        snprintf(path, len, "%s", file);
+    }
+}
+
+
+static void Tune_host(char *host, size_t len) {
+    if (gethostname(host, len) != 0)
+        snprintf(host, len, "unknown");
+    host[len - 1] = '\0';
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tune_read
+ * Purpose:    Read the next entry of the tuning cache, with or without
+ *             the k field
+ * Returns:    1 if an entry was read, 0 at the end of the file
+ */
+static int Tune_read(FILE *f, tune_entry_t *t) {
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%63s %d %d %15s %d %d %d %d %lf", t->host, &t->rows, &t->cols, t->backend,
+                   &t->np, &t->p, &t->nt, &t->k, &t->seconds) == 9)
+            return 1;
+        t->k = 0;
+        if (sscanf(line, "%63s %d %d %15s %d %d %d %lf", t->host, &t->rows, &t->cols, t->backend,
+                   &t->np, &t->p, &t->nt, &t->seconds) == 8)
+            return 1;
+    }
+    return 0;
+}
+
+
+static void Tune_write(FILE *f, const tune_entry_t *t) {
+    fprintf(f, "%s %d %d %s %d %d %d %d %.6f\n", t->host, t->rows, t->cols, t->backend,
+            t->np, t->p, t->nt, t->k, t->seconds);
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tune_lookup
+ * Purpose:    Find the tuned settings of a backend on this host for a
+ *             rows x cols grid: the exact shape if it was tuned, else the
+ *             tuned shape closest in cell count (within TUNE_MAX_RATIO)
+ * In args:    backend: "serial", "pth", "omp", "omp-tasks", "mpi" or
+ *             "hybrid", rows, cols
+ * Out arg:    e: the matching entry
+ * Returns:    1 if an entry was found, 0 if not (or there is no cache)
+ */
+int Tune_lookup(const char *backend, int rows, int cols, tune_entry_t *e) {
+    char path[4096], host[64];
+    tune_entry_t t;
+    double best = log(TUNE_MAX_RATIO);
+    int found = 0;
+
+    Tune_path(TUNE_CACHE_ENV, TUNE_CACHE_FILE, path, sizeof(path));
+    Tune_host(host, sizeof(host));
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+
+    while (Tune_read(f, &t)) {
+        if (strcmp(t.host, host) != 0 || strcmp(t.backend, backend) != 0)
+            continue;
+        double dist = fabs(log(((double) t.rows * t.cols) / ((double) rows * cols)));
+        if (t.rows == rows && t.cols == cols)
+            dist = -1.0;
+        if (dist <= best) {
+            best = dist;
+            *e = t;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Tune_store
+ * Purpose:    Add an entry to the tuning cache, replacing the one for the
+ *             same host, shape and backend; the file is rewritten and
+ *             renamed into place so readers never see half of it
+ * In args:    e: the entry (e->host is filled in here)
+ */
+void Tune_store(const tune_entry_t *e) {
+    char path[4096], tmp[4200];
+    tune_entry_t t, mine = *e;
+
+    Tune_path(TUNE_CACHE_ENV, TUNE_CACHE_FILE, path, sizeof(path));
+    Tune_host(mine.host, sizeof(mine.host));
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Unable to write tuning cache '%s'.\n", tmp);
+        exit(EXIT_FAILURE);
+    }
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        while (Tune_read(in, &t)) {
+            if (strcmp(t.host, mine.host) == 0 && t.rows == mine.rows && t.cols == mine.cols &&
+                strcmp(t.backend, mine.backend) == 0)
+                continue;
+            Tune_write(out, &t);
+        }
+        fclose(in);
+    }
+    Tune_write(out, &mine);
+
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: Unable to write tuning cache '%s'.\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+
+/*-------------------------------------------------------------------
+ * Function:   Roofline_lookup
+ * Purpose:    Find this host's calibration for a thread count: the largest
+ *             calibrated count not above it, else the smallest one
+ * In args:    threads: threads (or ranks x threads) in use on one node
+ * Out arg:    r: the matching entry
+ * Returns:    1 if an entry was found, 0 if the host isn't calibrated
+ */
+int Roofline_lookup(int threads, roofline_t *r) {
+    char path[4096], host[64];
+    roofline_t t;
+    int found = 0;
+
+    Tune_path(ROOFLINE_ENV, ROOFLINE_FILE, path, sizeof(path));
+    Tune_host(host, sizeof(host));
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+
+    while (fscanf(f, "%63s %d %lf %lf", t.host, &t.threads, &t.gbs, &t.gflops) == 4) {
+        if (strcmp(t.host, host) != 0)
+            continue;
+        int better = !found ||
+                     (t.threads <= threads && (r->threads > threads || t.threads > r->threads)) ||
+                     (t.threads > threads && r->threads > threads && t.threads < r->threads);
+        if (better) {
+            *r = t;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Roofline_store
+ * Purpose:    Add a calibration, replacing the one for the same host and
+ *             thread count; rewritten and renamed into place like the
+ *             tuning cache
+ * In args:    r: the entry (r->host is filled in here)
+ */
+void Roofline_store(const roofline_t *r) {
+    char path[4096], tmp[4200];
+    roofline_t t, mine = *r;
+
+    Tune_path(ROOFLINE_ENV, ROOFLINE_FILE, path, sizeof(path));
+    Tune_host(mine.host, sizeof(mine.host));
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Unable to write roofline file '%s'.\n", tmp);
+        exit(EXIT_FAILURE);
+    }
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        while (fscanf(in, "%63s %d %lf %lf", t.host, &t.threads, &t.gbs, &t.gflops) == 4) {
+            if (strcmp(t.host, mine.host) == 0 && t.threads == mine.threads)
+                continue;
+            fprintf(out, "%s %d %.3f %.3f\n", t.host, t.threads, t.gbs, t.gflops);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %d %.3f %.3f\n", mine.host, mine.threads, mine.gbs, mine.gflops);
+
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: Unable to write roofline file '%s'.\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Roofline_report
+ * Purpose:    Print a run's modelled traffic, achieved GB/s and GFLOP/s,
+ *             and its share of the roofline bound, if this host has been
+ *             calibrated (silent otherwise)
+ * In args:    backend: name for the report, cells: interior cells updated
+ *             per sweep, iters: sweeps, seconds: time in the sweeps,
+ *             threads: threads (ranks x threads) per node, nodes: nodes
+ *             used (the calibration is scaled by it), nt: streaming stores
+ */
+void Roofline_report(const char *backend, double cells, int iters, double seconds,
+                     int threads, int nodes, int nt) {
+    roofline_t r;
+    if (!Roofline_lookup(threads, &r) || seconds <= 0.0)
+        return;
+
+    double updates = cells * iters;
+    double bytes = nt ? STENCIL_BYTES_CELL_NT : STENCIL_BYTES_CELL;
+    double gbs = updates * bytes / seconds / 1e9;
+    double gflops = updates * STENCIL_FLOPS_CELL / seconds / 1e9;
+    double ai = STENCIL_FLOPS_CELL / bytes;
+
+    double peak = r.gflops * nodes, bw = r.gbs * nodes;
+    double bound = MIN(peak, ai * bw);
+    printf("roofline %s: %.0f B/cell, %.2f GB/s, %.2f GFLOP/s, AI %.3f flop/B, "
+           "%s bound %.2f GFLOP/s (calibrated at %d threads, x%d nodes), %.1f%% of bound\n",
+           backend, bytes, gbs, gflops, ai, ai * bw < peak ? "memory" : "compute",
+           bound, r.threads, nodes, 100.0 * gflops / bound);
+}
+
+#ifdef MPI_VERSION
+/*-------------------------------------------------------------------
+ * Function:   Rebalance_rows
+ * Purpose:    Redistribute the row slabs in proportion to each rank's
+ *             measured speed and migrate the rows that changed owner
+ * In args:    pitch, pitched_row_type: one local row, work: this rank's
+ *             compute time since the last call, iter: for the report,
+ *             comm: the ranks sharing the grid
+ * In/out:     A, B: this rank's two local buffers (reallocated on a move),
+ *             counts, displs: every rank's row count and first row
+ * Returns:    1 if the slabs moved, 0 if they were kept
+ * Notes:      Slabs stay contiguous and in rank order, so only the rows
+ *             near each boundary move. Rank 0 prints every decision.
+ */
+int Rebalance_rows(double **A, double **B, int *counts, int *displs, size_t pitch,
+                   MPI_Datatype pitched_row_type, double work, int iter, MPI_Comm comm) {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    int rows = displs[size - 1] + counts[size - 1];
+
+    double *times = malloc(size * sizeof(double));
+    int *new_counts = malloc(size * sizeof(int));
+    int *new_displs = malloc(size * sizeof(int));
+    int *sc = malloc(4 * size * sizeof(int));
+    if (times == NULL || new_counts == NULL || new_displs == NULL || sc == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    int *sd = sc + size, *rc = sc + 2 * size, *rd = sc + 3 * size;
+
+    MPI_Allgather(&work, 1, MPI_DOUBLE, times, 1, MPI_DOUBLE, comm);
+
+    double mean = 0.0, worst = 0.0, speed = 0.0;
+    for (int r = 0; r < size; r++) {
+        mean += times[r] / size;
+        worst = MAX(worst, times[r]);
+        speed += counts[r] / MAX(times[r], 1e-9);
+    }
+    double imbalance = mean > 0.0 ? worst / mean : 1.0;
+
+    if (imbalance < REBALANCE_TOL) {
+        if (rank == 0)
+            printf("rebalance iter %d: imbalance %.3f, kept\n", iter, imbalance);
+        free(times); free(new_counts); free(new_displs); free(sc);
+        return 0;
+    }
+
+    // New boundaries at the running share of the total speed, at least one row each
+    double cum = 0.0;
+    int lo = 0;
+    for (int r = 0; r < size; r++) {
+        cum += counts[r] / MAX(times[r], 1e-9);
+        int hi = r == size - 1 ? rows : (int) llround(rows * cum / speed);
+        hi = MAX(hi, lo + 1);
+        hi = MIN(hi, rows - (size - 1 - r));
+        new_displs[r] = lo;
+        new_counts[r] = hi - lo;
+        lo = hi;
+    }
+
+    // Rows I send to r: my old slab meets r's new one; I receive the reverse
+    int old_lo = displs[rank], old_hi = old_lo + counts[rank];
+    int my_lo = new_displs[rank], my_hi = my_lo + new_counts[rank];
+    for (int r = 0; r < size; r++) {
+        int s0 = MAX(old_lo, new_displs[r]), s1 = MIN(old_hi, new_displs[r] + new_counts[r]);
+        int r0 = MAX(my_lo, displs[r]), r1 = MIN(my_hi, displs[r] + counts[r]);
+        sc[r] = MAX(s1 - s0, 0);
+        sd[r] = sc[r] > 0 ? s0 - old_lo : 0;
+        rc[r] = MAX(r1 - r0, 0);
+        rd[r] = rc[r] > 0 ? r0 - my_lo : 0;
+    }
+
+    size_t old_count = (size_t)(counts[rank] + 2) * pitch;
+    size_t new_count = (size_t)(new_counts[rank] + 2) * pitch;
+    double *A2 = Alloc_grid(new_count);
+    double *B2 = Alloc_grid(new_count);
+
+    MPI_Alltoallv(*A + pitch, sc, sd, pitched_row_type, A2 + pitch, rc, rd, pitched_row_type, comm);
+    // Fixed boundary cells are the same in both buffers
+    memcpy(B2, A2, new_count * sizeof(double));
+
+    Free_grid(*A, old_count);
+    Free_grid(*B, old_count);
+    *A = A2;
+    *B = B2;
+
+    if (rank == 0) {
+        printf("rebalance iter %d: imbalance %.3f, rows", iter, imbalance);
+        for (int r = 0; r < size; r++)
+            printf(" %d", new_counts[r]);
+        printf("\n");
+    }
+
+    memcpy(counts, new_counts, size * sizeof(int));
+    memcpy(displs, new_displs, size * sizeof(int));
+    free(times); free(new_counts); free(new_displs); free(sc);
+    return 1;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Energy_node_reader
+ * Purpose:    1 on the lowest rank of each node, which reads RAPL for the
+ *             whole node
+ */
+int Energy_node_reader(MPI_Comm comm) {
+    MPI_Comm node;
+    int node_rank;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_free(&node);
+    return node_rank == 0;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Energy_sum
+ * Returns:    on rank 0, the joules of all nodes (NAN if any node could
+ *             not read RAPL)
+ */
+double Energy_sum(double joules, MPI_Comm comm) {
+    double total = 0.0;
+    MPI_Reduce(&joules, &total, 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+    return total;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Analysis_reduce
+ * Purpose:    Combine every rank's accumulator 0 (and row profiles) into
+ *             rank 0's, with the library's tree reductions
+ */
+void Analysis_reduce(analysis_t *a, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    ana_acc_t *acc = &a->acc[0];
+
+    // Two reductions: min rides along as -max, crossings as an (exact) double
+    double hi[2] = { -acc->min, acc->max }, tot[2] = { acc->sum, (double) acc->cross };
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : hi, hi, 2, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : tot, tot, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+    acc->min = -hi[0];
+    acc->max = hi[1];
+    acc->sum = tot[0];
+    acc->cross = (long) tot[1];
+    if (a->profiles) {
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : acc->cols, acc->cols, a->cols, MPI_DOUBLE, MPI_SUM, 0, comm);
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : a->row_mean, a->row_mean, a->rows, MPI_DOUBLE, MPI_SUM, 0, comm);
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : a->row_cross, a->row_cross, a->rows, MPI_INT, MPI_SUM, 0, comm);
+    }
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Topology_comm
+ * Purpose:    Renumber the ranks so that consecutive ranks, which own
+ *             neighbouring slabs, share a node and, where the library can
+ *             tell (Open MPI), a socket
+ * Out arg:    node_size: number of ranks on this node
+ * Returns:    a 1-D cartesian communicator over all ranks in that order
+ * Notes:      Nodes are numbered by their lowest world rank; inside a node
+ *             ranks are grouped by socket. MPI_Cart_create may reorder
+ *             further if the library knows better.
+ */
+MPI_Comm Topology_comm(int *node_size) {
+    int rank, size, node_rank, leader, inner;
+    MPI_Comm node, ordered, cart;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_size(node, node_size);
+    MPI_Allreduce(&rank, &leader, 1, MPI_INT, MPI_MIN, node);
+
+    // Position inside the node: by socket (its lowest node rank), then node rank
+    inner = node_rank;
+#ifdef OPEN_MPI
+    MPI_Comm socket;
+    int socket_leader;
+    MPI_Comm_split_type(node, OMPI_COMM_TYPE_SOCKET, node_rank, MPI_INFO_NULL, &socket);
+    MPI_Allreduce(&node_rank, &socket_leader, 1, MPI_INT, MPI_MIN, socket);
+    MPI_Comm_free(&socket);
+
+    int order = socket_leader * *node_size + node_rank;
+    int *orders = malloc(*node_size * sizeof(int));
+    MPI_Allgather(&order, 1, MPI_INT, orders, 1, MPI_INT, node);
+    inner = 0;
+    for (int r = 0; r < *node_size; r++)
+        inner += orders[r] < order;
+    free(orders);
+#endif
+    MPI_Comm_free(&node);
+
+    // Node index: how many node leaders come before ours
+    int *leaders = malloc(size * sizeof(int));
+    if (leaders == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Allgather(&leader, 1, MPI_INT, leaders, 1, MPI_INT, MPI_COMM_WORLD);
+    int node_index = 0;
+    for (int r = 0; r < leader; r++)
+        node_index += leaders[r] == r;
+    free(leaders);
+
+    MPI_Comm_split(MPI_COMM_WORLD, 0, node_index * size + inner, &ordered);
+
+    int periods = 0;
+    MPI_Cart_create(ordered, 1, &size, &periods, 1, &cart);
+    MPI_Comm_free(&ordered);
+    return cart;
+}
+
+
+/*-------------------------------------------------------------------
+ * Function:   Topology_report
+ * Purpose:    Print how many halo messages of an iters-long run stay on a
+ *             node and how many cross between nodes
+ * In args:    comm: the ranks in slab order, iters: number of iterations
+ */
+void Topology_report(MPI_Comm comm, int iters) {
+    int rank, size, leader;
+    MPI_Comm node;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Allreduce(&rank, &leader, 1, MPI_INT, MPI_MIN, node);
+    MPI_Comm_free(&node);
+
+    int *leaders = rank == 0 ? malloc(size * sizeof(int)) : NULL;
+    MPI_Gather(&leader, 1, MPI_INT, leaders, 1, MPI_INT, 0, comm);
+    if (rank != 0)
+        return;
+
+    // Each neighbouring pair exchanges one row each way per iteration
+    long long intra = 0, inter = 0;
+    int nodes = 1;
+    for (int r = 0; r + 1 < size; r++) {
+        if (leaders[r] == leaders[r + 1]) {
+            intra += 2LL * iters;
+        } else {
+            inter += 2LL * iters;
+        }
+    }
+    for (int r = 1; r < size; r++)
+        nodes += leaders[r] == r;
+    printf("halo messages: %lld intra-node, %lld inter-node (%d ranks on %d nodes)\n", intra, inter, size, nodes);
+    free(leaders);
+}
+#endif
+
+
+/* Start of Justin's Section */
+
+typedef struct {
+    int thread_id;
+    int num_threads;
+    int n_iters;
+    int rows;
+    int cols;
+    size_t pitch;
+    int nt;
+    double *matrix;
+    double *newMatrix;
+    pthread_barrier_t *barrier;
+    int debug;
+    snapshot_t *snap;
+    int iter0;                  // iterations already done (resumed from the cache)
+    result_cache_t *cache;
+    pipe_io_t *in, *out;        // fused read into the first sweep, write from the last
+    int *next_row;              // shared row counters of the two fused sweeps
+    stats_page_t *stats;
+    analysis_t *ana;            // in-situ analysis, one accumulator per thread
+    int gen;                    // -g: fill the grids before the first sweep
+ } thread_arg_t;
+
+
+
+void* pthread_stencil(void *arg) {
+    thread_arg_t *targs = (thread_arg_t*) arg;
+
+    int id = targs->thread_id;
+    int num_threads = targs->num_threads;
+    int n = targs->n_iters;
+    int rows = targs->rows;
+    int cols = targs->cols;
+    size_t pitch = targs->pitch;
+    double *matrix = targs->matrix;
+    double *newMatrix = targs->newMatrix;
+    pthread_barrier_t *barrier = targs->barrier;
+
+    // Divide rows using provided macros
+    int local_start = BLOCK_LOW(id, num_threads, rows-2) + 1;  // offset by 1 because of boundary
+    int local_end = BLOCK_HIGH(id, num_threads, rows-2) + 1;
+
+    // -g: each thread first touches the rows it sweeps; the first and last
+    // threads also take the boundary rows
+    if (targs->gen) {
+        int lo = id == 0 ? 0 : local_start;
+        int hi = id == num_threads - 1 ? rows : local_end + 1;
+        Gen_rows(matrix + (size_t) lo * pitch, pitch, lo, hi, rows, cols);
+        Gen_rows(newMatrix + (size_t) lo * pitch, pitch, lo, hi, rows, cols);
+        pthread_barrier_wait(barrier);
+    }
+
+    for (int iter = targs->iter0 + 1; iter <= n; iter++) {
+        double t0, t1, t2;
+        GET_TIME(t0);
+        pipe_io_t *pin = iter == targs->iter0 + 1 ? targs->in : NULL;
+        pipe_io_t *pout = iter == n ? targs->out : NULL;
+        analysis_t *ana = targs->ana;
+        int sample = Analysis_due(ana, iter, n);
+        if (sample)
+            Analysis_reset(ana, id);
+        if (pin != NULL || pout != NULL) {
+            // Fused sweep: rows handed out in file order, boundaries included
+            int *next = &targs->next_row[pin != NULL ? 0 : 1];
+            int i;
+            while ((i = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < rows) {
+                Pipe_row(pin, pout, matrix, newMatrix, i, rows, cols, pitch, targs->nt);
+                if (sample)
+                    Analysis_fold(ana, id, newMatrix + (size_t) i * pitch, i);
+            }
+        } else if (sample) {
+            // Analysis folded into the sweep; thread 0 takes the boundary rows
+            if (id == 0) {
+                Analysis_fold(ana, id, newMatrix, 0);
+                Analysis_fold(ana, id, newMatrix + (size_t)(rows - 1) * pitch, rows - 1);
+            }
+            for (size_t i = local_start; i <= (size_t) local_end; i++) {
+                Stencil_row_analyze(matrix + (i-1) * pitch, matrix + i * pitch, matrix + (i+1) * pitch,
+                                    newMatrix + i * pitch, i, ana, id);
+            }
+        } else {
+            for (size_t i = local_start; i <= (size_t) local_end; i++) {
+                Stencil_row(matrix + (i-1) * pitch, matrix + i * pitch, matrix + (i+1) * pitch,
+                            newMatrix + i * pitch, 1, cols - 1, targs->nt);
+            }
+        }
+        GET_TIME(t1);
+
+        pthread_barrier_wait(barrier);
+        GET_TIME(t2);
+        Stats_thread(targs->stats, id, t1 - t0, t2 - t1);
+
+        // Residual of this sweep (newMatrix) against the last (matrix), read
+        // before the swap barrier lets the others start writing newMatrix again
+        if (id == 0)
+            Stats_iteration(targs->stats, iter, newMatrix, matrix, rows, cols, pitch);
+
+        // Combine the accumulators in a tree; thread 0 writes before anyone
+        // can start on the next sample
+        if (sample) {
+            for (int s = 1; s < num_threads; s *= 2) {
+                Analysis_tree(ana, id, num_threads, s);
+                pthread_barrier_wait(barrier);
+            }
+            if (id == 0)
+                Analysis_write(ana, iter);
+        }
+
+            double *temp = targs->matrix;
+            targs->matrix = targs->newMatrix;
+            targs->newMatrix = temp;
+      
+    
+        pthread_barrier_wait(barrier);
+    
+        // update local pointers
+        matrix = targs->matrix;
+        newMatrix = targs->newMatrix;
+
+        // matrix stays read-only until the next swap, so one thread can copy it out
+        if (id == 0) {
+            Snapshot_capture(targs->snap, iter, matrix, pitch, 0, rows);
+            Cache_checkpoint(targs->cache, matrix, rows, cols, pitch, iter, n);
+        }
+            
+        
+    
+    }
+
     return NULL;
-}
\ No newline at end of file
+}
\ No newline at end of file
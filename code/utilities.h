@@ -1,8 +1,430 @@
+// Boundary and initial values of a generated grid
+typedef struct {
+    double left, right, top, bottom, interior;
+} stencil_bc_t;
+#define STENCIL_BC_DEFAULT { 1.0, 1.0, 0.0, 0.0, 0.0 }
+
 // Function protocols
 void Create_stencil(char prompt[], double A[], int m, int n);
+void Fill_stencil_rows(double A[], int row_lo, int row_hi, int m, int n, const stencil_bc_t *bc);
+double* Alloc_grid(size_t count);
+void Free_grid(double *A, size_t count);
 void Read_matrix(char* file_name, double **matrix, int *rows, int *cols);
-void Print_matrix(double* matrix, int rows, int cols);
+void Print_matrix(double* matrix, int rows, int cols, size_t pitch);
 void write_memory_to_file(double *A, int rows, int cols, char *fname);
+double* Map_matrix(char* file_name, int *rows, int *cols, size_t *map_bytes);
+void Unmap_matrix(double *matrix, size_t map_bytes);
+void Read_matrix_dims(char* file_name, int *rows, int *cols);
+void Read_matrix_rows(char* file_name, int row_lo, int row_hi, double *dst, size_t pitch);
+void Read_matrix_window(char* file_name, int r0, int c0, int r1, int c1, double *dst, size_t pitch);
+
+
+#ifndef _GRID_H_
+#define _GRID_H_
+
+/* In-memory grid: rows start GRID_ALIGN-byte aligned, pitch doubles apart.
+ * The pitch is cols rounded up to whole cache lines, plus one more line
+ * when that would be an even number of lines, so the three rows a stencil
+ * reads never map to the same cache sets. Files stay packed (pitch == cols);
+ * Read_grid/Write_grid unpack and pack the padding. */
+#define GRID_ALIGN 64
+#define GRID_LINE  (GRID_ALIGN / (int) sizeof(double))
+
+typedef struct {
+    double *data;
+    int rows, cols;
+    size_t pitch;
+} grid_t;
+
+size_t Grid_pitch(int cols);
+void Grid_alloc(grid_t *g, int rows, int cols);
+void Grid_free(grid_t *g);
+void Read_grid(char *file_name, grid_t *g);
+void Write_grid(const grid_t *g, char *fname);
+void Stencil_row(const double *up, const double *mid, const double *down, double *out,
+                 size_t j0, size_t j1, int nt);
+
+#endif
+
+
+#ifndef _GEN_H_
+#define _GEN_H_
+
+/* Synthetic inputs (-g RxC[/rank]): instead of reading a file made by
+ * make-2d, the drivers build the initial grid in place, every thread or
+ * rank filling (and so first touching) its own rows, with make-2d's
+ * default boundaries. With /rank (or /thread) R is per worker, so the
+ * grid grows with the worker count, for weak scaling. */
+void Gen_parse(const char *spec, int workers, int *rows, int *cols);
+void Gen_rows(double *A, size_t pitch, int row_lo, int row_hi, int rows, int cols);
+
+#endif
+
+
+#ifndef _TILED_H_
+#define _TILED_H_
+
+#include <stdint.h>
+
+/* Tiled grid format (files named *.t2d): the raw format starts with a
+ * positive row count, a tiled file with this negative magic instead.
+ *   ints:   magic, rows, cols, tile_rows, ntiles, 0
+ *   index:  ntiles x { uint64 offset, uint64 bytes }
+ *   tiles:  tile_rows x cols doubles each (the last may be shorter), each
+ *           compressed on its own so threads/ranks can work independently */
+#define TILED_MAGIC       ((int) 0xC0DE7D2D)
+#define TILED_HEADER_INTS 6
+#define TILED_SUFFIX      ".t2d"
+#define TILE_BYTES        (1 << 20)   // target uncompressed tile size
+
+#define TILE_CODEC_RAW    0
+#define TILE_CODEC_XOR    1           // xor-delta + byte shuffle + zero-run RLE
+
+typedef struct {
+    uint64_t offset;
+    uint64_t bytes;
+} tile_entry_t;
+
+int Is_tiled_name(char *fname);
+void Tiled_write(char *fname, const double *A, int rows, int cols, size_t pitch, const stencil_bc_t *bc);
+void Tiled_read_rows(int fd, int rows, int cols, int row_lo, int row_hi, double *dst, size_t pitch);
+
+#endif
+
+
+#ifndef _UPDATE_H_
+#define _UPDATE_H_
+
+/* In-place output update (-u): a raw output file is split into bands of
+ * about UPDATE_BAND_BYTES, and the sidecar <file>.sum keeps a checksum of
+ * every band as last written, plus the file's size and mtime. The next
+ * update pwrites only the bands whose checksum changed. When the sidecar
+ * is missing or doesn't match the file (other shape, or the file was
+ * written by something else since) the whole file is written. */
+#define UPDATE_MAGIC      0x53554d31   /* "SUM1" */
+#define UPDATE_SUFFIX     ".sum"
+#define UPDATE_BAND_BYTES (1 << 20)
+
+typedef struct {
+    int32_t magic, rows, cols, band_rows, nbands, pad;
+    int64_t size, mtime_sec, mtime_nsec;
+} update_header_t;
+
+size_t Update_grid_file(const grid_t *g, char *fname);
+
+#endif
+
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Snapshot stream: fixed-size binary frames of a downsampled region of the
+ * grid, written by a background thread so the sweep never waits on disk. */
+#define SNAP_MAGIC       0x31504e53   /* "SNP1" */
+#define SNAP_HEADER_INTS 12
+#define SNAP_MAX_PENDING 4
+
+typedef struct snap_job {
+    off_t   offset;
+    size_t  bytes;
+    double *data;
+    struct snap_job *next;
+} snap_job_t;
+
+typedef struct {
+    int fd;
+    int every, stride;
+    int r0, c0, r1, c1;            // region of interest, half open
+    int frame_rows, frame_cols;
+    size_t frame_bytes;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    snap_job_t *head, *tail;
+    int pending, done;
+} snapshot_t;
+
+void Snapshot_open(snapshot_t *snap, char *spec, int rows, int cols, int owner);
+void Snapshot_capture(snapshot_t *snap, int iter, double *A, size_t pitch, int g0, int g1);
+void Snapshot_close(snapshot_t *snap);
+
+#endif
+
+
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/* Fused I/O (-F): a reader thread fills the grid a band of rows at a time
+ * while the first sweep consumes the rows it has, and a writer thread
+ * writes each band of the last sweep as soon as all of its rows are final.
+ * Pipe_row does one row of either sweep, including the boundary cells that
+ * would otherwise need a full copy of the grid before the loop. */
+#define PIPE_BAND_BYTES (4 << 20)
+
+typedef struct {
+    char *file;
+    double *A;               // the grid being read, or the one to write
+    int rows, cols;
+    size_t pitch;
+    int band_rows, nbands;
+    int ready;               // reader: rows read so far
+    int *pending;            // writer: rows of each band not final yet
+    int tiled;               // writer: *.t2d output, encoded at the end
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pipe_io_t;
+
+void Pipe_read_start(pipe_io_t *io, char *file, grid_t *g);
+void Pipe_read_finish(pipe_io_t *io);
+void Pipe_write_start(pipe_io_t *io, char *file, double *A, int rows, int cols, size_t pitch);
+void Pipe_write_finish(pipe_io_t *io);
+void Pipe_row(pipe_io_t *in, pipe_io_t *out, const double *A, double *B, int i,
+              int rows, int cols, size_t pitch, int nt);
+
+#endif
+
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/* Live stats page: every driver process maps $STENCIL_STATS_DIR (default
+ * /dev/shm)/stencil-<pid>.stats and updates it each iteration, for
+ * stencil-top to read while the job runs (STENCIL_STATS=0 turns it off).
+ * The header is guarded by a sequence number that is odd while it
+ * changes; each slot (one per thread, or per rank) has a single writer. The
+ * residual, the largest change of a cell over a sample of every
+ * STATS_RESIDUAL_STRIDE-th row, is refreshed at most every
+ * STATS_RESIDUAL_SECS so it costs next to nothing. */
+#define STATS_MAGIC            0x53544e53   /* "SNTS" */
+#define STATS_DIR_ENV          "STENCIL_STATS_DIR"
+#define STATS_DIR              "/dev/shm"
+#define STATS_MAX_SLOTS        256
+#define STATS_RESIDUAL_STRIDE  8
+#define STATS_RESIDUAL_SECS    1.0
+
+typedef struct {
+    uint64_t iter;           // iterations this thread/rank has finished
+    double compute, wait;    // seconds spent computing and waiting
+} stats_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t pid, job;        // job: rank 0's pid, shared by all ranks of a run
+    int32_t rank, size, nslots;
+    int32_t rows, cols, n;
+    char backend[16], host[64], input[256];
+    double start;            // wall clock when the sweeps began
+    uint64_t seq;            // odd while the fields below are changing
+    uint64_t iter;
+    double updated;          // wall clock of the last update
+    double residual;         // < 0 until measured
+    double measured;         // wall clock when the residual was taken
+    int32_t done;
+    stats_slot_t slot[STATS_MAX_SLOTS];
+} stats_page_t;
+
+const char* Stats_dir(void);
+stats_page_t* Stats_open(const char *backend, const char *input, int rows, int cols, int n,
+                         int rank, int size, int job, int nslots);
+void Stats_thread(stats_page_t *s, int slot, double compute, double wait);
+void Stats_iteration(stats_page_t *s, int iter, const double *A, const double *B,
+                     int nrows, int cols, size_t pitch);
+void Stats_close(stats_page_t *s);
+
+#endif
+
+
+#ifndef _ANALYSIS_H_
+#define _ANALYSIS_H_
+
+/* In-situ analysis (-a file,every[,isotherm[,profiles]]): every `every`
+ * iterations, and after the last one, the sweep folds each new value into
+ * per-thread accumulators while it is still in a register. The threads'
+ * (and ranks') accumulators are combined in a tree and rank 0 appends one
+ * line to <file>:
+ *   iter,min,max,mean,heat,crossings
+ * heat is the sum of all cells, crossings counts horizontally adjacent
+ * cells on opposite sides of the isotherm (default 0.5). With profiles=1
+ * it also appends a record to <file>.prof, which starts with ints rows,
+ * cols:
+ *   int iter, double row_mean[rows], double col_mean[cols],
+ *   int row_crossings[rows] */
+#define ANALYSIS_ISO 0.5
+
+typedef struct {
+    double min, max, sum;
+    long cross;
+    double *cols;            // column sums, with profiles
+} ana_acc_t;
+
+typedef struct {
+    FILE *csv, *prof;        // rank 0 only
+    int every, profiles;
+    double iso;
+    int rows, cols;
+    double *row_mean;        // by global row, with profiles
+    int *row_cross;
+    ana_acc_t *acc;          // one per thread
+    int nacc;
+} analysis_t;
+
+void Analysis_open(analysis_t *a, char *spec, int rows, int cols, int nacc, int write);
+int Analysis_due(const analysis_t *a, int iter, int n);
+void Analysis_reset(analysis_t *a, int t);
+void Analysis_fold(analysis_t *a, int t, const double *row, int i);
+void Stencil_row_analyze(const double *up, const double *mid, const double *down, double *out,
+                         int i, analysis_t *a, int t);
+void Analysis_tree(analysis_t *a, int t, int p, int s);
+void Analysis_write(analysis_t *a, int iter);
+void Analysis_close(analysis_t *a);
+
+#endif
+
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+
+/* Result cache (-c dir[,budget_mb]): grids after k iterations, stored as
+ * <dir>/<input hash>.<variant>.<k>.t2d. Every backend computes the same
+ * bits, so they all share one cache. A run resumes from the largest cached
+ * k <= n and stores iteration n plus the powers of two >= CACHE_MIN_CHECKPOINT
+ * it passes; the least recently used grids go when the directory outgrows
+ * the budget. */
+#define CACHE_VARIANT         "9pt"     /* bump when the stencil changes */
+#define CACHE_BUDGET_MB       4096
+#define CACHE_MIN_CHECKPOINT  4
+
+typedef struct {
+    char dir[2048];
+    uint64_t key;            // hash of the input grid
+    off_t budget;            // bytes
+    int rows, cols;
+} result_cache_t;
+
+void Cache_open(result_cache_t *c, char *spec, const grid_t *g);
+int Cache_resume(result_cache_t *c, grid_t *g, int n);
+void Cache_checkpoint(result_cache_t *c, const double *A, int rows, int cols, size_t pitch, int k, int n);
+
+#endif
+
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+/* Tuning cache written by autotune: one line per host, grid shape and
+ * backend with the fastest settings found,
+ *     host rows cols backend np p nt k seconds
+ * in $STENCIL_TUNE_CACHE, or ~/.stencil-tune. k is the blocking factor
+ * (omp-tasks -k), 0 where the backend has none; lines from before it was
+ * stored (8 fields) read as k = 0. */
+#define TUNE_CACHE_ENV  "STENCIL_TUNE_CACHE"
+#define TUNE_CACHE_FILE ".stencil-tune"
+#define TUNE_MAX_RATIO  4.0     /* use a cached shape with up to 4x more/fewer cells */
+
+typedef struct {
+    char host[64];
+    int rows, cols;
+    char backend[16];
+    int np, p, nt, k;
+    double seconds;
+} tune_entry_t;
+
+int Tune_lookup(const char *backend, int rows, int cols, tune_entry_t *e);
+void Tune_store(const tune_entry_t *e);
+
+#endif
+
+#ifndef _ROOFLINE_H_
+#define _ROOFLINE_H_
+
+/* Machine limits measured by roofline: one line per host and thread count,
+ *     host threads triad_GBs peak_GFLOPs
+ * in $STENCIL_ROOFLINE, or ~/.stencil-roofline. When the host has been
+ * calibrated the drivers report how close each run came to the bound. */
+#define ROOFLINE_ENV   "STENCIL_ROOFLINE"
+#define ROOFLINE_FILE  ".stencil-roofline"
+
+/* Model of one cell update: the old cell is read once (the rows above and
+ * below come from cache) and the new one written, which costs a write
+ * allocate too unless it is streamed (-N); 8 adds and a divide. */
+#define STENCIL_FLOPS_CELL     9.0
+#define STENCIL_BYTES_CELL     24.0
+#define STENCIL_BYTES_CELL_NT  16.0
+
+typedef struct {
+    char host[64];
+    int threads;
+    double gbs;              // sustained triad bandwidth
+    double gflops;           // peak FMA throughput
+} roofline_t;
+
+int Roofline_lookup(int threads, roofline_t *r);
+void Roofline_store(const roofline_t *r);
+void Roofline_report(const char *backend, double cells, int iters, double seconds,
+                     int threads, int nodes, int nt);
+
+#endif
+
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+#include <pthread.h>
+
+/* Energy from the RAPL counters in the Linux powercap interface
+ * (intel-rapl:* in ENERGY_ROOT, where AMD packages show up as well): every
+ * package domain plus its DRAM subdomain, psys left out as it overlaps
+ * them. A sampler thread reads the counters every ENERGY_POLL_SECS so a
+ * counter wrapping around (every few minutes at full power) is never
+ * missed. energy_uj is often readable by root only; without RAPL or
+ * without permission the readings are NAN and the CSV columns "nan".
+ * Under MPI one rank per node reads and rank 0 sums the nodes. */
+#define ENERGY_ROOT         "/sys/class/powercap"
+#define ENERGY_MAX_DOMAINS  16
+#define ENERGY_POLL_SECS    5
+
+typedef struct {
+    int reader;                         // 0: this process reports 0 J
+    int n;                              // domains found
+    char path[ENERGY_MAX_DOMAINS][300];
+    double range[ENERGY_MAX_DOMAINS];   // J at which each counter wraps
+    double last[ENERGY_MAX_DOMAINS];    // last reading, J
+    double total;                       // J since Energy_open
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t sampler;
+} energy_t;
+
+void Energy_open(energy_t *e, int reader);
+double Energy_read(energy_t *e);
+void Energy_close(energy_t *e);
+void Energy_fields(FILE *f, double work_j, double overall_j, double work_seconds, double updates);
+
+#endif
+
+#ifdef MPI_VERSION
+/* Row-slab rebalancing for the MPI drivers (-b K): every K iterations the
+ * ranks compare their compute times and move slab boundaries so each rank's
+ * share of the rows follows its measured speed. */
+#define REBALANCE_TOL 1.05     /* max/mean compute time below this: keep the slabs */
+
+int Rebalance_rows(double **A, double **B, int *counts, int *displs, size_t pitch,
+                   MPI_Datatype pitched_row_type, double work, int iter, MPI_Comm comm);
+
+void Analysis_reduce(analysis_t *a, MPI_Comm comm);
+int Energy_node_reader(MPI_Comm comm);
+double Energy_sum(double joules, MPI_Comm comm);
+MPI_Comm Topology_comm(int *node_size);
+void Topology_report(MPI_Comm comm, int iters);
+#endif
 
 
 #ifndef _TIMER_H_
@@ -23,6 +445,7 @@ void write_memory_to_file(double *A, int rows, int cols, char *fname);
 /* For PThreads */
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 #define BLOCK_LOW(id,p,n) ((id)*(n)/(p))
 // given rank = id, give p = # processes (or threads), and given n, number of elements in 1 dimension, it will tell you the
 //starting index
@@ -0,0 +1,70 @@
+#!/bin/bash
+# Weak scaling: every rank (or thread) keeps the same number of rows while
+# the worker count grows, so ideally the time stays flat. Grids are built
+# in memory with -g, so no input file is made or read and nothing is
+# written; T_overall is not polluted by rank 0 reading a file.
+#
+# Usage: ./weak-scaling.bash [backend] [rows per worker] [cols] [iterations] [worker counts...]
+#   backend: mpi (default), hybrid, mpi-tasks, omp or pth; the MPI ones
+#            scale the rank count
+#   e.g.     ./weak-scaling.bash mpi 5000 5000 14 1 2 4 8 16
+#
+# Set MPIRUN to change the launcher (default: mpirun), and THREADS for the
+# hybrid's threads per rank (default: its own choice). Results go to
+# weakScaling.csv: backend, workers, rows, cols, T_overall, T_work and the
+# weak-scaling efficiency T(first)/T(P) of both (first: the first worker
+# count, normally 1).
+
+BACKEND=${1:-mpi}
+R=${2:-5000}
+C=${3:-5000}
+N=${4:-14}
+if [ $# -ge 4 ]; then shift 4; else set --; fi
+P_values=(${@:-1 2 4 8 16})
+MPIRUN=${MPIRUN:-mpirun}
+THREADS=${THREADS:+-p $THREADS}
+
+case $BACKEND in
+    mpi)       TIME_FILE="mpiTime.csv";       PER="rank" ;;
+    hybrid)    TIME_FILE="hybridTime.csv";    PER="rank" ;;
+    mpi-tasks) TIME_FILE="mpiTasksTime.csv";  PER="rank" ;;
+    omp)       TIME_FILE="ompTime.csv";       PER="thread" ;;
+    pth)       TIME_FILE="pthTime.csv";       PER="thread" ;;
+    *)         echo "Unknown backend $BACKEND (mpi, hybrid, mpi-tasks, omp or pth)" >&2; exit 1 ;;
+esac
+
+OUT_FILE="weakScaling.csv"
+[ -f $OUT_FILE ] || echo "Backend, Workers, Rows, Cols, OverallTime, WorkTime, OverallEff, WorkEff" > $OUT_FILE
+
+make -s stencil-2d-$BACKEND || exit 1
+
+printf "%-8s %8s %8s %12s %12s %10s %10s\n" workers rows cols T_overall T_work eff_ovrll eff_work
+T1_OVRLL=""
+T1_WORK=""
+for P in "${P_values[@]}"; do
+    if [ $BACKEND = hybrid ]; then
+        $MPIRUN -np $P ./stencil-2d-hybrid -n $N -g ${R}x${C}/$PER $THREADS > /dev/null || exit 1
+    elif [ $PER = rank ]; then
+        $MPIRUN -np $P ./stencil-2d-$BACKEND -n $N -g ${R}x${C}/$PER > /dev/null || exit 1
+    else
+        ./stencil-2d-$BACKEND -n $N -g ${R}x${C}/$PER -p $P > /dev/null || exit 1
+    fi
+
+    # Columns: iterations, rows, cols, overall, work, diff, workers,
+    # work J, overall J, work W, J per cell update
+    LINE=$(tail -n 1 $TIME_FILE)
+    ROWS=$(echo $LINE | cut -d, -f2)
+    T_OVRLL=$(echo $LINE | cut -d, -f4)
+    T_WORK=$(echo $LINE | cut -d, -f5)
+    if [ -z "$T1_OVRLL" ]; then
+        T1_OVRLL=$T_OVRLL
+        T1_WORK=$T_WORK
+    fi
+    E_OVRLL=$(awk -v a=$T1_OVRLL -v b=$T_OVRLL 'BEGIN { printf "%.3f", a / b }')
+    E_WORK=$(awk -v a=$T1_WORK -v b=$T_WORK 'BEGIN { printf "%.3f", a / b }')
+
+    printf "%-8s %8s %8s %12s %12s %10s %10s\n" $P $ROWS $C $T_OVRLL $T_WORK $E_OVRLL $E_WORK
+    echo "$BACKEND, $P, $ROWS, $C, $T_OVRLL, $T_WORK, $E_OVRLL, $E_WORK" >> $OUT_FILE
+done
+
+echo "Weak scaling complete. Results appended to $OUT_FILE."